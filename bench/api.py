@@ -0,0 +1,57 @@
+"""Minimal client of the llama_cpp_api HTTP API, shared by the benchmark and check scripts."""
+
+import json
+import time
+import urllib.parse
+import urllib.request
+
+
+class Api:
+    def __init__(self, url):
+        self.url = url.rstrip("/")
+
+    def request(self, method, path, body=None, params=None):
+        url = self.url + path
+        if params:
+            url += "?" + urllib.parse.urlencode(params)
+        data = body.encode() if isinstance(body, str) else body
+        req = urllib.request.Request(url, data=data, method=method)
+        with urllib.request.urlopen(req) as res:
+            reply = json.loads(res.read())
+        if "error" in reply:
+            raise RuntimeError(f"{method} {path}: {reply['error']}")
+        return reply
+
+    def post(self, path, body=b"", params=None):
+        return self.request("POST", path, body, params)
+
+    def get(self, path, params=None):
+        return self.request("GET", path, None, params)
+
+    def init(self, prompt):
+        return self.post("/init", prompt)["id"]
+
+    def fork(self, chat_id):
+        return self.post(f"/fork/{chat_id}")["id"]
+
+    def send(self, chat_id, text):
+        self.post(f"/send/{chat_id}", text)
+
+    def configure(self, chat_id, **settings):
+        self.post(f"/config/{chat_id}", "".join(f"{k}={v}\n" for k, v in settings.items()))
+
+    def delete(self, chat_id):
+        self.post(f"/delete/{chat_id}")
+
+    def metrics(self, chat_id):
+        return self.get(f"/metrics/{chat_id}")
+
+    def wait_reply(self, chat_id, poll=0.02):
+        """Reads the chat output until the reply is finished and returns its text."""
+        text = ""
+        while True:
+            update = self.get(f"/update/{chat_id}")
+            text += update["update"]
+            if update["finished"]:
+                return text
+            time.sleep(poll)
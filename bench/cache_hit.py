@@ -0,0 +1,69 @@
+#!/usr/bin/env python3
+"""Compares the time of a reply the response cache misses with the time of the same reply replayed from the cache.
+
+A chat is initialized, then forked for every round, so each fork starts in the same state with the same sampler RNG.
+The first fork generates the reply and records it, the later ones get the same message and replay it in n_batch
+chunks. Every replayed reply must be identical to the generated one.
+
+Start the server with the cache on and a fixed seed, e.g.
+  ./llama_cpp_api -m model.bin -s 42 -n 200 --response-cache 16777216
+"""
+
+import argparse
+import statistics
+import sys
+import time
+
+from api import Api
+
+
+def timed_reply(api, chat, message):
+    start = time.monotonic()
+    api.send(chat, message)
+    reply = api.wait_reply(chat, poll=0.005)
+    return reply, time.monotonic() - start
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--url", default="http://localhost:8880")
+    parser.add_argument("--prompt", default="A dialog between a user and a helpful assistant.\n")
+    parser.add_argument("--message", default="Tell me a story about a lighthouse keeper.\n")
+    parser.add_argument("--hits", type=int, default=10)
+    args = parser.parse_args()
+
+    api = Api(args.url)
+    root = api.init(args.prompt)
+    api.wait_reply(root)
+
+    mismatches = 0
+    hit_times = []
+    try:
+        chat = api.fork(root)
+        try:
+            expected, miss_time = timed_reply(api, chat, args.message)
+        finally:
+            api.delete(chat)
+
+        for _ in range(args.hits):
+            chat = api.fork(root)
+            try:
+                reply, hit_time = timed_reply(api, chat, args.message)
+            finally:
+                api.delete(chat)
+            hit_times.append(hit_time)
+            if reply != expected:
+                mismatches += 1
+                print(f"replayed reply differs\n  generated: {expected!r}\n  replayed:  {reply!r}")
+    finally:
+        api.delete(root)
+
+    hit_time = statistics.median(hit_times)
+    print(f"miss: {miss_time*1000:.1f} ms, hit: {hit_time*1000:.1f} ms (median of {args.hits}), "
+          f"{miss_time/hit_time:.1f}x faster")
+    print(f"{args.hits - mismatches}/{args.hits} replays identical")
+    return 1 if mismatches or hit_time >= miss_time else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,68 @@
+#!/usr/bin/env python3
+"""Measures decode throughput with 1, 4 and 16 chats generating at once, to see how the CPU arbiter shares cores.
+
+A chat is initialized, then for each count it is forked into that many chats, which all get the same message at the
+same time. Reports aggregate tokens per second, the per-chat rate and how many threads chats got per eval.
+
+Start the server with the arbiter on (default) and a fixed reply length, e.g. ./llama_cpp_api -m model.bin -n 128
+"""
+
+import argparse
+import sys
+import threading
+import time
+
+from api import Api
+
+
+def run(api, root, count, message):
+    chats = api.post(f"/fork/{root}", params={"count": count})["ids"]
+    try:
+        sampled = {chat: api.metrics(chat)["tokens_sampled"] for chat in chats}
+
+        def generate(chat):
+            api.send(chat, message)
+            api.wait_reply(chat)
+
+        threads = [threading.Thread(target=generate, args=(chat,)) for chat in chats]
+        start = time.monotonic()
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        elapsed = time.monotonic() - start
+
+        metrics = [api.metrics(chat) for chat in chats]
+        tokens = sum(m["tokens_sampled"] - sampled[chat] for chat, m in zip(chats, metrics))
+        per_chat = sum(m["tokens_per_second"] for m in metrics) / count
+        threads_per_eval = sum(m["cpu_threads"] for m in metrics) / count
+        wait_us = sum(m["cpu_wait_us_per_eval"] for m in metrics) / count
+        print(f"{count:>5} {tokens / elapsed:>12.1f} {per_chat:>12.1f} {threads_per_eval:>8.1f} {wait_us:>10.0f}")
+    finally:
+        for chat in chats:
+            api.delete(chat)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--url", default="http://localhost:8880")
+    parser.add_argument("--prompt", default="A dialog between a user and a helpful assistant.\n")
+    parser.add_argument("--message", default="Write a long poem about the sea.\n")
+    parser.add_argument("--counts", type=int, nargs="+", default=[1, 4, 16])
+    args = parser.parse_args()
+
+    api = Api(args.url)
+    root = api.init(args.prompt)
+    api.wait_reply(root)
+
+    print(f"{'chats':>5} {'total tok/s':>12} {'chat tok/s':>12} {'threads':>8} {'wait us':>10}")
+    try:
+        for count in args.counts:
+            run(api, root, count, args.message)
+    finally:
+        api.delete(root)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
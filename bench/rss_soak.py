@@ -0,0 +1,76 @@
+#!/usr/bin/env python3
+"""Checks that the memory of a chat stays flat over a long conversation.
+
+A chat is initialized and sent many short turns one after another. Its resident set size is sampled from
+/metrics/{id} every --every turns. Growth is measured from --warmup turns on, when the context has filled and rolled
+over at least once. Exits with 1 if the RSS grew by more than --tolerance.
+
+Start the server with short replies, e.g. ./llama_cpp_api -m model.bin -c 512 -n 8
+"""
+
+import argparse
+import json
+import sys
+import time
+import urllib.request
+
+
+def call(url, method, path, body=b""):
+    req = urllib.request.Request(url.rstrip("/") + path, data=body.encode() if isinstance(body, str) else body,
+                                 method=method)
+    with urllib.request.urlopen(req) as res:
+        reply = json.loads(res.read())
+    if "error" in reply:
+        raise RuntimeError(f"{method} {path}: {reply['error']}")
+    return reply
+
+
+def wait_reply(url, chat, poll=0.02):
+    while not call(url, "GET", f"/update/{chat}")["finished"]:
+        time.sleep(poll)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--url", default="http://localhost:8880")
+    parser.add_argument("--prompt", default="A dialog between a user and a helpful assistant.\n")
+    parser.add_argument("--message", default="Say one word.\n")
+    parser.add_argument("--turns", type=int, default=10000)
+    parser.add_argument("--warmup", type=int, default=500)
+    parser.add_argument("--every", type=int, default=500)
+    parser.add_argument("--tolerance", type=float, default=0.02, help="allowed relative RSS growth (default: 0.02)")
+    args = parser.parse_args()
+
+    chat = call(args.url, "POST", "/init", args.prompt)["id"]
+    try:
+        wait_reply(args.url, chat)
+
+        baseline = None
+        start = time.monotonic()
+        print(f"{'turn':>6} {'rss MiB':>10} {'growth':>8} {'turns/s':>8}")
+        for turn in range(1, args.turns + 1):
+            call(args.url, "POST", f"/send/{chat}", args.message)
+            wait_reply(args.url, chat)
+
+            if turn % args.every != 0 and turn != args.warmup:
+                continue
+            rss = call(args.url, "GET", f"/metrics/{chat}")["memory_rss_bytes"]
+            if turn >= args.warmup and baseline is None:
+                baseline = rss
+            growth = (rss - baseline) / baseline if baseline else 0.0
+            print(f"{turn:>6} {rss / 2**20:>10.1f} {growth:>8.2%} {turn / (time.monotonic() - start):>8.1f}")
+    finally:
+        call(args.url, "POST", f"/delete/{chat}")
+
+    if baseline is None:
+        print("not enough turns to pass the warmup")
+        return 1
+    if growth > args.tolerance:
+        print(f"RSS grew by {growth:.2%} after turn {args.warmup}, more than {args.tolerance:.2%}")
+        return 1
+    print("RSS is flat")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
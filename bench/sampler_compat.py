@@ -0,0 +1,57 @@
+#!/usr/bin/env python3
+"""Checks that the partial-selection sampler picks the same tokens as the reference port of llama.cpp's sampler.
+
+A chat is initialized and forked twice, so both forks start with the same context and the same sampler RNG state.
+One fork samples with sampler=fast, the other with sampler=reference, both get the same messages. Every reply must be
+identical. Sampler time per token of each fork is reported at the end.
+
+Start the server with a fixed seed, e.g. ./llama_cpp_api -m model.bin -s 42 -n 64
+"""
+
+import argparse
+import sys
+
+from api import Api
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--url", default="http://localhost:8880")
+    parser.add_argument("--prompt", default="A dialog between a user and a helpful assistant.\n")
+    parser.add_argument("--message", default="Tell me a story about a lighthouse keeper.\n")
+    parser.add_argument("--turns", type=int, default=20)
+    args = parser.parse_args()
+
+    api = Api(args.url)
+    root = api.init(args.prompt)
+    api.wait_reply(root)
+
+    fast, reference = api.fork(root), api.fork(root)
+    api.configure(fast, sampler="fast")
+    api.configure(reference, sampler="reference")
+
+    mismatches = 0
+    try:
+        for turn in range(args.turns):
+            replies = []
+            for chat in (fast, reference):
+                api.send(chat, args.message)
+                replies.append(api.wait_reply(chat))
+            if replies[0] != replies[1]:
+                mismatches += 1
+                print(f"turn {turn}: replies differ\n  fast:      {replies[0]!r}\n  reference: {replies[1]!r}")
+
+        for name, chat in (("fast", fast), ("reference", reference)):
+            metrics = api.metrics(chat)
+            print(f"{name:>9}: {metrics['tokens_sampled']:.0f} tokens, "
+                  f"{metrics['sampler_us_per_token']:.1f} us/token in the sampler")
+    finally:
+        for chat in (fast, reference, root):
+            api.delete(chat)
+
+    print(f"{args.turns - mismatches}/{args.turns} turns identical")
+    return 1 if mismatches else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
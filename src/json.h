@@ -3,15 +3,25 @@
 #ifndef LLAMA_CPP_API_JSON_H
 #define LLAMA_CPP_API_JSON_H
 
+#include <cstdint>
 #include <sstream>
+#include <string>
+#include <vector>
 
 namespace llama_cpp_api
 {
 
 template <typename T>
-void print_json_value(std::ostream& stream, const std::string& name, const T& value)
+struct is_json_array : std::false_type
+{ };
+
+template <typename T>
+struct is_json_array<std::vector<T>> : std::true_type
+{ };
+
+template <typename T>
+void print_json_element(std::ostream& stream, const T& value)
 {
-    stream << "  \"" << name << "\": ";
     if constexpr(std::is_same<typename std::decay<decltype(value)>::type, std::string>::value)
     {
         stream << "\"";
@@ -32,12 +42,32 @@ void print_json_value(std::ostream& stream, const std::string& name, const T& va
         }
         stream << "\"";
     }
+    else if constexpr(is_json_array<typename std::decay<decltype(value)>::type>::value)
+    {
+        stream << "[";
+        for (size_t i = 0; i < value.size(); ++i)
+        {
+            if (i > 0)
+            {
+                stream << ", ";
+            }
+            print_json_element(stream, value[i]);
+        }
+        stream << "]";
+    }
     else
     {
         stream << value;
     }
 }
 
+template <typename T>
+void print_json_value(std::ostream& stream, const std::string& name, const T& value)
+{
+    stream << "  \"" << name << "\": ";
+    print_json_element(stream, value);
+}
+
 template <typename T>
 void print_json_values(std::ostream& stream, const std::string& name, const T& value)
 {
@@ -65,6 +95,220 @@ std::string get_json(Args&&... args)
     return stream.str();
 }
 
+/// Same as get_json, but with names known only at runtime
+template <typename T>
+std::string get_json_object(const std::vector<std::pair<std::string, T>>& values)
+{
+    std::ostringstream stream;
+    stream.precision(15);
+    stream << "{\n";
+    for (size_t i = 0; i < values.size(); ++i)
+    {
+        print_json_value(stream, values[i].first, values[i].second);
+        stream << (i + 1 < values.size() ? ",\n" : "\n");
+    }
+    stream << "}\n";
+
+    return stream.str();
+}
+
+/// Reads a JSON array of strings, such as a request body. Returns false if the text is anything else
+inline bool read_json_string_array(const std::string& text, std::vector<std::string>& values)
+{
+    size_t pos = 0;
+    auto skipSpace = [&]()
+    {
+        while (pos < text.size() && (text[pos] == ' ' || text[pos] == '\t' || text[pos] == '\n' || text[pos] == '\r'))
+        {
+            ++pos;
+        }
+    };
+    auto readHex = [&](uint32_t& code)
+    {
+        if (pos + 4 > text.size())
+        {
+            return false;
+        }
+        code = 0;
+        for (size_t end = pos + 4; pos < end; ++pos)
+        {
+            auto c = text[pos];
+            int digit = c >= '0' && c <= '9' ? c - '0'
+                      : c >= 'a' && c <= 'f' ? c - 'a' + 10
+                      : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+            if (digit < 0)
+            {
+                return false;
+            }
+            code = code * 16 + digit;
+        }
+        return true;
+    };
+    auto appendUtf8 = [](std::string& value, uint32_t code)
+    {
+        if (code < 0x80)
+        {
+            value += static_cast<char>(code);
+        }
+        else if (code < 0x800)
+        {
+            value += static_cast<char>(0xc0 | (code >> 6));
+            value += static_cast<char>(0x80 | (code & 0x3f));
+        }
+        else if (code < 0x10000)
+        {
+            value += static_cast<char>(0xe0 | (code >> 12));
+            value += static_cast<char>(0x80 | ((code >> 6) & 0x3f));
+            value += static_cast<char>(0x80 | (code & 0x3f));
+        }
+        else
+        {
+            value += static_cast<char>(0xf0 | (code >> 18));
+            value += static_cast<char>(0x80 | ((code >> 12) & 0x3f));
+            value += static_cast<char>(0x80 | ((code >> 6) & 0x3f));
+            value += static_cast<char>(0x80 | (code & 0x3f));
+        }
+    };
+    auto readString = [&](std::string& value)
+    {
+        if (pos >= text.size() || text[pos] != '"')
+        {
+            return false;
+        }
+        ++pos;
+        while (pos < text.size() && text[pos] != '"')
+        {
+            auto c = text[pos++];
+            if (static_cast<unsigned char>(c) < 0x20)
+            {
+                return false;
+            }
+            if (c != '\\')
+            {
+                value += c;
+                continue;
+            }
+            if (pos >= text.size())
+            {
+                return false;
+            }
+
+            uint32_t code = 0;
+            switch (text[pos++])
+            {
+            case '"': value += '"'; break;
+            case '\\': value += '\\'; break;
+            case '/': value += '/'; break;
+            case 'b': value += '\b'; break;
+            case 'f': value += '\f'; break;
+            case 'n': value += '\n'; break;
+            case 'r': value += '\r'; break;
+            case 't': value += '\t'; break;
+            case 'u':
+                if (!readHex(code))
+                {
+                    return false;
+                }
+                // characters outside the basic plane come as a surrogate pair
+                if (code >= 0xd800 && code < 0xdc00)
+                {
+                    if (text.compare(pos, 2, "\\u") != 0)
+                    {
+                        return false;
+                    }
+                    pos += 2;
+                    uint32_t low = 0;
+                    if (!readHex(low) || low < 0xdc00 || low >= 0xe000)
+                    {
+                        return false;
+                    }
+                    code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+                }
+                else if (code >= 0xdc00 && code < 0xe000)
+                {
+                    return false;
+                }
+                appendUtf8(value, code);
+                break;
+            default:
+                return false;
+            }
+        }
+        if (pos >= text.size())
+        {
+            return false;
+        }
+        ++pos;
+        return true;
+    };
+
+    values.clear();
+    skipSpace();
+    if (pos >= text.size() || text[pos] != '[')
+    {
+        return false;
+    }
+    ++pos;
+    skipSpace();
+    if (pos < text.size() && text[pos] == ']')
+    {
+        ++pos;
+    }
+    else
+    {
+        while (true)
+        {
+            skipSpace();
+            values.emplace_back();
+            if (!readString(values.back()))
+            {
+                return false;
+            }
+            skipSpace();
+            if (pos < text.size() && text[pos] == ',')
+            {
+                ++pos;
+                continue;
+            }
+            if (pos < text.size() && text[pos] == ']')
+            {
+                ++pos;
+                break;
+            }
+            return false;
+        }
+    }
+    skipSpace();
+    return pos == text.size();
+}
+
+/// Binary data as a JSON string value
+inline std::string get_base64(const std::string& data)
+{
+    static const char kAlphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    std::string result;
+    result.reserve((data.size() + 2) / 3 * 4);
+    for (size_t i = 0; i < data.size(); i += 3)
+    {
+        uint32_t value = static_cast<uint8_t>(data[i]) << 16;
+        if (i + 1 < data.size())
+        {
+            value |= static_cast<uint8_t>(data[i + 1]) << 8;
+        }
+        if (i + 2 < data.size())
+        {
+            value |= static_cast<uint8_t>(data[i + 2]);
+        }
+
+        result += kAlphabet[(value >> 18) & 63];
+        result += kAlphabet[(value >> 12) & 63];
+        result += i + 1 < data.size() ? kAlphabet[(value >> 6) & 63] : '=';
+        result += i + 2 < data.size() ? kAlphabet[value & 63] : '=';
+    }
+    return result;
+}
+
 }
 
 #endif // LLAMA_CPP_API_JSON_H
@@ -1,29 +1,73 @@
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <filesystem>
+#include <functional>
 #include <iostream>
+#include <limits>
+#include <map>
 #include <set>
 #include <sstream>
 #include <mutex>
+#include <thread>
+#include <unistd.h>
 
 #include "libipc/ipc.h"
 #include "cpp-httplib/httplib.h"
 
 #include "json.h"
+#include "params.h"
 #include "model/llama.h"
 #include "model/printer.h"
+#include "model/vocabulary.h"
+#include "process/admission.h"
+#include "process/checkpoint.h"
 #include "process/model_runner.h"
+#include "process/numa.h"
+#include "process/output_ring.h"
+#include "process/response_cache.h"
+#include "process/supervisor.h"
+#include "process/transcript.h"
 
 using namespace llama_cpp_api;
 using namespace std::chrono_literals;
 
+static constexpr int kMaxForkCount = 64;
+static constexpr int kCheckpointAttempts = 3; // times a chat that keeps generating is waited for
 
 int main(int argc, char** argv)
 {
+    ApiParams apiParams;
+    if (!api_params_parse(argc, argv, apiParams))
+    {
+        return 1;
+    }
+
     gpt_params params;
     if (!gpt_params_parse(argc, argv, params))
     {
         return 0;
     }
 
-    auto pModel = create_llama_model(params, "\n\n### Instruction:\n\n", "\n\n### Response:\n\n");
+    auto loadModel = [&]()
+    {
+        return create_llama_model(params, apiParams, "\n\n### Instruction:\n\n", "\n\n### Response:\n\n");
+    };
+
+    // with one node there is a single root, loaded here as usual
+    auto numaNodes = apiParams.numa ? read_numa_nodes(apiParams.numaSimulate) : std::vector<NumaNode>();
+    std::unique_ptr<Model> pModel;
+    if (numaNodes.size() <= 1)
+    {
+        pModel = loadModel();
+    }
+    else if (apiParams.weightsMapping == "mmap")
+    {
+        fprintf(stderr, "warning: mapped model pages are shared by all nodes, use --weights-mapping heap or memfd "
+                        "to give every node its own copy\n");
+    }
 
     std::unordered_map<std::thread::id, int> serverThreadId;
     std::mutex serverThreadIdMutex;
@@ -40,7 +84,8 @@ int main(int argc, char** argv)
         return serverThreadId.at(threadId);
     };
 
-    std::set<int> chatIds;
+    Supervisor supervisor(apiParams.requestTimeoutMs, apiParams.generationTimeoutMs);
+
     struct FindChatIdResult
     {
         int id;
@@ -52,50 +97,1660 @@ int main(int argc, char** argv)
         int id;
         try
         {
-            id = std::stoi(str);
+            id = std::stoi(str);
+        }
+        catch (const std::exception& e)
+        {
+            return FindChatIdResult{0, false, e.what()};
+        }
+        id = supervisor.resolveId(id);
+
+        auto chat = supervisor.findChat(id);
+        if (!chat)
+        {
+            return FindChatIdResult{0, false, "Chat not found"};
+        }
+        if (!chat->alive)
+        {
+            return FindChatIdResult{id, false, "Chat died"};
+        }
+
+        return FindChatIdResult{id, true, ""};
+    };
+
+    MessageBuffer messageBuffer;
+
+    // shared with runners, which refuse to start generating when all slots are taken
+    GenerationSlots generationSlots(apiParams.maxGenerating, apiParams.reservedInteractive);
+    AdmissionQueue admissionQueue(apiParams.queueSize, apiParams.queueTimeoutMs);
+    InitCoalescer initCoalescer(apiParams.initCoalesceMs);
+
+    // runners write their output here, so reading it takes no IPC round trip
+    OutputRings outputRings(apiParams.outputRings, apiParams.outputRingSize, apiParams.viewerTimeoutMs);
+
+    // replies runners have generated, runners look inputs up here before they sample
+    ResponseCache responseCache(apiParams.responseCacheSize, apiParams.responseCacheEntrySize);
+
+    // tokenizes for clients and checks their prompts, without asking a chat
+    Vocabulary vocabulary(params.model);
+
+    // tells clients to back off instead of piling up requests
+    auto rejectRequest = [&](httplib::Response& res, const std::string& message)
+    {
+        res.status = 429;
+        res.set_header("Retry-After", std::to_string(apiParams.retryAfterS));
+        res.set_content(get_json("error", message), "application/json");
+    };
+
+    auto getChatPriority = [&](int id)
+    {
+        return supervisor.findChat(id).value_or(ChatInfo{0, false, eInteractive}).priority;
+    };
+
+    auto releaseOutput = [&](ipc::channel& inputChannel, int senderId, int id)
+    {
+        OutputChunk output;
+        if (outputRings.read(id, OutputRings::kConsumerCursor, output))
+        {
+            return output;
+        }
+
+        // the chat did not get a ring
+        auto request = ModelRunnerReleaseOutputRequest{senderId};
+        request.send(get_channel_name(id), messageBuffer);
+        auto buf = supervisor.receive(inputChannel, {id});
+        auto response = ModelRunnerReleaseOutputResponse::receive(buf.data(), buf.size());
+        output.text.assign(response.data, response.size);
+        output.offset = 0;
+        output.hasMore = response.hasMore;
+        return output;
+    };
+
+    // called after eReady, the end of a reply longer than the ring is still in the runner until the ring is read
+    auto releaseReply = [&](ipc::channel& inputChannel, int senderId, int id)
+    {
+        auto output = releaseOutput(inputChannel, senderId, id);
+        while (output.hasMore)
+        {
+            auto chat = supervisor.findChat(id);
+            if (!chat || !chat->alive)
+            {
+                throw RunnerError(503, "Chat " + std::to_string(id) + " died");
+            }
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            auto more = releaseOutput(inputChannel, senderId, id);
+            output.text += more.text;
+            output.hasMore = more.hasMore;
+        }
+
+        return output.text;
+    };
+
+    auto getChatMetrics = [&](ipc::channel& inputChannel, int senderId, int id)
+    {
+        auto request = ModelRunnerMetricsRequest{senderId};
+        request.send(get_channel_name(id), messageBuffer);
+        auto buf = supervisor.receive(inputChannel, {id});
+        auto response = ModelRunnerMetricsResponse::receive(buf.data(), buf.size());
+
+        ModelMetrics metrics;
+        std::istringstream stream(std::string(response.data, response.size));
+        std::string name;
+        double value;
+        while (stream >> name >> value)
+        {
+            metrics.emplace_back(name, value);
+        }
+
+        return metrics;
+    };
+
+    // saves live chats level by level, so that KV caches of parents are on disk when their children take deltas
+    // against them. Chats of a level are saved in parallel, each by its own runner. Returns the number of chats saved,
+    // chats that could not be saved are added to skipped and their children are saved as if forked from a root
+    auto checkpointChats = [&](const std::string& dir, std::vector<int>& skipped)
+    {
+        auto senderId = getServerThreadId();
+        auto inputChannelName = get_channel_name(senderId);
+        ipc::channel inputChannel(inputChannelName.c_str(), ipc::receiver);
+
+        auto rootIds = supervisor.getRootIds();
+        std::map<int, ChatInfo> chats;
+        for (auto id : supervisor.getChatIds())
+        {
+            auto chat = supervisor.findChat(id);
+            if (chat && chat->alive)
+            {
+                chats[id] = *chat;
+            }
+        }
+
+        // chats whose parent is gone start from their root
+        std::map<int, std::vector<int>> children;
+        std::vector<int> level;
+        for (const auto& [id, chat] : chats)
+        {
+            if (chats.count(chat.parentId))
+            {
+                children[chat.parentId].push_back(id);
+            }
+            else
+            {
+                level.push_back(id);
+            }
+        }
+
+        auto tmpDir = dir + ".tmp";
+        std::filesystem::remove_all(tmpDir);
+        std::filesystem::create_directories(tmpDir);
+
+        std::vector<CheckpointEntry> entries;
+        std::map<int, bool> hasKv;
+        while (!level.empty())
+        {
+            // chats that are generating are saved when they finish, a chat that started generating again before its
+            // turn is waited for once more
+            std::set<int> saved;
+            auto pending = level;
+            for (int attempt = 0; attempt < kCheckpointAttempts && !pending.empty(); ++attempt)
+            {
+                for (auto id : pending)
+                {
+                    auto request = ModelRunnerNotifyWhenReadyRequest{senderId};
+                    request.send(get_channel_name(id), messageBuffer);
+                }
+                for (size_t i = 0; i < pending.size(); ++i)
+                {
+                    supervisor.receive(inputChannel, pending, Supervisor::eGeneration);
+                }
+
+                for (auto id : pending)
+                {
+                    // the delta is taken against the chain of saved KV caches above the chat
+                    std::string data = tmpDir + "\n";
+                    std::vector<int> chain;
+                    for (auto parent = chats[id].parentId; hasKv[parent]; parent = chats[parent].parentId)
+                    {
+                        chain.insert(chain.begin(), parent);
+                    }
+                    for (auto parent : chain)
+                    {
+                        data += std::to_string(parent) + " ";
+                    }
+
+                    auto request = ModelRunnerCheckpointRequest{senderId, data.data(), data.size()};
+                    request.send(get_channel_name(id), messageBuffer);
+                }
+
+                std::vector<int> busy;
+                for (size_t i = 0; i < pending.size(); ++i)
+                {
+                    auto buf = supervisor.receive(inputChannel, pending);
+                    auto response = ModelRunnerCheckpointResponse::receive(buf.data(), buf.size());
+                    std::string result(response.data, response.size);
+                    if (result[0] == 'B') // Busy
+                    {
+                        busy.push_back(response.senderId);
+                    }
+                    else if (result[0] == 'E') // Error
+                    {
+                        std::cerr << "Chat " << response.senderId << " not saved: " << result << std::endl;
+                        skipped.push_back(response.senderId);
+                    }
+                    else
+                    {
+                        hasKv[response.senderId] = result[0] == 'S'; // Success, otherwise Empty
+                        saved.insert(response.senderId);
+                    }
+                }
+                pending = std::move(busy);
+            }
+
+            for (auto id : pending)
+            {
+                std::cerr << "Chat " << id << " not saved, it kept generating" << std::endl;
+                skipped.push_back(id);
+            }
+
+            std::vector<int> next;
+            for (auto id : level)
+            {
+                if (saved.count(id))
+                {
+                    const auto& chat = chats[id];
+                    auto root = std::find(rootIds.begin(), rootIds.end(), chat.rootId);
+                    auto parentSaved = std::any_of(entries.begin(), entries.end(), [&](const auto& entry)
+                    {
+                        return entry.id == chat.parentId;
+                    });
+                    entries.push_back(CheckpointEntry{id, parentSaved ? chat.parentId : -1,
+                                                      root != rootIds.end() ? int(root - rootIds.begin()) : 0,
+                                                      chat.priority});
+                }
+                next.insert(next.end(), children[id].begin(), children[id].end());
+            }
+            level = std::move(next);
+        }
+
+        // the previous checkpoint is replaced only by a complete one
+        write_checkpoint_index(tmpDir, entries);
+        std::filesystem::remove_all(dir);
+        std::filesystem::rename(tmpDir, dir);
+
+        return entries.size();
+    };
+
+    // forks every saved chat from its restored parent, or from a root, and loads its state. The KV delta of a chat is
+    // taken against its parent, which the fork already holds. Chats of a level are restored in parallel
+    auto restoreChats = [&](const std::string& dir)
+    {
+        auto entries = read_checkpoint_index(dir);
+
+        auto senderId = getServerThreadId();
+        auto inputChannelName = get_channel_name(senderId);
+        ipc::channel inputChannel(inputChannelName.c_str(), ipc::receiver);
+
+        auto rootIds = supervisor.getRootIds();
+        std::map<int, int> newIds;
+        std::map<int, int> depths;
+        int maxDepth = 0;
+        for (const auto& entry : entries)
+        {
+            depths[entry.id] = entry.parentId < 0 ? 0 : depths[entry.parentId] + 1;
+            maxDepth = std::max(maxDepth, depths[entry.id]);
+
+            // chats forked meanwhile do not take the old ids
+            supervisor.addAlias(entry.id, -1);
+        }
+
+        size_t restored = 0;
+        for (int depth = 0; depth <= maxDepth; ++depth)
+        {
+            // chats that have the same parent are forked in one pass
+            std::map<int, std::vector<CheckpointEntry>> bySource;
+            for (const auto& entry : entries)
+            {
+                if (depths[entry.id] != depth)
+                {
+                    continue;
+                }
+
+                if (entry.parentId < 0)
+                {
+                    bySource[rootIds[std::min<size_t>(entry.rootIndex, rootIds.size() - 1)]].push_back(entry);
+                }
+                else if (newIds.count(entry.parentId))
+                {
+                    bySource[newIds[entry.parentId]].push_back(entry);
+                }
+                else
+                {
+                    std::cerr << "Chat " << entry.id << " not restored, its parent is missing" << std::endl;
+                }
+            }
+
+            std::vector<int> sources;
+            for (const auto& [source, group] : bySource)
+            {
+                int count = group.size();
+                auto request = ModelRunnerForkManyRequest{senderId, &count};
+                request.send(get_channel_name(source), messageBuffer);
+                sources.push_back(source);
+            }
+
+            std::vector<int> level;
+            for (size_t i = 0; i < sources.size(); ++i)
+            {
+                auto buf = supervisor.receive(inputChannel, sources);
+                auto response = ModelRunnerForkManyResponse::receive(buf.data(), buf.size());
+                const auto& group = bySource[response.senderId];
+
+                auto pIds = reinterpret_cast<const int*>(response.data);
+                for (size_t j = 0; j < response.size / sizeof(int) && j < group.size(); ++j)
+                {
+                    if (!supervisor.addChat(pIds[j], response.senderId))
+                    {
+                        std::cerr << "Chat " << group[j].id << " not restored, its fork was refused" << std::endl;
+                        continue;
+                    }
+                    supervisor.setChatPriority(pIds[j], group[j].priority);
+                    newIds[group[j].id] = pIds[j];
+                    level.push_back(pIds[j]);
+
+                    std::string data = dir + "\n" + std::to_string(group[j].id);
+                    auto request = ModelRunnerRestoreRequest{senderId, data.data(), data.size()};
+                    request.send(get_channel_name(pIds[j]), messageBuffer);
+                }
+            }
+
+            std::vector<int> failed;
+            for (size_t i = 0; i < level.size(); ++i)
+            {
+                auto buf = supervisor.receive(inputChannel, level);
+                auto response = ModelRunnerRestoreResponse::receive(buf.data(), buf.size());
+                std::string result(response.data, response.size);
+                auto id = response.senderId;
+
+                auto oldId = std::find_if(newIds.begin(), newIds.end(), [&](const auto& ids)
+                {
+                    return ids.second == id;
+                })->first;
+                if (result[0] != 'S') // Error
+                {
+                    std::cerr << "Chat " << oldId << " not restored: " << result << std::endl;
+                    failed.push_back(id);
+                    newIds.erase(oldId);
+                    continue;
+                }
+
+                supervisor.addAlias(oldId, id);
+                ++restored;
+            }
+
+            // descendants of failed chats are skipped, as their parent is missing
+            for (auto id : failed)
+            {
+                auto request = ModelRunnerKillRequest{senderId};
+                request.send(get_channel_name(id), messageBuffer);
+                supervisor.receive(inputChannel, {id});
+                supervisor.removeChat(id);
+            }
+        }
+
+        for (const auto& entry : entries)
+        {
+            if (!newIds.count(entry.id))
+            {
+                supervisor.removeAlias(entry.id);
+            }
+        }
+
+        return restored;
+    };
+
+    httplib::Server server;
+
+    /// Returns a list of current chat ids, memory of each chat process and the tree of forks
+    /// Chats that died are listed in dead and left out of memory and the tree, chats that do not reply are left out
+    /// of memory. Pss adds up to the memory actually used, rss counts pages shared copy-on-write with the parent in every chat,
+    /// file_private_dirty shows model weights that were copied because a chat wrote to them
+    server.Get("/chats", [&](const httplib::Request& req, httplib::Response& res)
+    {
+        res.set_header("Access-Control-Allow-Origin", "*");
+
+        auto senderId = getServerThreadId();
+        auto inputChannelName = get_channel_name(senderId);
+        ipc::channel inputChannel(inputChannelName.c_str(), ipc::receiver);
+
+        static const std::vector<std::pair<std::string, std::string>> memoryFields = {
+            {"memory_rss_bytes", "rss"},
+            {"memory_pss_bytes", "pss"},
+            {"memory_shared_bytes", "shared"},
+            {"memory_private_dirty_bytes", "private_dirty"},
+            {"memory_file_private_dirty_bytes", "file_private_dirty"},
+        };
+
+        // root runners hold the model, so they are listed in memory and the tree, but not in ids
+        auto chatIds = supervisor.getChatIds();
+        auto rootIds = supervisor.getRootIds();
+        std::vector<int> processIds = rootIds;
+        std::vector<int> deadIds;
+        std::map<int, std::vector<int>> children;
+        for (auto id : chatIds)
+        {
+            auto chat = supervisor.findChat(id);
+            if (!chat || !chat->alive)
+            {
+                if (chat)
+                {
+                    deadIds.push_back(id);
+                }
+                continue;
+            }
+
+            processIds.push_back(id);
+            auto parent = supervisor.findChat(chat->parentId) ? chat->parentId : chat->rootId;
+            children[parent].push_back(id);
+        }
+
+        std::vector<std::pair<std::string, std::vector<std::pair<std::string, uint64_t>>>> memory;
+        std::vector<std::pair<std::string, uint64_t>> total;
+        for (const auto& field : memoryFields)
+        {
+            total.emplace_back(field.second, 0);
+        }
+        for (auto id : processIds)
+        {
+            // a chat that dies while it is listed does not fail the listing
+            ModelMetrics metrics;
+            try
+            {
+                metrics = getChatMetrics(inputChannel, senderId, id);
+            }
+            catch (const RunnerError& e)
+            {
+                if (e.getStatus() == 503)
+                {
+                    deadIds.push_back(id);
+                }
+                continue;
+            }
+
+            std::vector<std::pair<std::string, uint64_t>> values;
+            for (size_t i = 0; i < memoryFields.size(); ++i)
+            {
+                auto it = std::find_if(metrics.begin(), metrics.end(), [&](const auto& metric)
+                {
+                    return metric.first == memoryFields[i].first;
+                });
+                auto value = it != metrics.end() ? static_cast<uint64_t>(it->second) : 0;
+                values.emplace_back(memoryFields[i].second, value);
+                total[i].second += value;
+            }
+            memory.emplace_back(std::to_string(id), std::move(values));
+        }
+        for (auto& [parent, ids] : children)
+        {
+            ids.erase(std::remove_if(ids.begin(), ids.end(), [&](int id)
+            {
+                return std::find(deadIds.begin(), deadIds.end(), id) != deadIds.end();
+            }), ids.end());
+        }
+
+        auto printObject = [](std::ostream& str, const std::vector<std::pair<std::string, uint64_t>>& values)
+        {
+            str << "{";
+            for (size_t i = 0; i < values.size(); ++i)
+            {
+                str << (i > 0 ? ", " : "") << "\"" << values[i].first << "\": " << values[i].second;
+            }
+            str << "}";
+        };
+
+        std::function<void(std::ostream&, int, const std::string&)> printTree;
+        printTree = [&](std::ostream& str, int id, const std::string& indent)
+        {
+            str << "{\"id\": " << id << ", \"children\": [";
+            auto it = children.find(id);
+            if (it != children.end())
+            {
+                for (size_t i = 0; i < it->second.size(); ++i)
+                {
+                    str << (i > 0 ? "," : "") << "\n" << indent << "  ";
+                    printTree(str, it->second[i], indent + "  ");
+                }
+                str << "\n" << indent;
+            }
+            str << "]}";
+        };
+
+        std::ostringstream str;
+        str << "{\n";
+        str << "  \"ids\": [\n";
+        if (!chatIds.empty())
+        {
+            str << "    " << *chatIds.begin();
+            for (auto it = ++chatIds.begin(); it != chatIds.end(); ++it)
+            {
+                str << ",\n";
+                str << "    " << *it;
+            }
+        }
+        str << "\n  ],\n";
+        str << "  \"dead\": [";
+        for (size_t i = 0; i < deadIds.size(); ++i)
+        {
+            str << (i > 0 ? ", " : "") << deadIds[i];
+        }
+        str << "],\n";
+        str << "  \"memory\": {\n";
+        for (size_t i = 0; i < memory.size(); ++i)
+        {
+            str << "    \"" << memory[i].first << "\": ";
+            printObject(str, memory[i].second);
+            str << (i + 1 < memory.size() ? ",\n" : "\n");
+        }
+        str << "  },\n";
+        str << "  \"total\": ";
+        printObject(str, total);
+        str << ",\n";
+        str << "  \"tree\": ";
+        printTree(str, 0, "  ");
+        if (rootIds.size() > 1)
+        {
+            // roots of the other NUMA nodes
+            str << ",\n";
+            str << "  \"replicas\": [";
+            for (size_t i = 1; i < rootIds.size(); ++i)
+            {
+                str << (i > 1 ? "," : "") << "\n    ";
+                printTree(str, rootIds[i], "    ");
+            }
+            str << "\n  ]";
+        }
+        str << "\n}\n";
+
+        res.set_content(str.str(), "application/json");
+    });
+
+    /// Fork existing chat and returns new chat id
+    /// With ?count=N forks N chats in one pass, each with its own sampler seed, and returns the list of ids
+    server.Post("/fork/([0-9]+)", [&](const httplib::Request& req, httplib::Response &res)
+    {
+        res.set_header("Access-Control-Allow-Origin", "*");
+
+        auto chatId = findChatId(req.matches[1]);
+        if (!chatId.success)
+        {
+            res.set_content(get_json("error", chatId.message), "application/json");
+            return;
+        }
+
+        auto senderId = getServerThreadId();
+        auto inputChannelName = get_channel_name(senderId);
+        auto outputChannelName = get_channel_name(chatId.id);
+        ipc::channel inputChannel(inputChannelName.c_str(), ipc::receiver);
+        ipc::channel outputChannel(outputChannelName.c_str(), ipc::sender);
+
+        if (req.has_param("count"))
+        {
+            int count = 0;
+            try
+            {
+                count = std::stoi(req.get_param_value("count"));
+            }
+            catch (const std::exception& e)
+            {
+                res.set_content(get_json("error", std::string(e.what())), "application/json");
+                return;
+            }
+            if (count < 1 || count > kMaxForkCount)
+            {
+                res.set_content(get_json("error", "count must be in [1, " + std::to_string(kMaxForkCount) + "]"),
+                                "application/json");
+                return;
+            }
+
+            ChatReservation reservation(supervisor, count, apiParams.maxChats);
+            if (!reservation)
+            {
+                rejectRequest(res, "Too many chats");
+                return;
+            }
+
+            auto request = ModelRunnerForkManyRequest{senderId, &count};
+            request.send(outputChannel, messageBuffer);
+            auto buf = supervisor.receive(inputChannel, {chatId.id});
+            auto response = ModelRunnerForkManyResponse::receive(buf.data(), buf.size());
+
+            auto pIds = reinterpret_cast<const int*>(response.data);
+            std::vector<int> ids;
+            for (size_t i = 0; i < response.size / sizeof(int); ++i)
+            {
+                if (supervisor.addChat(pIds[i], chatId.id))
+                {
+                    ids.push_back(pIds[i]);
+                }
+            }
+            reservation.release(count);
+
+            if (ids.empty())
+            {
+                res.set_content(get_json("error", std::string("Fork failed, model might be busy")), "application/json");
+                return;
+            }
+
+            res.set_content(get_json("ids", ids), "application/json");
+            return;
+        }
+
+        ChatReservation reservation(supervisor, 1, apiParams.maxChats);
+        if (!reservation)
+        {
+            rejectRequest(res, "Too many chats");
+            return;
+        }
+
+        auto request = ModelRunnerForkRequest{senderId};
+        request.send(outputChannel, messageBuffer);
+        auto buf = supervisor.receive(inputChannel, {chatId.id});
+        auto response = ModelRunnerForkResponse::receive(buf.data(), buf.size());
+        if (*response.pValue < 0)
+        {
+            res.set_content(get_json("error", std::string("Fork failed, model might be busy")), "application/json");
+        }
+        else if (!supervisor.addChat(*response.pValue, chatId.id))
+        {
+            res.set_content(get_json("error", std::string("Fork failed, try again")), "application/json");
+        }
+        else
+        {
+            res.set_content(get_json("id", *response.pValue), "application/json");
+        }
+    });
+
+    /// Delete chat. With transcripts on, returns the name of its log, which /history reads with ?log= once the chat is
+    /// gone
+    server.Post("/delete/(\\d+)", [&](const httplib::Request& req, httplib::Response &res)
+    {
+        res.set_header("Access-Control-Allow-Origin", "*");
+
+        auto chatId = findChatId(req.matches[1]);
+        auto chat = supervisor.findChat(chatId.id);
+        auto transcript = chat && !apiParams.transcriptDir.empty() ? chat->transcript : std::string();
+        if (!chatId.success && chatId.message == "Chat died")
+        {
+            supervisor.removeChat(chatId.id);
+            res.set_content(get_json("deleted", chatId.id, "transcript", transcript), "application/json");
+            return;
+        }
+        if (!chatId.success)
+        {
+            res.set_content(get_json("error", chatId.message), "application/json");
+            return;
+        }
+
+        auto senderId = getServerThreadId();
+        auto inputChannelName = get_channel_name(senderId);
+        auto outputChannelName = get_channel_name(chatId.id);
+        ipc::channel inputChannel(inputChannelName.c_str(), ipc::receiver);
+        ipc::channel outputChannel(outputChannelName.c_str(), ipc::sender);
+
+        auto request = ModelRunnerKillRequest{senderId};
+        request.send(outputChannel, messageBuffer);
+        auto buf = supervisor.receive(inputChannel, {chatId.id});
+
+        supervisor.removeChat(chatId.id);
+        res.set_content(get_json("deleted", chatId.id, "transcript", transcript), "application/json");
+    });
+
+    // forks a root of the node with the fewest chats, the reservation of the new chat is released. A fork that gets
+    // the old id of a restored chat is killed and forked again, a failed fork throws
+    auto forkRoot = [&](ChatReservation& reservation)
+    {
+        auto rootId = supervisor.getLeastLoadedRoot();
+        auto senderId = getServerThreadId();
+        auto inputChannelName = get_channel_name(senderId);
+        auto outputChannelName = get_channel_name(rootId);
+        ipc::channel inputChannel(inputChannelName.c_str(), ipc::receiver);
+        ipc::channel outputChannel(outputChannelName.c_str(), ipc::sender);
+
+        int id;
+        do
+        {
+            auto request = ModelRunnerForkRequest{senderId};
+            request.send(outputChannel, messageBuffer);
+            auto buf = supervisor.receive(inputChannel, {rootId});
+            id = *ModelRunnerForkResponse::receive(buf.data(), buf.size()).pValue;
+            if (id < 0)
+            {
+                throw RunnerError(503, "Fork failed, model might be busy");
+            }
+        }
+        while (!supervisor.addChat(id, rootId));
+        reservation.release(1);
+        return id;
+    };
+
+    // a chat that is not initialized is of no use
+    auto killChat = [&](int id)
+    {
+        auto senderId = getServerThreadId();
+        auto inputChannelName = get_channel_name(senderId);
+        ipc::channel inputChannel(inputChannelName.c_str(), ipc::receiver);
+
+        auto request = ModelRunnerKillRequest{senderId};
+        request.send(get_channel_name(id), messageBuffer);
+        supervisor.receive(inputChannel, {id});
+        supervisor.removeChat(id);
+    };
+
+    // a forked chat that is killed when the request ends before it is initialized, by an exception as well
+    struct NewChat
+    {
+        std::function<void(int)> kill;
+        int id = -1;
+        bool keep = false;
+
+        ~NewChat()
+        {
+            if (id >= 0 && !keep)
+            {
+                kill(id);
+            }
+        }
+    };
+
+    // forked chats that the request uses and kills when it ends, by an exception as well, except the ones it takes out
+    struct NewChats
+    {
+        std::function<void(int)> kill;
+        std::vector<int> ids;
+
+        ~NewChats()
+        {
+            for (auto id : ids)
+            {
+                kill(id);
+            }
+        }
+    };
+
+    // the runner may have died already, a destructor does not throw
+    auto killNewChat = [&](int id)
+    {
+        try
+        {
+            killChat(id);
+        }
+        catch (...)
+        {
+            supervisor.removeChat(id);
+        }
+    };
+
+    // sends a request with text to chat id and receives the response of the type given, the responses to such
+    // requests all carry the result as text
+    auto sendText = [&](int id, auto request, auto response)
+    {
+        auto inputChannelName = get_channel_name(request.senderId);
+        ipc::channel inputChannel(inputChannelName.c_str(), ipc::receiver);
+
+        request.send(get_channel_name(id), messageBuffer);
+        auto buf = supervisor.receive(inputChannel, {id});
+        response = decltype(response)::receive(buf.data(), buf.size());
+        return std::string(response.data, response.size);
+    };
+
+    // body of /init or /send that is larger than a piece, it is passed to the chat while it arrives, so that the chat
+    // evaluates it during the upload instead of after it
+    struct InputUpload
+    {
+        int id = -1;
+        std::string body;      // arrived and not sent yet
+        bool started = false;  // the chat took the first piece and waits for the rest
+        bool admitted = true;  // the last piece got a generation slot
+        std::string result = "Success";
+        bool tokenized = false; // the body is token ids, which are sent whole
+    };
+
+    // the pieces before the last one take no generation slot, the chat evaluates them while the rest arrives
+    auto sendPiece = [&](InputUpload& upload)
+    {
+        upload.result = sendText(upload.id, ModelRunnerInputPieceRequest{getServerThreadId(), upload.body.data(),
+                                                                         upload.body.size()},
+                                 ModelRunnerInputPieceResponse());
+        upload.started = upload.started || upload.result[0] == 'S';
+        upload.body.clear();
+        return upload.result[0] == 'S';
+    };
+
+    // the rest of the body starts the reply once a generation slot is free, as a body sent whole would
+    auto finishUpload = [&](InputUpload& upload, auto request, auto response)
+    {
+        upload.admitted = admissionQueue.admit(getChatPriority(upload.id), [&]()
+        {
+            upload.result = sendText(upload.id, request, response);
+            return upload.result[0] != 'B'; // Busy
+        });
+    };
+
+    // reads the body, from the first piece on it is sent to the chat, which startUpload returns for the /init that
+    // has no chat yet. Returns false if the upload broke off
+    auto readUpload = [&](const httplib::ContentReader& contentReader, InputUpload& upload, auto startUpload)
+    {
+        return contentReader([&](const char* data, size_t size)
+        {
+            upload.body.append(data, size);
+            if (apiParams.inputPieceSize == 0 || upload.tokenized || upload.body.size() <= apiParams.inputPieceSize)
+            {
+                return true;
+            }
+
+            if (upload.id < 0)
+            {
+                upload.id = startUpload();
+            }
+            return sendPiece(upload);
+        });
+    };
+
+    // a body posted as application/octet-stream is token ids, as /tokenize returns them with format=binary
+    auto isTokenBody = [&](const httplib::Request& req)
+    {
+        return req.get_header_value("Content-Type") == "application/octet-stream";
+    };
+
+    // token ids are checked and prompts that do not fit in the context refused before a chat is forked for them,
+    // returns an error message or empty string
+    auto checkInput = [&](const std::string& body, bool tokenized, bool prompt)
+    {
+        std::vector<int> tokens;
+        if (!tokenized)
+        {
+            if (!prompt)
+            {
+                return std::string();
+            }
+            tokens = vocabulary.tokenize(body, true);
+        }
+        else if (!read_token_ids(body.data(), body.size(), tokens) || tokens.empty())
+        {
+            return std::string("Expected token ids");
+        }
+        else if (!vocabulary.contains(tokens))
+        {
+            return std::string("Token id is not in the vocabulary");
+        }
+
+        // init leaves room for a few tokens
+        if (prompt && static_cast<int>(tokens.size()) > params.n_ctx - 4)
+        {
+            return "Prompt is too long (" + std::to_string(tokens.size()) + " tokens, max " +
+                   std::to_string(params.n_ctx - 4) + ")";
+        }
+        return std::string();
+    };
+
+    // forks a root and initializes the new chat with the prompt, sets initializedId if it succeeded. A chat that
+    // fails to initialize is killed
+    auto initChat = [&](ChatReservation& reservation, const std::string& prompt, bool tokenized,
+                        httplib::Response& res, int& initializedId)
+    {
+        NewChat chat{killNewChat, forkRoot(reservation)};
+
+        std::string result;
+        auto admitted = admissionQueue.admit(getChatPriority(chat.id), [&]()
+        {
+            auto senderId = getServerThreadId();
+            result = tokenized
+                    ? sendText(chat.id, ModelRunnerInitTokensRequest{senderId, prompt.data(), prompt.size()},
+                               ModelRunnerInitTokensResponse())
+                    : sendText(chat.id, ModelRunnerInitRequest{senderId, prompt.data(), prompt.size()},
+                               ModelRunnerInitResponse());
+            return result[0] != 'B'; // Busy
+        });
+
+        if (!admitted)
+        {
+            rejectRequest(res, "Too many chats generating");
+        }
+        else if (result[0] != 'S') // Error
+        {
+            res.set_content(get_json("error", result), "application/json");
+        }
+        else
+        {
+            chat.keep = true;
+            initializedId = chat.id;
+            res.set_content(get_json("id", chat.id), "application/json");
+        }
+    };
+
+    /// Init chat with prompt
+    /// Requests with the prompt of a chat that is being initialized, or was shortly before, wait for its reply and fork
+    /// it, so the prompt is evaluated once. The new chats start with the same reply as unread output.
+    /// A prompt larger than a piece is evaluated while it arrives and is not shared.
+    /// Content-Type application/octet-stream - the prompt is token ids, which are not shared either
+    server.Post("/init", [&](const httplib::Request& req, httplib::Response &res,
+                             const httplib::ContentReader& contentReader)
+    {
+        res.set_header("Access-Control-Allow-Origin", "*");
+
+        ChatReservation reservation(supervisor, 1, apiParams.maxChats);
+        if (!reservation)
+        {
+            rejectRequest(res, "Too many chats");
+            return;
+        }
+
+        InputUpload upload;
+        upload.tokenized = isTokenBody(req);
+        NewChat chat{killNewChat};
+        auto complete = readUpload(contentReader, upload, [&]() { return chat.id = forkRoot(reservation); });
+
+        if (upload.id >= 0)
+        {
+            if (complete && upload.started)
+            {
+                finishUpload(upload, ModelRunnerInitRequest{getServerThreadId(), upload.body.data(),
+                                                            upload.body.size()},
+                             ModelRunnerInitResponse());
+            }
+            chat.keep = complete && upload.admitted && upload.result[0] == 'S';
+
+            if (!upload.admitted)
+            {
+                rejectRequest(res, "Too many chats generating");
+            }
+            else if (upload.result[0] != 'S') // Error
+            {
+                res.set_content(get_json("error", upload.result), "application/json");
+            }
+            else if (complete)
+            {
+                res.set_content(get_json("id", upload.id), "application/json");
+            }
+            return;
+        }
+
+        if (!complete)
+        {
+            return;
+        }
+        const auto& prompt = upload.body;
+
+        auto error = checkInput(prompt, upload.tokenized, true);
+        if (!error.empty())
+        {
+            res.set_content(get_json("error", error), "application/json");
+            return;
+        }
+
+        if (upload.tokenized)
+        {
+            int id = -1;
+            initChat(reservation, prompt, true, res, id);
+            return;
+        }
+
+        // a chat initialized with the same prompt is forked once it has replied, instead of evaluating the prompt again.
+        // A request that waits for it as long as it would wait for a slot initializes its own
+        int sourceId = -1;
+        auto first = initCoalescer.join(prompt, sourceId,
+                                        std::chrono::steady_clock::now() +
+                                        std::chrono::milliseconds(apiParams.queueTimeoutMs));
+        if (sourceId >= 0)
+        {
+            auto senderId = getServerThreadId();
+            auto inputChannelName = get_channel_name(senderId);
+            ipc::channel inputChannel(inputChannelName.c_str(), ipc::receiver);
+
+            int id = -1;
+            try
+            {
+                auto request = ModelRunnerForkInitRequest{senderId};
+                request.send(get_channel_name(sourceId), messageBuffer);
+                auto buf = supervisor.receive(inputChannel, {sourceId}, Supervisor::eGeneration);
+                id = *ModelRunnerForkInitResponse::receive(buf.data(), buf.size()).pValue;
+            }
+            catch (const RunnerError&)
+            {
+                // the chat died, it is not forked
+            }
+
+            if (id >= 0 && supervisor.addChat(id, sourceId))
+            {
+                reservation.release(1);
+                res.set_content(get_json("id", id), "application/json");
+                return;
+            }
+
+            // the chat has moved on or died, this request initializes a chat of its own
+            initCoalescer.forget(prompt, sourceId);
+        }
+
+        // requests waiting for this one initialize their own chats if it fails
+        int id = -1;
+        try
+        {
+            initChat(reservation, prompt, false, res, id);
+        }
+        catch (...)
+        {
+            if (first)
+            {
+                initCoalescer.finish(prompt, -1);
+            }
+            throw;
+        }
+        if (first)
+        {
+            initCoalescer.finish(prompt, id);
+        }
+    });
+
+    /// Send message to chat
+    /// A message larger than a piece is evaluated while it arrives, if the upload breaks off the chat drops it and is
+    /// as before the message.
+    /// Content-Type application/octet-stream - the message is token ids
+    server.Post("/send/(\\d+)", [&](const httplib::Request& req, httplib::Response &res,
+                                    const httplib::ContentReader& contentReader)
+    {
+        res.set_header("Access-Control-Allow-Origin", "*");
+
+        auto chatId = findChatId(req.matches[1]);
+        if (!chatId.success)
+        {
+            res.set_content(get_json("error", chatId.message), "application/json");
+            return;
+        }
+
+        InputUpload upload;
+        upload.id = chatId.id;
+        upload.tokenized = isTokenBody(req);
+        auto complete = readUpload(contentReader, upload, [&]() { return chatId.id; });
+
+        auto senderId = getServerThreadId();
+        if (upload.started)
+        {
+            if (complete)
+            {
+                finishUpload(upload, ModelRunnerReceiveInputRequest{senderId, upload.body.data(), upload.body.size()},
+                             ModelRunnerReceiveInputResponse());
+            }
+
+            // the chat waits for the rest of the message until it drops the pieces, a truncated message is not
+            // replied to
+            if (!complete || upload.result[0] != 'S')
+            {
+                sendText(chatId.id, ModelRunnerAbortInputRequest{senderId}, ModelRunnerAbortInputResponse());
+            }
+            if (!complete)
+            {
+                return;
+            }
+        }
+        else if (!complete)
+        {
+            // nothing was sent before the upload broke off, unless the chat refused the first piece
+            if (upload.result[0] == 'S')
+            {
+                return;
+            }
+        }
+        else if (auto error = checkInput(upload.body, upload.tokenized, false); !error.empty())
+        {
+            upload.result = "Error: " + error;
+        }
+        else
+        {
+            const auto& body = upload.body;
+            upload.admitted = admissionQueue.admit(getChatPriority(chatId.id), [&]()
+            {
+                upload.result = upload.tokenized
+                        ? sendText(chatId.id, ModelRunnerReceiveTokensRequest{senderId, body.data(), body.size()},
+                                   ModelRunnerReceiveTokensResponse())
+                        : sendText(chatId.id, ModelRunnerReceiveInputRequest{senderId, body.data(), body.size()},
+                                   ModelRunnerReceiveInputResponse());
+                return upload.result[0] != 'B'; // Busy
+            });
+        }
+
+        if (!upload.admitted)
+        {
+            rejectRequest(res, "Too many chats generating");
+        }
+        else if (upload.result[0] != 'S') // Error
+        {
+            res.set_content(get_json("error", upload.result), "application/json");
+        }
+        else
+        {
+            res.set_content(get_json("sent", chatId.id), "application/json");
+        }
+    });
+
+    /// Tokens of the text as a chat gets them: mode=prompt - as the prompt of /init, otherwise as a message of /send.
+    /// format=binary - token ids as /init and /send take them with Content-Type application/octet-stream.
+    /// Served by the server from the vocabulary of the model, no chat is involved
+    server.Post("/tokenize", [&](const httplib::Request& req, httplib::Response& res)
+    {
+        res.set_header("Access-Control-Allow-Origin", "*");
+
+        auto tokens = vocabulary.tokenize(req.body, req.get_param_value("mode") == "prompt");
+        if (req.get_param_value("format") == "binary")
+        {
+            res.set_content(write_token_ids(tokens), "application/octet-stream");
+            return;
+        }
+
+        res.set_content(get_json("tokens", tokens, "count", tokens.size(), "context", params.n_ctx),
+                        "application/json");
+    });
+
+    /// Text of token ids, given as decimal numbers separated by anything else, e.g. a JSON array, or with Content-Type
+    /// application/octet-stream as /tokenize returns them with format=binary
+    server.Post("/detokenize", [&](const httplib::Request& req, httplib::Response& res)
+    {
+        res.set_header("Access-Control-Allow-Origin", "*");
+
+        std::vector<int> tokens;
+        bool parsed = true;
+        if (isTokenBody(req))
+        {
+            parsed = read_token_ids(req.body.data(), req.body.size(), tokens);
+        }
+        else
+        {
+            auto text = req.body;
+            std::replace_if(text.begin(), text.end(), [](unsigned char c) { return !std::isdigit(c) && c != '-'; },
+                            ' ');
+            std::istringstream stream(text);
+            int token;
+            while (stream >> token)
+            {
+                tokens.push_back(token);
+            }
+            parsed = stream.eof();
+        }
+
+        if (!parsed)
+        {
+            res.set_content(get_json("error", std::string("Expected token ids")), "application/json");
+            return;
+        }
+        if (!vocabulary.contains(tokens))
+        {
+            res.set_content(get_json("error", std::string("Token id is not in the vocabulary")), "application/json");
+            return;
+        }
+
+        res.set_content(get_json("text", vocabulary.detokenize(tokens)), "application/json");
+    });
+
+    /// Stop calculation in chat
+    server.Post("/stop/(\\d+)", [&](const httplib::Request& req, httplib::Response &res)
+    {
+        res.set_header("Access-Control-Allow-Origin", "*");
+
+        auto chatId = findChatId(req.matches[1]);
+        if (!chatId.success)
+        {
+            res.set_content(get_json("error", chatId.message), "application/json");
+            return;
+        }
+
+        auto senderId = getServerThreadId();
+        auto inputChannelName = get_channel_name(senderId);
+        auto outputChannelName = get_channel_name(chatId.id);
+        ipc::channel inputChannel(inputChannelName.c_str(), ipc::receiver);
+        ipc::channel outputChannel(outputChannelName.c_str(), ipc::sender);
+
+        auto request = ModelRunnerStopModelRequest{senderId};
+        request.send(outputChannel, messageBuffer);
+        auto buf = supervisor.receive(inputChannel, {chatId.id});
+
+        res.set_content(get_json("stopped", chatId.id), "application/json");
+    });
+
+    /// Get new text in chat
+    /// With ?viewer=N the text is read for a viewer registered by /watch, all viewers get the whole output. With
+    /// ?from=offset the text starting at offset is returned, as far as it is still kept; given with a viewer, the
+    /// viewer continues from there. Viewer and offset reads return the offset the next read starts at. Plain reads
+    /// consume the text, output is not held back for a consumer that has not read for the viewer timeout
+    server.Get("/update/(\\d+)", [&](const httplib::Request& req, httplib::Response &res)
+    {
+        res.set_header("Access-Control-Allow-Origin", "*");
+
+        auto chatId = findChatId(req.matches[1]);
+        if (!chatId.success)
+        {
+            res.set_content(get_json("error", chatId.message), "application/json");
+            return;
+        }
+
+        if (req.has_param("viewer") || req.has_param("from"))
+        {
+            int viewer = 0;
+            uint64_t from = 0;
+            try
+            {
+                viewer = req.has_param("viewer") ? std::stoi(req.get_param_value("viewer")) : 0;
+                from = req.has_param("from") ? std::stoull(req.get_param_value("from")) : 0;
+            }
+            catch (const std::exception& e)
+            {
+                res.set_content(get_json("error", std::string(e.what())), "application/json");
+                return;
+            }
+
+            OutputChunk output;
+            bool found;
+            if (viewer > 0)
+            {
+                found = (!req.has_param("from") || outputRings.seekViewer(chatId.id, viewer, from)) &&
+                        outputRings.read(chatId.id, viewer, output);
+            }
+            else
+            {
+                found = outputRings.readFrom(chatId.id, from, output);
+            }
+
+            if (!found)
+            {
+                res.set_content(get_json("error", std::string(viewer > 0 ? "Viewer not found" : "Chat has no output")),
+                                "application/json");
+                return;
+            }
+
+            res.set_content(get_json("update", output.text, "finished", !output.hasMore, "offset", output.offset),
+                            "application/json");
+            return;
+        }
+
+        auto senderId = getServerThreadId();
+        auto inputChannelName = get_channel_name(senderId);
+        ipc::channel inputChannel(inputChannelName.c_str(), ipc::receiver);
+
+        auto output = releaseOutput(inputChannel, senderId, chatId.id);
+
+        res.set_content(get_json("update", output.text, "finished", !output.hasMore), "application/json");
+    });
+
+    /// Register a viewer of chat output, it reads with /update/N?viewer=V and gets all output from the returned offset
+    /// on. Output is kept until every viewer has read it, viewers that stop reading are dropped after a timeout
+    server.Post("/watch/(\\d+)", [&](const httplib::Request& req, httplib::Response& res)
+    {
+        res.set_header("Access-Control-Allow-Origin", "*");
+
+        auto chatId = findChatId(req.matches[1]);
+        if (!chatId.success)
+        {
+            res.set_content(get_json("error", chatId.message), "application/json");
+            return;
+        }
+
+        uint64_t offset = 0;
+        auto viewer = outputRings.addViewer(chatId.id, offset);
+        if (viewer < 0)
+        {
+            res.set_content(get_json("error", std::string("Chat has no output or too many viewers")),
+                            "application/json");
+            return;
+        }
+
+        res.set_content(get_json("viewer", viewer, "offset", offset), "application/json");
+    });
+
+    /// Unregister a viewer
+    server.Post("/unwatch/(\\d+)/(\\d+)", [&](const httplib::Request& req, httplib::Response& res)
+    {
+        res.set_header("Access-Control-Allow-Origin", "*");
+
+        auto chatId = findChatId(req.matches[1]);
+        if (!chatId.success)
+        {
+            res.set_content(get_json("error", chatId.message), "application/json");
+            return;
+        }
+
+        outputRings.removeViewer(chatId.id, std::stoi(req.matches[2]));
+        res.set_content(get_json("unwatched", chatId.id), "application/json");
+    });
+
+    /// Get past inputs and outputs of chat from its transcript
+    /// A chat that is gone is read with ?log=, the name of its log returned by /delete and X-Transcript-Log, as its id
+    /// may belong to another chat by now. ?from=&to= select a range of bytes of the text, or of turns with
+    /// ?unit=turns. The text is sent straight from the mapped logs; ?format=json returns the turns with their token
+    /// ids instead
+    server.Get("/history/(\\d+)", [&](const httplib::Request& req, httplib::Response& res)
+    {
+        res.set_header("Access-Control-Allow-Origin", "*");
+
+        if (apiParams.transcriptDir.empty())
+        {
+            res.set_content(get_json("error", std::string("Transcripts are off")), "application/json");
+            return;
+        }
+
+        std::string name;
+        if (req.has_param("log"))
+        {
+            // only a log of this chat, so that the name cannot point outside the dir
+            name = req.get_param_value("log");
+            if (name.compare(0, req.matches[1].length() + 1, std::string(req.matches[1]) + "-") != 0 ||
+                name.find('/') != std::string::npos)
+            {
+                res.set_content(get_json("error", std::string("Not a log of this chat")), "application/json");
+                return;
+            }
+        }
+        else
+        {
+            std::optional<ChatInfo> chat;
+            try
+            {
+                chat = supervisor.findChat(supervisor.resolveId(std::stoi(req.matches[1])));
+            }
+            catch (const std::exception&)
+            {
+                // an id out of range is not a chat
+            }
+            if (!chat)
+            {
+                res.set_content(get_json("error", std::string("Chat not found, a deleted chat is read with ?log=")),
+                                "application/json");
+                return;
+            }
+            name = chat->transcript;
+        }
+
+        std::shared_ptr<TranscriptReader> pReader;
+        uint64_t from = 0, to = UINT64_MAX;
+        try
+        {
+            pReader = std::make_shared<TranscriptReader>(apiParams.transcriptDir, name);
+            if (req.has_param("from"))
+            {
+                from = std::stoull(req.get_param_value("from"));
+            }
+            if (req.has_param("to"))
+            {
+                to = std::stoull(req.get_param_value("to"));
+            }
+        }
+        catch (const std::exception& e)
+        {
+            res.set_content(get_json("error", std::string(e.what())), "application/json");
+            return;
+        }
+
+        auto byTurns = req.get_param_value("unit") == "turns";
+        auto nTurns = pReader->getTurnCount();
+        if (byTurns)
+        {
+            from = std::min<uint64_t>(from, nTurns);
+            to = std::max(from, std::min<uint64_t>(to, nTurns));
+        }
+        else
+        {
+            from = std::min(from, pReader->getSize());
+            to = std::max(from, std::min(to, pReader->getSize()));
+        }
+
+        res.set_header("X-Transcript-Log", name);
+        res.set_header("X-Transcript-Size", std::to_string(pReader->getSize()));
+        res.set_header("X-Transcript-Turns", std::to_string(nTurns));
+
+        if (req.get_param_value("format") == "json")
+        {
+            if (!byTurns)
+            {
+                std::string text;
+                pReader->writeText(from, to, [&](const char* data, size_t size)
+                {
+                    text.append(data, size);
+                    return true;
+                });
+                res.set_content(get_json("text", text, "from", from, "to", to), "application/json");
+                return;
+            }
+
+            std::vector<std::string> inputs, outputs;
+            std::vector<std::vector<int>> inputTokens, outputTokens;
+            size_t turn = 0;
+            for (const auto& record : pReader->getRecords())
+            {
+                if (turn >= to)
+                {
+                    break;
+                }
+                if (turn < from)
+                {
+                    turn += record.type == eTranscriptTurn;
+                    continue;
+                }
+
+                if (inputs.size() <= turn - from)
+                {
+                    inputs.emplace_back();
+                    outputs.emplace_back();
+                    inputTokens.emplace_back();
+                    outputTokens.emplace_back();
+                }
+
+                if (record.type == eTranscriptInput)
+                {
+                    inputs.back().append(record.data, record.size);
+                }
+                else if (record.type == eTranscriptOutput)
+                {
+                    outputs.back().append(record.data, record.size);
+                }
+                else if (record.type == eTranscriptTurn && record.size >= 2 * sizeof(uint32_t))
+                {
+                    uint32_t nInput, nOutput;
+                    std::memcpy(&nInput, record.data, sizeof(nInput));
+                    std::memcpy(&nOutput, record.data + sizeof(nInput), sizeof(nOutput));
+                    if (record.size == 2 * sizeof(uint32_t) + (nInput + nOutput) * sizeof(int))
+                    {
+                        auto pTokens = reinterpret_cast<const int*>(record.data + 2 * sizeof(uint32_t));
+                        inputTokens.back().assign(pTokens, pTokens + nInput);
+                        outputTokens.back().assign(pTokens + nInput, pTokens + nInput + nOutput);
+                    }
+                    ++turn;
+                }
+            }
+
+            res.set_content(get_json("from", from, "inputs", inputs, "outputs", outputs, "input_tokens", inputTokens,
+                                     "output_tokens", outputTokens), "application/json");
+            return;
+        }
+
+        if (byTurns)
+        {
+            from = pReader->getTurnOffset(from);
+            to = pReader->getTurnOffset(to);
+        }
+
+        res.set_header("X-Transcript-From", std::to_string(from));
+        res.set_content_provider(to - from, "text/plain", [pReader, from](size_t offset, size_t length,
+                                                                          httplib::DataSink& sink)
+        {
+            return pReader->writeText(from + offset, from + offset + length, [&](const char* data, size_t size)
+            {
+                return sink.write(data, size);
+            });
+        });
+    });
+
+    /// Send message to chat, wait for response and return it
+    server.Post("/interact/(\\d+)", [&](const httplib::Request& req, httplib::Response& res)
+    {
+        res.set_header("Access-Control-Allow-Origin", "*");
+
+        auto chatId = findChatId(req.matches[1]);
+        if (!chatId.success)
+        {
+            res.set_content(get_json("error", chatId.message), "application/json");
+            return;
+        }
+
+        auto senderId = getServerThreadId();
+        auto inputChannelName = get_channel_name(senderId);
+        auto outputChannelName = get_channel_name(chatId.id);
+        ipc::channel inputChannel(inputChannelName.c_str(), ipc::receiver);
+        ipc::channel outputChannel(outputChannelName.c_str(), ipc::sender);
+
+        // send message
+        {
+            std::string result;
+            auto admitted = admissionQueue.admit(getChatPriority(chatId.id), [&]()
+            {
+                auto request = ModelRunnerReceiveInputRequest{senderId, req.body.data(), req.body.size()};
+                request.send(outputChannel, messageBuffer);
+                auto buf = supervisor.receive(inputChannel, {chatId.id});
+                auto response = ModelRunnerReceiveInputResponse::receive(buf.data(), buf.size());
+                result.assign(response.data, response.size);
+                return result[0] != 'B'; // Busy
+            });
+
+            if (!admitted)
+            {
+                rejectRequest(res, "Too many chats generating");
+                return;
+            }
+            if (result[0] != 'S') // Error
+            {
+                res.set_content(get_json("error", result), "application/json");
+                return;
+            }
+        }
+
+        // wait until done
+        {
+            auto request = ModelRunnerNotifyWhenReadyRequest{senderId};
+            request.send(outputChannel, messageBuffer);
+            supervisor.receive(inputChannel, {chatId.id}, Supervisor::eGeneration);
+        }
+
+        // get reply from model
+        res.set_content(get_json("reply", releaseReply(inputChannel, senderId, chatId.id)), "application/json");
+    });
+
+    /// Fork chat N times, send the same message to every fork and wait for all replies
+    /// Returns the best reply (or all replies with ?return=all), the chat of the best reply is kept and the others are
+    /// deleted. ?select=mean - the best reply has the highest log-probability per token (default), select=total - the
+    /// highest cumulative log-probability, which favours short replies
+    server.Post("/sample/(\\d+)", [&](const httplib::Request& req, httplib::Response& res)
+    {
+        res.set_header("Access-Control-Allow-Origin", "*");
+
+        auto chatId = findChatId(req.matches[1]);
+        if (!chatId.success)
+        {
+            res.set_content(get_json("error", chatId.message), "application/json");
+            return;
+        }
+
+        int count = 0;
+        try
+        {
+            count = std::stoi(req.get_param_value("n"));
+        }
+        catch (const std::exception& e)
+        {
+            res.set_content(get_json("error", std::string(e.what())), "application/json");
+            return;
+        }
+        if (count < 1 || count > kMaxForkCount)
+        {
+            res.set_content(get_json("error", "n must be in [1, " + std::to_string(kMaxForkCount) + "]"),
+                            "application/json");
+            return;
         }
-        catch (const std::exception& e)
+        auto returnAll = req.get_param_value("return") == "all";
+        auto select = req.has_param("select") ? req.get_param_value("select") : std::string("mean");
+        if (select != "mean" && select != "total")
         {
-            return FindChatIdResult{0, false, e.what()};
+            res.set_content(get_json("error", std::string("select must be mean or total")), "application/json");
+            return;
         }
 
-        if (chatIds.find(id) == chatIds.end())
+        auto senderId = getServerThreadId();
+        auto inputChannelName = get_channel_name(senderId);
+        ipc::channel inputChannel(inputChannelName.c_str(), ipc::receiver);
+
+        // fork candidates
+        ChatReservation reservation(supervisor, count, apiParams.maxChats);
+        if (!reservation)
         {
-            return FindChatIdResult{0, false, "Chat not found"};
+            rejectRequest(res, "Too many chats");
+            return;
         }
 
-        return FindChatIdResult{id, true, ""};
-    };
+        // candidates are killed however the request ends, but the best one
+        NewChats candidates{killNewChat};
+        {
+            auto request = ModelRunnerForkManyRequest{senderId, &count};
+            request.send(get_channel_name(chatId.id), messageBuffer);
+            auto buf = supervisor.receive(inputChannel, {chatId.id});
+            auto response = ModelRunnerForkManyResponse::receive(buf.data(), buf.size());
 
-    MessageBuffer messageBuffer;
+            auto pIds = reinterpret_cast<const int*>(response.data);
+            for (size_t i = 0; i < response.size / sizeof(int); ++i)
+            {
+                if (supervisor.addChat(pIds[i], chatId.id))
+                {
+                    candidates.ids.push_back(pIds[i]);
+                }
+            }
+            reservation.release(count);
 
-    httplib::Server server;
+            if (candidates.ids.empty())
+            {
+                res.set_content(get_json("error", std::string("Fork failed, model might be busy")), "application/json");
+                return;
+            }
+        }
+        const auto ids = candidates.ids;
 
-    /// Returns a list of current chat ids
-    server.Get("/chats", [&](const httplib::Request& req, httplib::Response& res)
-    {
-        res.set_header("Access-Control-Allow-Origin", "*");
+        // start generation in every candidate, they run concurrently as far as generation slots allow
+        for (auto id : ids)
+        {
+            std::string result;
+            auto admitted = admissionQueue.admit(getChatPriority(id), [&]()
+            {
+                auto request = ModelRunnerReceiveInputRequest{senderId, req.body.data(), req.body.size()};
+                request.send(get_channel_name(id), messageBuffer);
+                auto buf = supervisor.receive(inputChannel, {id});
+                auto response = ModelRunnerReceiveInputResponse::receive(buf.data(), buf.size());
+                result.assign(response.data, response.size);
+                return result[0] != 'B'; // Busy
+            });
 
-        std::ostringstream str;
-        str << "{\n";
-        str << "  \"ids\": [\n";
-        if (!chatIds.empty())
+            if (!admitted)
+            {
+                rejectRequest(res, "Too many chats generating");
+                return;
+            }
+            if (result[0] != 'S') // Error
+            {
+                res.set_content(get_json("error", result), "application/json");
+                return;
+            }
+        }
+
+        // wait until done and collect replies
+        std::vector<std::string> replies(ids.size());
+        std::vector<double> logprobs(ids.size());
+        std::vector<int> tokens(ids.size());
+        std::vector<double> scores(ids.size());
+        for (size_t i = 0; i < ids.size(); ++i)
         {
-            str << "    " << *chatIds.begin();
-            for (auto it = ++chatIds.begin(); it != chatIds.end(); ++it)
             {
-                str << ",\n";
-                str << "    " << *it;
+                auto request = ModelRunnerNotifyWhenReadyRequest{senderId};
+                request.send(get_channel_name(ids[i]), messageBuffer);
+                supervisor.receive(inputChannel, {ids[i]}, Supervisor::eGeneration);
             }
+            replies[i] = releaseReply(inputChannel, senderId, ids[i]);
+            {
+                auto request = ModelRunnerLogProbRequest{senderId};
+                request.send(get_channel_name(ids[i]), messageBuffer);
+                auto buf = supervisor.receive(inputChannel, {ids[i]});
+                auto response = ModelRunnerLogProbResponse::receive(buf.data(), buf.size());
+                logprobs[i] = response.pValue->logprob;
+                tokens[i] = response.pValue->tokens;
+            }
+
+            // an empty reply has no tokens to average over, it only wins if all are empty
+            scores[i] = select == "total" ? logprobs[i]
+                      : tokens[i] > 0 ? logprobs[i] / tokens[i] : -std::numeric_limits<double>::infinity();
         }
-        str << "\n  ]\n";
-        str << "}\n";
 
-        res.set_content(str.str(), "application/json");
+        size_t best = std::max_element(scores.begin(), scores.end()) - scores.begin();
+
+        // keep only the best candidate, the guard kills the others
+        candidates.ids.erase(candidates.ids.begin() + best);
+
+        if (returnAll)
+        {
+            res.set_content(get_json("id", ids[best], "best", best, "replies", replies, "logprobs", logprobs,
+                                     "tokens", tokens), "application/json");
+        }
+        else
+        {
+            res.set_content(get_json("id", ids[best], "reply", replies[best], "logprob", logprobs[best],
+                                     "tokens", tokens[best]), "application/json");
+        }
     });
 
-    /// Fork existing chat and returns new chat id
-    server.Post("/fork/([0-9]+)", [&](const httplib::Request& req, httplib::Response &res)
+    /// Score candidate continuations of chat, the body is a JSON array of candidate strings
+    /// Every candidate is evaluated in its own fork of the chat, so the chat itself is not changed and its context is
+    /// not evaluated again. Returns log-probability of every token and the total for each candidate
+    server.Post("/score/(\\d+)", [&](const httplib::Request& req, httplib::Response& res)
     {
         res.set_header("Access-Control-Allow-Origin", "*");
 
@@ -106,101 +1761,177 @@ int main(int argc, char** argv)
             return;
         }
 
+        std::vector<std::string> candidates;
+        if (!read_json_string_array(req.body, candidates))
+        {
+            res.set_content(get_json("error", std::string("Expected a JSON array of strings")), "application/json");
+            return;
+        }
+        if (candidates.empty())
+        {
+            res.set_content(get_json("error", std::string("No candidates")), "application/json");
+            return;
+        }
+
         auto senderId = getServerThreadId();
         auto inputChannelName = get_channel_name(senderId);
-        auto outputChannelName = get_channel_name(chatId.id);
         ipc::channel inputChannel(inputChannelName.c_str(), ipc::receiver);
-        ipc::channel outputChannel(outputChannelName.c_str(), ipc::sender);
 
-        auto request = ModelRunnerForkRequest{senderId};
-        request.send(outputChannel, messageBuffer);
-        auto buf = inputChannel.recv();
-        auto response = ModelRunnerForkResponse::receive(buf.data(), buf.size());
-        if (*response.pValue < 0)
+        std::vector<std::vector<double>> logprobs(candidates.size());
+        std::vector<double> totals(candidates.size());
+        std::string error;
+
+        for (size_t first = 0; first < candidates.size() && error.empty(); first += kMaxForkCount)
         {
-            res.set_content(get_json("error", std::string("Fork failed, model might be busy")), "application/json");
+            int count = std::min<int>(kMaxForkCount, candidates.size() - first);
+
+            // fork one chat per candidate, they are killed however the request ends
+            ChatReservation reservation(supervisor, count, apiParams.maxChats);
+            if (!reservation)
+            {
+                rejectRequest(res, "Too many chats");
+                return;
+            }
+
+            NewChats scorers{killNewChat};
+            {
+                auto request = ModelRunnerForkManyRequest{senderId, &count};
+                request.send(get_channel_name(chatId.id), messageBuffer);
+                auto buf = supervisor.receive(inputChannel, {chatId.id});
+                auto response = ModelRunnerForkManyResponse::receive(buf.data(), buf.size());
+
+                auto pIds = reinterpret_cast<const int*>(response.data);
+                for (size_t i = 0; i < response.size / sizeof(int); ++i)
+                {
+                    if (supervisor.addChat(pIds[i], chatId.id))
+                    {
+                        scorers.ids.push_back(pIds[i]);
+                    }
+                }
+                reservation.release(count);
+            }
+            const auto& ids = scorers.ids;
+            if ((int)ids.size() != count)
+            {
+                error = "Fork failed, model might be busy";
+            }
+
+            // score in parallel, replies come in any order
+            std::unordered_map<int, size_t> candidateById;
+            if (error.empty())
+            {
+                for (size_t i = 0; i < ids.size(); ++i)
+                {
+                    const auto& candidate = candidates[first + i];
+                    auto request = ModelRunnerScoreRequest{senderId, candidate.data(), candidate.size()};
+                    request.send(get_channel_name(ids[i]), messageBuffer);
+                    candidateById[ids[i]] = first + i;
+                }
+                for (size_t i = 0; i < ids.size(); ++i)
+                {
+                    auto buf = supervisor.receive(inputChannel, ids, Supervisor::eGeneration);
+                    auto response = ModelRunnerScoreResponse::receive(buf.data(), buf.size());
+                    if (response.data[0] != 'S') // Error
+                    {
+                        error = std::string(response.data, response.size);
+                        continue;
+                    }
+
+                    auto index = candidateById.at(response.senderId);
+                    auto pValues = reinterpret_cast<const double*>(response.data + 1);
+                    logprobs[index].assign(pValues, pValues + (response.size - 1) / sizeof(double));
+                    for (auto value : logprobs[index])
+                    {
+                        totals[index] += value;
+                    }
+                }
+            }
         }
-        else
+
+        if (!error.empty())
         {
-            chatIds.emplace(*response.pValue);
-            res.set_content(get_json("id", *response.pValue), "application/json");
+            res.set_content(get_json("error", error), "application/json");
+            return;
         }
+
+        res.set_content(get_json("logprobs", logprobs, "totals", totals), "application/json");
     });
 
-    /// Delete chat
-    server.Post("/delete/(\\d+)", [&](const httplib::Request& req, httplib::Response &res)
+    /// Embeddings of texts, one per line, evaluated in a chat forked from a root for the request, needs --embedding.
+    /// The embeddings are float32 in host byte order, one after the other: base64 in JSON, or the bytes themselves with
+    /// format=binary and their dimensions in X-Embedding-Dimensions. Texts per second include forking the chat
+    server.Post("/embed", [&](const httplib::Request& req, httplib::Response& res)
     {
         res.set_header("Access-Control-Allow-Origin", "*");
 
-        auto chatId = findChatId(req.matches[1]);
-        if (!chatId.success)
+        if (req.body.empty())
         {
-            res.set_content(get_json("error", chatId.message), "application/json");
+            res.set_content(get_json("error", std::string("No texts")), "application/json");
+            return;
+        }
+
+        ChatReservation reservation(supervisor, 1, apiParams.maxChats);
+        if (!reservation)
+        {
+            rejectRequest(res, "Too many chats");
             return;
         }
 
+        auto start = std::chrono::steady_clock::now();
         auto senderId = getServerThreadId();
         auto inputChannelName = get_channel_name(senderId);
-        auto outputChannelName = get_channel_name(chatId.id);
         ipc::channel inputChannel(inputChannelName.c_str(), ipc::receiver);
-        ipc::channel outputChannel(outputChannelName.c_str(), ipc::sender);
 
-        auto request = ModelRunnerKillRequest{senderId};
-        request.send(outputChannel, messageBuffer);
-        auto buf = inputChannel.recv();
+        // the chat is only for this request, it is killed however the request ends
+        NewChat chat{killNewChat, forkRoot(reservation)};
 
-        chatIds.erase(chatId.id);
-        res.set_content(get_json("deleted", chatId.id), "application/json");
-    });
+        // embedding evaluates the texts as generating would, so it waits for a slot the same way
+        std::string result;
+        auto admitted = admissionQueue.admit(getChatPriority(chat.id), [&]()
+        {
+            auto request = ModelRunnerEmbedRequest{senderId, req.body.data(), req.body.size()};
+            request.send(get_channel_name(chat.id), messageBuffer);
+            auto buf = supervisor.receive(inputChannel, {chat.id}, Supervisor::eGeneration);
+            auto response = ModelRunnerEmbedResponse::receive(buf.data(), buf.size());
+            result.assign(response.data, response.size);
+            return result[0] != 'B'; // Busy
+        });
 
-    /// Init chat with prompt
-    server.Post("/init", [&](const httplib::Request& req, httplib::Response &res)
-    {
-        res.set_header("Access-Control-Allow-Origin", "*");
+        if (!admitted)
+        {
+            rejectRequest(res, "Too many chats generating");
+            return;
+        }
 
-        // fork root
-        int id = 0;
+        if (result[0] != 'S') // Error
         {
-            auto senderId = getServerThreadId();
-            auto inputChannelName = get_channel_name(senderId);
-            auto outputChannelName = get_channel_name(0);
-            ipc::channel inputChannel(inputChannelName.c_str(), ipc::receiver);
-            ipc::channel outputChannel(outputChannelName.c_str(), ipc::sender);
+            res.set_content(get_json("error", result), "application/json");
+            return;
+        }
 
-            auto request = ModelRunnerForkRequest{senderId};
-            request.send(outputChannel, messageBuffer);
-            auto buf = inputChannel.recv();
-            auto response = ModelRunnerForkResponse::receive(buf.data(), buf.size());
+        int32_t dimensions = 0;
+        std::memcpy(&dimensions, result.data() + 1, sizeof(dimensions));
+        auto embeddings = result.substr(1 + sizeof(dimensions));
+        auto count = dimensions > 0 ? embeddings.size() / (dimensions * sizeof(float)) : 0;
 
-            id = *response.pValue;
-            chatIds.emplace(id);
-        }
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        auto textsPerSecond = elapsed.count() > 0 ? count / elapsed.count() : 0.0;
 
-        // init new chat
+        if (req.get_param_value("format") == "binary")
         {
-            auto senderId = getServerThreadId();
-            auto inputChannelName = get_channel_name(senderId);
-            auto outputChannelName = get_channel_name(id);
-            ipc::channel inputChannel(inputChannelName.c_str(), ipc::receiver);
-            ipc::channel outputChannel(outputChannelName.c_str(), ipc::sender);
-
-            auto request = ModelRunnerInitRequest{senderId, req.body.data(), req.body.size()};
-            request.send(outputChannel, messageBuffer);
-            auto buf = inputChannel.recv();
-            auto response = ModelRunnerInitResponse::receive(buf.data(), buf.size());
-            if (response.data[0] != 'S') // Error
-            {
-                res.set_content(get_json("error", std::string(response.data, response.size)), "application/json");
-            }
-            else
-            {
-                res.set_content(get_json("id", id), "application/json");
-            }
+            res.set_header("X-Embedding-Dimensions", std::to_string(dimensions));
+            res.set_header("X-Texts-Per-Second", std::to_string(textsPerSecond));
+            res.set_content(embeddings, "application/octet-stream");
+            return;
         }
+
+        res.set_content(get_json("count", count, "dimensions", dimensions, "embeddings", get_base64(embeddings),
+                                 "texts_per_second", textsPerSecond), "application/json");
     });
 
-    /// Send message to chat
-    server.Post("/send/(\\d+)", [&](const httplib::Request& req, httplib::Response &res)
+    /// Change chat settings, one key=value per line of the body
+    /// priority=interactive|batch sets the admission priority of the chat, forks inherit it
+    server.Post("/config/(\\d+)", [&](const httplib::Request& req, httplib::Response& res)
     {
         res.set_header("Access-Control-Allow-Origin", "*");
 
@@ -217,48 +1948,59 @@ int main(int argc, char** argv)
         ipc::channel inputChannel(inputChannelName.c_str(), ipc::receiver);
         ipc::channel outputChannel(outputChannelName.c_str(), ipc::sender);
 
-        auto request = ModelRunnerReceiveInputRequest{senderId, req.body.data(), req.body.size()};
+        auto request = ModelRunnerConfigureRequest{senderId, req.body.data(), req.body.size()};
         request.send(outputChannel, messageBuffer);
-        auto buf = inputChannel.recv();
-        auto response = ModelRunnerReceiveInputResponse::receive(buf.data(), buf.size());
+        auto buf = supervisor.receive(inputChannel, {chatId.id});
+        auto response = ModelRunnerConfigureResponse::receive(buf.data(), buf.size());
 
         if (response.data[0] != 'S') // Error
         {
             res.set_content(get_json("error", std::string(response.data, response.size)), "application/json");
+            return;
         }
-        else
+
+        // the server orders its admission queue by priority, so it keeps a copy
+        std::istringstream body(req.body);
+        std::string line;
+        while (std::getline(body, line))
         {
-            res.set_content(get_json("sent", chatId.id), "application/json");
+            ChatPriority priority;
+            if (line.rfind("priority=", 0) == 0 && parse_chat_priority(line.substr(9), priority))
+            {
+                supervisor.setChatPriority(chatId.id, priority);
+            }
         }
+
+        res.set_content(get_json("configured", chatId.id), "application/json");
     });
 
-    /// Stop calculation in chat
-    server.Post("/stop/(\\d+)", [&](const httplib::Request& req, httplib::Response &res)
+    /// Save all chats to the checkpoint directory, replacing the previous checkpoint. Chats that are generating are saved
+    /// when they finish. Forked chats store their KV cache as a delta against their parent
+    server.Post("/admin/checkpoint", [&](const httplib::Request& req, httplib::Response& res)
     {
         res.set_header("Access-Control-Allow-Origin", "*");
 
-        auto chatId = findChatId(req.matches[1]);
-        if (!chatId.success)
+        size_t count;
+        std::vector<int> skipped;
+        try
         {
-            res.set_content(get_json("error", chatId.message), "application/json");
+            count = checkpointChats(apiParams.checkpointDir, skipped);
+        }
+        catch (const RunnerError&)
+        {
+            throw;
+        }
+        catch (const std::exception& e)
+        {
+            res.set_content(get_json("error", std::string(e.what())), "application/json");
             return;
         }
 
-        auto senderId = getServerThreadId();
-        auto inputChannelName = get_channel_name(senderId);
-        auto outputChannelName = get_channel_name(chatId.id);
-        ipc::channel inputChannel(inputChannelName.c_str(), ipc::receiver);
-        ipc::channel outputChannel(outputChannelName.c_str(), ipc::sender);
-
-        auto request = ModelRunnerStopModelRequest{senderId};
-        request.send(outputChannel, messageBuffer);
-        auto buf = inputChannel.recv();
-
-        res.set_content(get_json("stopped", chatId.id), "application/json");
+        res.set_content(get_json("chats", count, "skipped", skipped), "application/json");
     });
 
-    /// Get new text in chat
-    server.Get("/update/(\\d+)", [&](const httplib::Request& req, httplib::Response &res)
+    /// Get chat metrics
+    server.Get("/metrics/(\\d+)", [&](const httplib::Request& req, httplib::Response& res)
     {
         res.set_header("Access-Control-Allow-Origin", "*");
 
@@ -271,66 +2013,53 @@ int main(int argc, char** argv)
 
         auto senderId = getServerThreadId();
         auto inputChannelName = get_channel_name(senderId);
-        auto outputChannelName = get_channel_name(chatId.id);
         ipc::channel inputChannel(inputChannelName.c_str(), ipc::receiver);
-        ipc::channel outputChannel(outputChannelName.c_str(), ipc::sender);
-
-        auto request = ModelRunnerReleaseOutputRequest{senderId};
-        request.send(outputChannel, messageBuffer);
-        auto buf = inputChannel.recv();
-        auto response = ModelRunnerReleaseOutputResponse::receive(buf.data(), buf.size());
 
-        res.set_content(get_json("update", std::string(response.data, response.size), "finished", !response.hasMore),
-                        "application/json");
+        res.set_content(get_json_object(getChatMetrics(inputChannel, senderId, chatId.id)), "application/json");
     });
 
-    /// Send message to chat, wait for response and return it
-    server.Post("/interact/(\\d+)", [&](const httplib::Request& req, httplib::Response& res)
+    /// Get metrics of all chats in Prometheus text format
+    server.Get("/metrics", [&](const httplib::Request& req, httplib::Response& res)
     {
         res.set_header("Access-Control-Allow-Origin", "*");
 
-        auto chatId = findChatId(req.matches[1]);
-        if (!chatId.success)
-        {
-            res.set_content(get_json("error", chatId.message), "application/json");
-            return;
-        }
-
         auto senderId = getServerThreadId();
         auto inputChannelName = get_channel_name(senderId);
-        auto outputChannelName = get_channel_name(chatId.id);
         ipc::channel inputChannel(inputChannelName.c_str(), ipc::receiver);
-        ipc::channel outputChannel(outputChannelName.c_str(), ipc::sender);
 
-        // send message
+        // root runners are reported as chats too, they hold the pages shared by all chats. Root of the first node is 0
+        auto rootIds = supervisor.getRootIds();
+        auto ids = supervisor.getChatIds();
+        ids.insert(ids.begin(), rootIds.begin(), rootIds.end());
+
+        std::ostringstream str;
+        str.precision(15);
+        for (auto id : ids)
         {
-            auto request = ModelRunnerReceiveInputRequest{senderId, req.body.data(), req.body.size()};
-            request.send(outputChannel, messageBuffer);
-            auto buf = inputChannel.recv();
-            auto response = ModelRunnerReceiveInputResponse::receive(buf.data(), buf.size());
-            if (response.data[0] != 'S') // Error
+            auto isRoot = std::find(rootIds.begin(), rootIds.end(), id) != rootIds.end();
+            if (!isRoot && !supervisor.findChat(id).value_or(ChatInfo{0, false}).alive)
             {
-                res.set_content(get_json("error", std::string(response.data, response.size)), "application/json");
-                return;
+                continue;
             }
-        }
-
-        // wait until done
-        {
-            auto request = ModelRunnerNotifyWhenReadyRequest{senderId};
-            request.send(outputChannel, messageBuffer);
-            inputChannel.recv();
-        }
 
-        // get reply from model
-        {
-            auto request = ModelRunnerReleaseOutputRequest{senderId};
-            request.send(outputChannel, messageBuffer);
-            auto buf = inputChannel.recv();
-            auto response = ModelRunnerReleaseOutputResponse::receive(buf.data(), buf.size());
+            // a chat that dies while it is listed does not fail the listing
+            ModelMetrics metrics;
+            try
+            {
+                metrics = getChatMetrics(inputChannel, senderId, id);
+            }
+            catch (const RunnerError&)
+            {
+                continue;
+            }
 
-            res.set_content(get_json("reply", std::string(response.data, response.size)), "application/json");
+            for (const auto& [name, value] : metrics)
+            {
+                str << "llama_cpp_api_" << name << "{chat=\"" << id << "\"} " << value << "\n";
+            }
         }
+
+        res.set_content(str.str(), "text/plain; version=0.0.4");
     });
 
     server.set_exception_handler([](const auto& req, auto& res, std::exception_ptr ep)
@@ -343,6 +2072,12 @@ int main(int argc, char** argv)
         {
             std::rethrow_exception(ep);
         }
+        catch (RunnerError& e)
+        {
+            res.set_content(get_json("error", std::string(e.what())), "application/json");
+            res.status = e.getStatus();
+            return;
+        }
         catch (std::exception &e)
         {
             snprintf(buf, sizeof(buf), fmt, e.what());
@@ -355,19 +2090,142 @@ int main(int argc, char** argv)
         res.status = 500;
     });
 
-    auto pRunner = make_model_runner(0, 10, std::move(pModel));
-    auto pid = fork();
-    if (pid == 0)
+    auto runRoot = [](std::unique_ptr<Process> pRunner)
     {
+        // runners reap the chats they fork automatically
+        signal(SIGCHLD, SIG_IGN);
+
         while (pRunner)
         {
             pRunner = pRunner->loop();
         }
+    };
+
+    std::vector<int> rootPids;
+    if (pModel)
+    {
+        auto pRunner = make_model_runner(0, 10, std::move(pModel), &generationSlots, &outputRings,
+                                         std::make_unique<TranscriptWriter>(apiParams.transcriptDir), &responseCache,
+                                         eInteractive);
+        auto pid = fork();
+        if (pid == 0)
+        {
+            runRoot(std::move(pRunner));
+            return 0;
+        }
+        rootPids.push_back(pid);
+    }
+    else
+    {
+        auto killRoots = [&]()
+        {
+            for (auto pid : rootPids)
+            {
+                kill(pid, SIGKILL);
+            }
+        };
 
-        return 0;
+        // every node loads its own replica, memory allocated by the root and the chats it forks stays on the node
+        std::vector<int> readyFds;
+        for (size_t i = 0; i < numaNodes.size(); ++i)
+        {
+            int fds[2];
+            if (pipe(fds) != 0)
+            {
+                perror("pipe");
+                killRoots();
+                return 1;
+            }
+
+            auto pid = fork();
+            if (pid == 0)
+            {
+                close(fds[0]);
+                if (!bind_to_numa_node(numaNodes[i]))
+                {
+                    fprintf(stderr, "warning: failed to bind to NUMA node %d\n", numaNodes[i].id);
+                }
+
+                auto pRunner = make_model_runner(i == 0 ? 0 : getpid(), 10, loadModel(), &generationSlots,
+                                                 &outputRings,
+                                                 std::make_unique<TranscriptWriter>(apiParams.transcriptDir),
+                                                 &responseCache, eInteractive);
+                fprintf(stderr, "root %d: NUMA node %d, %zu cpus\n", i == 0 ? 0 : getpid(), numaNodes[i].id,
+                        numaNodes[i].cpus.size());
+
+                // a root that cannot report its model loaded does not serve, the server sees it fail to start
+                char ready = 1;
+                ssize_t written;
+                while ((written = write(fds[1], &ready, 1)) < 0 && errno == EINTR)
+                {
+                }
+                close(fds[1]);
+                if (written != 1)
+                {
+                    perror("write");
+                    return 1;
+                }
+
+                runRoot(std::move(pRunner));
+                return 0;
+            }
+
+            close(fds[1]);
+            rootPids.push_back(pid);
+            readyFds.push_back(fds[0]);
+        }
+
+        // requests are not served until every root has loaded its model
+        for (auto fd : readyFds)
+        {
+            char ready = 0;
+            auto loaded = read(fd, &ready, 1) == 1;
+            close(fd);
+            if (!loaded)
+            {
+                fprintf(stderr, "error: failed to load the model on every NUMA node\n");
+                killRoots();
+                return 1;
+            }
+        }
+    }
+
+    supervisor.start(rootPids, [&]()
+    {
+        server.stop();
+    });
+
+    if (apiParams.warmRestart && std::filesystem::exists(apiParams.checkpointDir))
+    {
+        try
+        {
+            auto count = restoreChats(apiParams.checkpointDir);
+            fprintf(stderr, "restored %zu chats from %s\n", count, apiParams.checkpointDir.c_str());
+        }
+        catch (const std::exception& e)
+        {
+            fprintf(stderr, "warning: failed to restore chats: %s\n", e.what());
+        }
     }
 
     server.listen("0.0.0.0", 8880);
 
+    if (apiParams.warmRestart)
+    {
+        try
+        {
+            std::vector<int> skipped;
+            auto count = checkpointChats(apiParams.checkpointDir, skipped);
+            fprintf(stderr, "saved %zu chats to %s, %zu skipped\n", count, apiParams.checkpointDir.c_str(),
+                    skipped.size());
+        }
+        catch (const std::exception& e)
+        {
+            fprintf(stderr, "error: failed to save chats: %s\n", e.what());
+        }
+    }
+
+    supervisor.killAll();
+
     return 0;
 }
\ No newline at end of file
@@ -3,6 +3,7 @@
 #ifndef LLAMA_CPP_API_MESSAGES_COMMON_H
 #define LLAMA_CPP_API_MESSAGES_COMMON_H
 
+#include <cstdint>
 #include <cstring>
 
 #include "libipc/ipc.h"
@@ -12,6 +13,20 @@
 namespace llama_cpp_api
 {
 
+// a receiver that does not connect within this time is gone: a server thread that gave up waiting, or a dead runner
+static constexpr uint64_t kSendTimeoutMs = 1000;
+
+// sender id, message id, sequence number; padded so that message data is aligned for any scalar
+static constexpr size_t kMessageHeaderSize = sizeof(int) * 4;
+
+/// Sequence number written into the header of messages sent by the calling thread. The server numbers its requests,
+/// a runner replies with the number of the request it answers, so replies to abandoned requests can be told apart
+inline uint32_t& message_sequence()
+{
+    thread_local uint32_t s_sequence = 0;
+    return s_sequence;
+}
+
 inline int& sender_id_in_buffer(void* buffer)
 {
     return reinterpret_cast<int*>(buffer)[0];
@@ -32,32 +47,52 @@ inline int message_id_in_buffer(const void* buffer)
     return reinterpret_cast<const int*>(buffer)[1];
 }
 
+inline uint32_t& sequence_in_buffer(void* buffer)
+{
+    return reinterpret_cast<uint32_t*>(buffer)[2];
+}
+
+inline uint32_t sequence_in_buffer(const void* buffer)
+{
+    return reinterpret_cast<const uint32_t*>(buffer)[2];
+}
+
 template <typename T = char>
 inline T* message_data_in_buffer(void* buffer)
 {
-    return reinterpret_cast<T*>(reinterpret_cast<char*>(buffer) + sizeof(int) * 2);
+    return reinterpret_cast<T*>(reinterpret_cast<char*>(buffer) + kMessageHeaderSize);
 }
 
 template <typename T = char>
 inline const T* message_data_in_buffer(const void* buffer)
 {
-    return reinterpret_cast<const T*>(reinterpret_cast<const char*>(buffer) + sizeof(int) * 2);
+    return reinterpret_cast<const T*>(reinterpret_cast<const char*>(buffer) + kMessageHeaderSize);
 }
 
 inline size_t calc_data_size_from_message_size(size_t size)
 {
-    return size - sizeof(int) * 2;
+    return size - kMessageHeaderSize;
 }
 
 inline size_t calc_message_size_from_data_size(size_t size)
 {
-    return size + sizeof(int) * 2;
+    return size + kMessageHeaderSize;
 }
 
 inline void fill_message_header(int processId, int messageId, MessageBuffer& rBuffer)
 {
     sender_id_in_buffer(rBuffer.get()) = processId;
     message_id_in_buffer(rBuffer.get()) = messageId;
+    sequence_in_buffer(rBuffer.get()) = message_sequence();
+}
+
+/// Sends the message unless nobody receives on the channel within kSendTimeoutMs, then it is dropped
+inline void send_message(ipc::channel& rChannel, MessageBuffer& rBuffer, size_t messageSize)
+{
+    if (rChannel.wait_for_recv(1, kSendTimeoutMs))
+    {
+        rChannel.send(rBuffer.get(), messageSize);
+    }
 }
 
 template <uint16_t kMessageId>
@@ -86,8 +121,7 @@ struct DataBufferMessage
         fill_message_header(senderId, kMessageId, rBuffer);
         std::memcpy(message_data_in_buffer(rBuffer.get()), data, size);
 
-        rChannel.wait_for_recv(1);
-        rChannel.send(rBuffer.get(), messageSize);
+        send_message(rChannel, rBuffer, messageSize);
     }
 
     void send(const std::string& channelName, MessageBuffer& rBuffer)
@@ -121,8 +155,7 @@ struct ValueMessage
         fill_message_header(senderId, kMessageId, rBuffer);
         std::memcpy(message_data_in_buffer(rBuffer.get()), pValue, sizeof(T));
 
-        rChannel.wait_for_recv(1);
-        rChannel.send(rBuffer.get(), messageSize);
+        send_message(rChannel, rBuffer, messageSize);
     }
 
     void send(const std::string& channelName, MessageBuffer& rBuffer)
@@ -153,8 +186,7 @@ struct EmptyMessage
 
         fill_message_header(senderId, kMessageId, rBuffer);
 
-        rChannel.wait_for_recv(1);
-        rChannel.send(rBuffer.get(), messageSize);
+        send_message(rChannel, rBuffer, messageSize);
     }
 
     void send(const std::string& channelName, MessageBuffer& rBuffer)
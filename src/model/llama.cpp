@@ -1,17 +1,212 @@
 #include "model/llama.h"
 
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <numeric>
 #include <random>
+#include <sstream>
 #include <stdexcept>
+#include <thread>
 #include <iostream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 #include "llama.cpp/llama.h"
 
+#include "process/checkpoint.h"
+#include "process/cpu_arbiter.h"
+#include "process/memory.h"
+
 namespace llama_cpp_api
 {
 
+enum class SamplerMode
+{
+    fast,
+    reference,
+};
+
+enum class SpeculativeMode
+{
+    off,
+    ngram,
+    draft,
+};
+
+enum class OverflowPolicy
+{
+    halve,  // keep half of the recent tokens
+    window, // keep a fixed number of recent tokens
+    turns,  // keep the recent whole turns that fit into half of the context
+};
+
+struct LlamaModelSettings
+{
+    SamplerMode sampler;
+    SpeculativeMode speculative;
+    int draft_n;
+    int ngram_n;
+    int n_threads_prefill;
+    int n_threads_decode;
+    int n_input_history;
+    OverflowPolicy overflow;
+    int overflow_window;
+    bool overflow_proactive;
+};
+
+// thread counts and batch size for the host, measured at startup or read from the autotune cache
+struct LlamaTuning
+{
+    int n_threads_prefill;
+    int n_threads_decode;
+    int n_batch;
+};
+
+struct LlamaModelStats
+{
+    std::atomic<int64_t> n_sampled{0};
+    std::atomic<int64_t> n_drafted{0};
+    std::atomic<int64_t> n_accepted{0};
+
+    std::atomic<int64_t> t_sample_us{0};
+
+    std::atomic<double> last_tokens_per_second{0.0};
+
+    std::atomic<int64_t> n_evals{0};
+    std::atomic<int64_t> t_cpu_wait_us{0};
+    std::atomic<int> last_n_threads{0};
+
+    // latency of the last reply: time to first token since the input arrived, gaps between tokens
+    std::atomic<int64_t> t_input_us{0};
+    std::atomic<int64_t> t_last_token_us{0};
+    std::atomic<int64_t> last_ttft_us{0};
+    std::atomic<int64_t> t_inter_token_us{0};
+    std::atomic<int64_t> n_inter_token{0};
+    std::atomic<int64_t> last_max_inter_token_us{0};
+
+    // prompt tokens taken from the preamble evaluated by the root
+    std::atomic<int64_t> n_prompt_reused{0};
+
+    // context rollovers, proactive ones happen before a reply instead of in the middle of it
+    std::atomic<int64_t> n_rollovers{0};
+    std::atomic<int64_t> n_rollovers_proactive{0};
+    std::atomic<int64_t> n_rollover_tokens{0};
+    std::atomic<int64_t> t_rollover_us{0};
+    std::atomic<int64_t> last_rollover_us{0};
+};
+
+// startup phases of the root, forked chats report them as well
+struct LlamaStartupTimes
+{
+    int64_t t_load_us = 0;     // model file mapped or read, draft model included
+    int64_t t_mapping_us = 0;  // weights mapping policy applied
+    int64_t t_autotune_us = 0;
+    int64_t t_preamble_us = 0; // preamble evaluated or its snapshot loaded
+    int64_t t_total_us = 0;
+};
+
+static int64_t llama_time_us()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// buffers reused by the fast sampler between tokens
+struct LlamaSamplerScratch
+{
+    std::vector<float> values;
+    std::vector<float> sample;
+    std::vector<float> probs;
+    std::vector<std::pair<float, llama_token>> candidates;
+    std::vector<llama_token> window;
+};
+
+struct LlamaSpeculativeState
+{
+    // draft tokens evaluated right after the last evaluated token
+    std::vector<llama_token> draft;
+    // logits for the last evaluated token and for every draft token
+    std::vector<float> logits;
+    // number of draft tokens accepted so far, also index of the logits row to sample from
+    size_t n_accepted = 0;
+
+    // tokens in the draft model context by position
+    std::vector<llama_token> draft_ctx_tokens;
+
+    void clear()
+    {
+        draft.clear();
+        logits.clear();
+        n_accepted = 0;
+    }
+};
+
+struct LlamaOverflowState
+{
+    // context positions where user turns start
+    std::vector<int> turn_starts;
+    // tokens sampled in reply to the last input and their moving average over the replies, to predict the next one
+    int n_reply_tokens = 0;
+    double reply_tokens_avg = 0.0;
+    // the recent tokens are re-evaluated by the next eval, which is timed as the rollover
+    bool rollover_pending = false;
+};
+
+// reply recorded by an earlier run from the same state, evaluated in n_batch chunks like a prefill instead of sampled.
+// The recorded run evaluated it a token at a time, so the KV cache can differ from its one in the last bits, and so can
+// later replies of the chat
+struct LlamaReplay
+{
+    std::vector<llama_token> tokens;
+    int n_sampled = 0; // the others were injected, e.g. the reverse prompt after end of text
+    double logprob = 0.0;
+    std::string rng;   // sampler RNG state after the reply
+    bool pending = false;
+    bool applied = false;
+};
+
+// prompt or input that arrives in pieces: each piece is tokenized as far as its text cannot merge with the next one,
+// and the tokens are evaluated in whole batches while the rest is still arriving
+struct LlamaInputStream
+{
+    bool open = false;    // more pieces follow, nothing is sampled until the last one
+    bool prompt = false;  // the pieces are the prompt of init, otherwise an input
+    bool started = false; // tokens of the first piece are added, the turn has started
+    std::string text;     // end of the pieces so far that is not tokenized yet
+    int n_turn_start = 0; // where the input starts in embd_inp
+    int n_tokens = 0;     // input tokens so far, taken from n_remain with the last piece
+    int n_keep = 0;       // n_keep of params, init set it for the part of the prompt it saw
+
+    std::vector<llama_token> tokens; // input the client tokenized itself, it follows the text
+
+    std::vector<llama_token> last_n_tokens; // as before the input, restored if the input is aborted
+};
+
 struct LlamaModelContext
 {
     llama_context* ctx;
+    llama_context* draft_ctx = nullptr;
+
+    bool logits_all;
+
+    // with logits_all llama_get_logits returns a row per token of the last eval, sampling reads the last one
+    int last_logits_row = 0;
+
+    // where a scoring context maps the weights from, empty if they are on the heap
+    std::string weights_path;
 
     std::vector<llama_token> embd_inp;
 
@@ -20,6 +215,9 @@ struct LlamaModelContext
 
     std::vector<llama_token> embd;
 
+    // tokens in the context by position, ctx_tokens.size() == n_past between evaluations
+    std::vector<llama_token> ctx_tokens;
+
     int n_ctx;
     int n_past;
     int n_remain;
@@ -30,250 +228,1222 @@ struct LlamaModelContext
     bool waiting_input;
 
     std::atomic<bool> is_interacting;
+
+    // sampler RNG, owned by the chat so that forked chats can be reseeded independently
+    std::mt19937 rng;
+
+    // cumulative log-probability of the tokens sampled since the last input
+    double logprob;
+
+    LlamaSamplerScratch sampler;
+    LlamaSpeculativeState speculative;
+    LlamaOverflowState overflow;
+
+    // tokens of the current turn, reported when it is done
+    ModelTurn turn;
+
+    LlamaReplay replay;
+    LlamaInputStream stream;
+    LlamaModelStats stats;
+
+    // shared by all chats, divides cores between the ones evaluating at the same time
+    CpuArbiter* cpu_arbiter = nullptr;
 };
 
-static void load_llama_model(gpt_params& params, llama_context*& ctx)
+// orders candidates by logit, ties by token id, so that the reference and fast samplers agree bit for bit
+static bool sampler_greater(const std::pair<float, llama_token>& a, const std::pair<float, llama_token>& b)
 {
-    if (params.perplexity) {
-        printf("\n************\n");
-        printf("%s: please use the 'perplexity' tool for perplexity calculations\n", __func__);
-        printf("************\n\n");
+    return a.first > b.first || (a.first == b.first && a.second < b.second);
+}
 
-        throw std::runtime_error("perplexity param not supported");
+static llama_token sample_greedy(const float* plogits, int n_logits)
+{
+    // select the token with the highest logit directly
+    float max_logit = plogits[0];
+    llama_token max_id = 0;
+
+    for (int i = 1; i < n_logits; ++i) {
+        if (plogits[i] > max_logit) {
+            max_logit = plogits[i];
+            max_id = i;
+        }
     }
+    return max_id;
+}
 
-    if (params.embedding) {
-        printf("\n************\n");
-        printf("%s: please use the 'embedding' tool for embedding calculations\n", __func__);
-        printf("************\n\n");
-
-        throw std::runtime_error("embedding param not supported");
+// softmax and top-p over the top k candidates sorted with sampler_greater, shared by both samplers
+static llama_token sample_top_p(std::vector<std::pair<float, llama_token>>& logits_id, std::vector<float>& probs,
+                                float top_p, std::mt19937& rng)
+{
+    // compute probs for the top k tokens
+    probs.clear();
+    probs.reserve(logits_id.size());
+
+    const float maxl = logits_id[0].first;
+    double sum = 0.0;
+    for (const auto& kv : logits_id) {
+        const float p = expf(kv.first - maxl);
+        probs.push_back(p);
+        sum += p;
     }
 
-    if (params.n_ctx > 2048) {
-        fprintf(stderr, "%s: warning: model does not support context sizes greater than 2048 tokens (%d specified);"
-                "expect poor results\n", __func__, params.n_ctx);
+    // normalize the probs
+    for (auto& p : probs) {
+        p /= sum;
     }
 
-    if (params.seed <= 0) {
-        params.seed = time(NULL);
+    if (top_p < 1.0) {
+        double cumsum = 0.0;
+        for (int i = 0; i < (int) probs.size(); i++) {
+            cumsum += probs[i];
+            if (cumsum >= top_p) {
+                probs.resize(i + 1);
+                logits_id.resize(i + 1);
+                break;
+            }
+        }
     }
 
-    fprintf(stderr, "%s: seed = %d\n", __func__, params.seed);
+    std::discrete_distribution<> dist(probs.begin(), probs.end());
+    const int idx = dist(rng);
 
-    // load the model
-    {
-        auto lparams = llama_context_default_params();
+    return logits_id[idx].second;
+}
 
-        lparams.n_ctx      = params.n_ctx;
-        lparams.n_parts    = params.n_parts;
-        lparams.seed       = params.seed;
-        lparams.f16_kv     = params.memory_f16;
-        lparams.use_mlock  = params.use_mlock;
+// same as llama_sample_top_p_top_k from llama.cpp, but samples from the given logits with the chat's own RNG;
+// kept as the reference for the fast sampler
+static llama_token sample_top_p_top_k(const float* plogits, int n_logits, std::mt19937& rng,
+                                      const llama_token* last_n_tokens_data, int last_n_tokens_size, int top_k,
+                                      float top_p, float temp, float repeat_penalty)
+{
+    if (temp <= 0) {
+        return sample_greedy(plogits, n_logits);
+    }
 
-        ctx = llama_init_from_file(params.model.c_str(), lparams);
+    const std::vector<llama_token> last_n_tokens(last_n_tokens_data, last_n_tokens_data + last_n_tokens_size);
 
-        if (ctx == NULL) {
-            fprintf(stderr, "%s: error: failed to load model '%s'\n", __func__, params.model.c_str());
+    std::vector<std::pair<float, llama_token>> logits_id;
+    logits_id.reserve(n_logits);
 
-            throw std::runtime_error("failed to load model");
+    {
+        const float scale = 1.0f/temp;
+        for (int i = 0; i < n_logits; ++i) {
+            // repetition penalty from ctrl paper (https://arxiv.org/abs/1909.05858)
+            if (std::find(last_n_tokens.begin(), last_n_tokens.end(), i) != last_n_tokens.end()) {
+                // if score < 0 then repetition penalty has to multiplied to reduce the previous token probability
+                if (plogits[i] < 0.0f) {
+                    logits_id.push_back(std::make_pair(plogits[i]*scale*repeat_penalty, i));
+                } else {
+                    logits_id.push_back(std::make_pair(plogits[i]*scale/repeat_penalty, i));
+                }
+            } else {
+                logits_id.push_back(std::make_pair(plogits[i]*scale, i));
+            }
         }
     }
 
-    // print system information
-    {
-        fprintf(stderr, "\n");
-        fprintf(stderr, "system_info: n_threads = %d / %d | %s\n",
-                params.n_threads, std::thread::hardware_concurrency(), llama_print_system_info());
-    }
+    // find the top k tokens
+    const int n_top = top_k > 0 ? std::min(top_k, n_logits) : n_logits;
+    std::partial_sort(logits_id.begin(), logits_id.begin() + n_top, logits_id.end(), sampler_greater);
+    logits_id.resize(n_top);
 
-    // determine the maximum memory usage needed to do inference for the given n_batch and n_predict parameters
-    // uncomment the "used_mem" line in llama.cpp to see the results
-    if (params.mem_test) {
-        throw std::runtime_error("mem_test param not supported");
-    }
+    std::vector<float> probs;
+    return sample_top_p(logits_id, probs, top_p, rng);
 }
 
-static void init_llama_model(gpt_params& params, const char* input_prefix, const char* output_prefix,
-                             llama_context*& ctx, std::vector<llama_token>& inp_pfx, std::vector<llama_token>& inp_sfx,
-                             std::vector<llama_token>& embd_inp, std::vector<llama_token>& embd,
-                             std::vector<llama_token>& last_n_tokens, std::vector<llama_token>& llama_token_newline,
-                             int& n_remain, int& n_past, int& n_ctx, int& n_consumed, std::atomic<bool>& is_interacting,
-                             bool& input_noecho, bool& is_antiprompt, bool& waiting_input)
+// values[i] = plogits[i]*scale
+static void scale_logits(const float* plogits, float* values, int n, float scale)
 {
-    std::cout << params.prompt << std::endl;
-    // Add a space in front of the first character to match OG llama tokenizer behavior
-    params.prompt.insert(0, 1, ' ');
+    int i = 0;
+#if defined(__AVX__)
+    const __m256 vscale = _mm256_set1_ps(scale);
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(values + i, _mm256_mul_ps(_mm256_loadu_ps(plogits + i), vscale));
+    }
+#elif defined(__SSE2__)
+    const __m128 vscale = _mm_set1_ps(scale);
+    for (; i + 4 <= n; i += 4) {
+        _mm_storeu_ps(values + i, _mm_mul_ps(_mm_loadu_ps(plogits + i), vscale));
+    }
+#endif
+    for (; i < n; ++i) {
+        values[i] = plogits[i]*scale;
+    }
+}
 
-    // tokenize the prompt
-    embd_inp = ::llama_tokenize(ctx, params.prompt, true);
+// collects all values that are not less than the threshold
+static void select_candidates(const float* values, int n, float threshold,
+                              std::vector<std::pair<float, llama_token>>& candidates)
+{
+    candidates.clear();
+
+    int i = 0;
+#if defined(__AVX__)
+    const __m256 vthreshold = _mm256_set1_ps(threshold);
+    for (; i + 8 <= n; i += 8) {
+        int mask = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(values + i), vthreshold, _CMP_GE_OQ));
+        while (mask) {
+            const int j = i + __builtin_ctz(mask);
+            candidates.emplace_back(values[j], j);
+            mask &= mask - 1;
+        }
+    }
+#elif defined(__SSE2__)
+    const __m128 vthreshold = _mm_set1_ps(threshold);
+    for (; i + 4 <= n; i += 4) {
+        int mask = _mm_movemask_ps(_mm_cmpge_ps(_mm_loadu_ps(values + i), vthreshold));
+        while (mask) {
+            const int j = i + __builtin_ctz(mask);
+            candidates.emplace_back(values[j], j);
+            mask &= mask - 1;
+        }
+    }
+#endif
+    for (; i < n; ++i) {
+        if (values[i] >= threshold) {
+            candidates.emplace_back(values[i], i);
+        }
+    }
+}
 
-    n_ctx = llama_n_ctx(ctx);
+// a value that is likely, but not guaranteed, to be below the n_top-th largest value, estimated from a sample
+static float estimate_top_k_threshold(const std::vector<float>& values, int n_top, std::vector<float>& sample)
+{
+    const int n = values.size();
+    const int stride = std::max(1, n / 1024);
 
-    if ((int) embd_inp.size() > n_ctx - 4) {
-        fprintf(stderr, "%s: error: prompt is too long (%d tokens, max %d)\n", __func__, (int) embd_inp.size(), n_ctx - 4);
-        throw std::runtime_error("prompt is too long");
+    sample.clear();
+    for (int i = 0; i < n; i += stride) {
+        sample.push_back(values[i]);
     }
 
-    // number of tokens to keep when resetting context
-    if (params.n_keep < 0 || params.n_keep > (int)embd_inp.size() || params.instruct) {
-        params.n_keep = (int)embd_inp.size();
+    // expected rank of the threshold in the sample with a safety margin
+    const int m = sample.size();
+    const int rank = (int) ((int64_t) n_top * m / n) * 2 + 8;
+    if (rank >= m) {
+        return -INFINITY;
     }
 
-    // prefix & suffix for instruct mode
-    inp_pfx = ::llama_tokenize(ctx, input_prefix, true);
-    inp_sfx = ::llama_tokenize(ctx, output_prefix, false);
+    std::nth_element(sample.begin(), sample.begin() + rank, sample.end(), std::greater<float>());
+    return sample[rank];
+}
 
-    // in instruct mode, we inject a prefix and a suffix to each input by the user
-    if (params.instruct) {
-        params.interactive_start = true;
-        params.antiprompt.push_back(input_prefix);
+// same result as sample_top_p_top_k, but the repeat penalty is applied once per distinct token of the window and
+// only the candidates above a threshold are sorted
+static llama_token sample_top_p_top_k_fast(const float* plogits, int n_logits, std::mt19937& rng,
+                                           const llama_token* last_n_tokens_data, int last_n_tokens_size, int top_k,
+                                           float top_p, float temp, float repeat_penalty, LlamaSamplerScratch& scratch)
+{
+    if (temp <= 0) {
+        return sample_greedy(plogits, n_logits);
     }
 
-    // enable interactive mode if reverse prompt or interactive start is specified
-    if (params.antiprompt.size() != 0 || params.interactive_start) {
-        params.interactive = true;
-    }
+    const float scale = 1.0f/temp;
 
-    // determine newline token
-    llama_token_newline = ::llama_tokenize(ctx, "\n", false);
+    auto& values = scratch.values;
+    values.resize(n_logits);
+    scale_logits(plogits, values.data(), n_logits, scale);
 
-    if (params.verbose_prompt) {
-        fprintf(stderr, "\n");
-        fprintf(stderr, "%s: prompt: '%s'\n", __func__, params.prompt.c_str());
-        fprintf(stderr, "%s: number of tokens in prompt = %zu\n", __func__, embd_inp.size());
-        for (int i = 0; i < (int) embd_inp.size(); i++) {
-            fprintf(stderr, "%6d -> '%s'\n", embd_inp[i], llama_token_to_str(ctx, embd_inp[i]));
-        }
-        if (params.n_keep > 0) {
-        fprintf(stderr, "%s: static prompt based on n_keep: '", __func__);
-            for (int i = 0; i < params.n_keep; i++) {
-                fprintf(stderr, "%s", llama_token_to_str(ctx, embd_inp[i]));
-            }
-            fprintf(stderr, "'\n");
+    // repetition penalty, distinct tokens of the window are found with a small open addressing hash set
+    {
+        size_t n_table = 16;
+        while (n_table < 2 * (size_t) last_n_tokens_size) {
+            n_table *= 2;
         }
-        fprintf(stderr, "\n");
-    }
+        auto& table = scratch.window;
+        table.assign(n_table, -1);
 
-    if (params.interactive) {
-        fprintf(stderr, "%s: interactive mode on.\n", __func__);
+        for (int k = 0; k < last_n_tokens_size; ++k) {
+            const llama_token i = last_n_tokens_data[k];
+            if (i < 0 || i >= n_logits) {
+                continue;
+            }
 
-        if (params.antiprompt.size()) {
-            for (auto antiprompt : params.antiprompt) {
-                fprintf(stderr, "Reverse prompt: '%s'\n", antiprompt.c_str());
+            size_t h = ((uint32_t) i * 2654435761u) & (n_table - 1);
+            while (table[h] != -1 && table[h] != i) {
+                h = (h + 1) & (n_table - 1);
             }
-        }
+            if (table[h] == i) {
+                continue;
+            }
+            table[h] = i;
 
-        if (!params.input_prefix.empty()) {
-            fprintf(stderr, "Input prefix: '%s'\n", params.input_prefix.c_str());
+            if (plogits[i] < 0.0f) {
+                values[i] = plogits[i]*scale*repeat_penalty;
+            } else {
+                values[i] = plogits[i]*scale/repeat_penalty;
+            }
         }
     }
-    fprintf(stderr, "sampling: temp = %f, top_k = %d, top_p = %f, repeat_last_n = %i, repeat_penalty = %f\n",
-        params.temp, params.top_k, params.top_p, params.repeat_last_n, params.repeat_penalty);
-    fprintf(stderr, "generate: n_ctx = %d, n_batch = %d, n_predict = %d, n_keep = %d\n", n_ctx, params.n_batch, params.n_predict, params.n_keep);
-    fprintf(stderr, "\n\n");
 
-    // TODO: replace with ring-buffer
-    last_n_tokens.resize(n_ctx);
-    std::fill(last_n_tokens.begin(), last_n_tokens.end(), 0);
+    // find the top k tokens
+    const int n_top = top_k > 0 ? std::min(top_k, n_logits) : n_logits;
+    auto& candidates = scratch.candidates;
 
-    if (params.interactive) {
-        fprintf(stderr, "== Running in interactive mode. ==\n"
-#if defined (__unix__) || (defined (__APPLE__) && defined (__MACH__)) || defined (_WIN32)
-               " - Press Ctrl+C to interject at any time.\n"
-#endif
-               " - Press Return to return control to LLaMa.\n"
-               " - If you want to submit another line, end your input in '\\'.\n\n");
-        is_interacting = params.interactive_start;
+    float threshold = n_top < n_logits ? estimate_top_k_threshold(values, n_top, scratch.sample) : -INFINITY;
+    select_candidates(values.data(), n_logits, threshold, candidates);
+    if ((int) candidates.size() < n_top) {
+        // the estimate was too high
+        select_candidates(values.data(), n_logits, -INFINITY, candidates);
     }
 
-    is_antiprompt = false;
-    input_noecho  = false;
+    if ((int) candidates.size() > n_top) {
+        std::nth_element(candidates.begin(), candidates.begin() + n_top, candidates.end(), sampler_greater);
+        candidates.resize(n_top);
+    }
+    std::sort(candidates.begin(), candidates.end(), sampler_greater);
 
-    n_past     = 0;
-    n_remain   = params.n_predict;
-    n_consumed = 0;
+    return sample_top_p(candidates, scratch.probs, top_p, rng);
+}
 
-    embd.clear();
-    waiting_input = false;
+// log-probability of the token under the unmodified model distribution (temperature 1, no penalties)
+static double token_logprob(const float* plogits, int n_logits, llama_token id)
+{
+    const float max_logit = *std::max_element(plogits, plogits + n_logits);
+    double sum = 0.0;
+    for (int i = 0; i < n_logits; ++i) {
+        sum += exp(plogits[i] - max_logit);
+    }
+
+    return plogits[id] - max_logit - log(sum);
 }
 
-static void init_llama_model(gpt_params& params, const char* inputPrefix, const char* outputPrefix,
-                             LlamaModelContext& context)
+// proposes the tokens that followed the most recent earlier occurrence of the last n tokens of history
+static std::vector<llama_token> propose_ngram_draft(const std::vector<llama_token>& history, int n_gram, int n_draft)
 {
-    init_llama_model(params, inputPrefix, outputPrefix, context.ctx, context.inp_pfx, context.inp_sfx, context.embd_inp,
-                     context.embd, context.last_n_tokens, context.llama_token_newline, context.n_remain, context.n_past,
-                     context.n_ctx, context.n_consumed, context.is_interacting, context.input_noecho,
-                     context.is_antiprompt, context.waiting_input);
+    const int n_history = history.size();
+
+    for (int n = std::min(n_gram, n_history - 1); n > 0; --n) {
+        const auto suffix = history.end() - n;
+
+        // search backwards, so that the most recent match wins
+        for (int i = n_history - 1; i >= n; --i) {
+            if (!std::equal(suffix, history.end(), history.begin() + i - n)) {
+                continue;
+            }
+
+            const int n_found = std::min(n_draft, n_history - i);
+            return std::vector<llama_token>(history.begin() + i, history.begin() + i + n_found);
+        }
+    }
+
+    return {};
 }
 
-template <typename UpdateFunction>
-void run_llama_model(const gpt_params& params, llama_context* ctx, std::vector<llama_token>& inp_pfx,
-                     std::vector<llama_token>& inp_sfx, std::vector<llama_token>& embd_inp,
-                     std::vector<llama_token>& embd, std::vector<llama_token>& last_n_tokens,
-                     std::vector<llama_token>& llama_token_newline, int& n_remain, int& n_past, int& n_ctx,
-                     int& n_consumed, std::atomic<bool>& is_interacting, bool& input_noecho, bool& is_antiprompt,
-                     bool& waiting_input, const std::string& input, UpdateFunction update)
+// evaluates tokens on the cores granted by the arbiter, at most n_threads;
+// prefill is evaluated in n_batch chunks, each one acquires cores anew, so decoding chats get them in between
+static int eval_llama(llama_context* ctx, const llama_token* tokens, int n_tokens, int n_past, int n_threads,
+                      CpuArbiter* cpu_arbiter, CpuArbiter::EvalKind kind, LlamaModelStats& stats)
 {
-    while (waiting_input || n_remain != 0 || params.interactive) {
-        if (!waiting_input) {
-            // predict
-            if (embd.size() > 0) {
-                // infinite text generation via context swapping
-                // if we run out of context:
-                // - take the n_keep first tokens from the original prompt (via n_past)
-                // - take half of the last (n_ctx - n_keep) tokens and recompute the logits in a batch
-                if (n_past + (int) embd.size() > n_ctx) {
-                    const int n_left = n_past - params.n_keep;
+    CpuGrant grant(cpu_arbiter, n_threads, kind);
+    stats.n_evals++;
+    stats.t_cpu_wait_us += grant.getWaitUs();
+    stats.last_n_threads = grant.getThreads();
 
-                    n_past = params.n_keep;
+    return llama_eval(ctx, tokens, n_tokens, n_past, grant.getThreads());
+}
 
-                    // insert n_left/2 tokens at the start of embd from last_n_tokens
-                    embd.insert(embd.begin(), last_n_tokens.begin() + n_ctx - n_left/2 - embd.size(), last_n_tokens.end() - embd.size());
+// greedily generates draft tokens with the draft model after bringing its context in sync with tokens
+static std::vector<llama_token> propose_model_draft(const gpt_params& params, llama_context* draft_ctx,
+                                                   std::vector<llama_token>& draft_ctx_tokens,
+                                                   const std::vector<llama_token>& tokens, int n_draft, int n_threads,
+                                                   CpuArbiter* cpu_arbiter, LlamaModelStats& stats)
+{
+    // reuse the common prefix, evaluate the rest
+    size_t n_common = 0;
+    while (n_common < draft_ctx_tokens.size() && n_common < tokens.size() &&
+           draft_ctx_tokens[n_common] == tokens[n_common]) {
+        ++n_common;
+    }
+    if (n_common == tokens.size()) {
+        // logits of the last token are needed
+        --n_common;
+    }
 
-                    //printf("\n---\n");
-                    //printf("resetting: '");
-                    //for (int i = 0; i < (int) embd.size(); i++) {
-                    //    printf("%s", llama_token_to_str(ctx, embd[i]));
-                    //}
-                    //printf("'\n");
-                    //printf("\n---\n");
-                }
+    for (size_t i = n_common; i < tokens.size(); i += params.n_batch) {
+        const int n = std::min<int>(params.n_batch, tokens.size() - i);
+        if (eval_llama(draft_ctx, tokens.data() + i, n, i, n_threads, cpu_arbiter, CpuArbiter::eDecode, stats)) {
+            fprintf(stderr, "%s : failed to eval\n", __func__);
+            throw std::runtime_error("failed to eval");
+        }
+    }
+    draft_ctx_tokens = tokens;
 
-                if (llama_eval(ctx, embd.data(), embd.size(), n_past, params.n_threads)) {
-                    fprintf(stderr, "%s : failed to eval\n", __func__);
-                    throw std::runtime_error("failed to eval");
-                }
-            }
+    const int n_vocab = llama_n_vocab(draft_ctx);
 
-            n_past += embd.size();
-            embd.clear();
+    std::vector<llama_token> draft;
+    while ((int) draft.size() < n_draft) {
+        const float* logits = llama_get_logits(draft_ctx);
+        const llama_token id = std::max_element(logits, logits + n_vocab) - logits;
+        draft.push_back(id);
 
-            if ((int) embd_inp.size() <= n_consumed && !is_interacting) {
-                // out of user input, sample next token
-                const int32_t top_k          = params.top_k;
-                const float   top_p          = params.top_p;
-                const float   temp           = params.temp;
-                const float   repeat_penalty = params.repeat_penalty;
+        if ((int) draft.size() == n_draft || id == llama_token_eos()) {
+            break;
+        }
 
-                llama_token id = 0;
+        if (eval_llama(draft_ctx, &id, 1, draft_ctx_tokens.size(), n_threads, cpu_arbiter, CpuArbiter::eDecode,
+                       stats)) {
+            fprintf(stderr, "%s : failed to eval\n", __func__);
+            throw std::runtime_error("failed to eval");
+        }
+        draft_ctx_tokens.push_back(id);
+    }
 
-                {
-                    auto logits = llama_get_logits(ctx);
+    return draft;
+}
 
-                    if (params.ignore_eos) {
-                        logits[llama_token_eos()] = 0;
-                    }
+static constexpr const char* kWeightsMemfdName = "llama-weights";
 
-                    id = llama_sample_top_p_top_k(ctx,
-                            last_n_tokens.data() + n_ctx - params.repeat_last_n,
-                            params.repeat_last_n, top_k, top_p, temp, repeat_penalty);
+// anonymous buffers smaller than this are allocator arenas and tensor metadata, they are never wiped
+static constexpr uintptr_t kMinScratchSize = 16 * 1024 * 1024;
 
-                    last_n_tokens.erase(last_n_tokens.begin());
-                    last_n_tokens.push_back(id);
-                }
+// copies the model file into a sealed memfd, the weights are then mapped from shared memory, which all forked chats
+// map at the same pages regardless of page cache pressure on the model file
+static int create_weights_memfd(const std::string& path) {
+    int src = open(path.c_str(), O_RDONLY);
+    if (src < 0) {
+        fprintf(stderr, "%s: error: failed to open '%s'\n", __func__, path.c_str());
+        throw std::runtime_error("failed to open model");
+    }
 
-                // replace end of text token with newline token when in interactive mode
+    int fd = memfd_create(kWeightsMemfdName, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        close(src);
+        throw std::runtime_error("memfd_create failed");
+    }
+
+    std::vector<char> buf(4 * 1024 * 1024);
+    size_t n_copied = 0;
+    while (true) {
+        auto n_read = read(src, buf.data(), buf.size());
+        if (n_read == 0) {
+            break;
+        }
+        if (n_read < 0 || write(fd, buf.data(), n_read) != n_read) {
+            close(src);
+            close(fd);
+            throw std::runtime_error("failed to copy model to memfd");
+        }
+        n_copied += n_read;
+    }
+
+    // the copy is the only one needed, drop the file from the page cache
+    posix_fadvise(src, 0, 0, POSIX_FADV_DONTNEED);
+    close(src);
+
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) != 0) {
+        fprintf(stderr, "%s: warning: failed to seal weights memfd\n", __func__);
+    }
+
+    fprintf(stderr, "%s: copied %zu MB of '%s' to memfd\n", __func__, n_copied / (1024 * 1024), path.c_str());
+    return fd;
+}
+
+// weights_path, if given, is set to where the process and its forks can map the same weights again, or to empty string
+// if they are not mapped
+static llama_context* init_llama_context(const std::string& path, llama_context_params lparams,
+                                         const ApiParams& apiParams, std::string* weights_path = nullptr) {
+    lparams.use_mmap = lparams.use_mmap && apiParams.weightsMapping != "heap";
+    if (!lparams.use_mmap || apiParams.weightsMapping != "memfd") {
+        if (weights_path) {
+            *weights_path = lparams.use_mmap ? path : std::string();
+        }
+        return llama_init_from_file(path.c_str(), lparams);
+    }
+
+    // the mapping keeps the memfd alive after it is closed, it stays open only to be mapped again
+    int fd = create_weights_memfd(path);
+    const auto fd_path = "/proc/self/fd/" + std::to_string(fd);
+    auto ctx = llama_init_from_file(fd_path.c_str(), lparams);
+    if (weights_path) {
+        *weights_path = fd_path;
+    } else {
+        close(fd);
+    }
+
+    return ctx;
+}
+
+// applies huge page and fork policies to the mappings created while loading models, i.e. regions missing in before.
+// Regions containing any of the keep pointers (KV cache, logits) hold state that forked chats continue from
+static void apply_mapping_policy(const ApiParams& apiParams, const std::vector<MemoryRegion>& before,
+                                 const std::vector<std::string>& model_paths, const std::vector<const void*>& keep) {
+    auto is_new = [&](const MemoryRegion& region) {
+        // regions merged with mappings that existed before may contain unrelated data
+        return std::none_of(before.begin(), before.end(), [&](const MemoryRegion& old) {
+            return old.begin < region.end && region.begin < old.end;
+        });
+    };
+
+    auto is_weights = [&](const MemoryRegion& region) {
+        return region.path.rfind(std::string("/memfd:") + kWeightsMemfdName, 0) == 0 ||
+               std::find(model_paths.begin(), model_paths.end(), region.path) != model_paths.end();
+    };
+
+    auto is_kept = [&](const MemoryRegion& region) {
+        return std::any_of(keep.begin(), keep.end(), [&](const void* ptr) {
+            auto addr = reinterpret_cast<uintptr_t>(ptr);
+            return ptr != nullptr && region.begin <= addr && addr < region.end;
+        });
+    };
+
+    size_t n_weights = 0, n_wiped = 0, n_hugepage = 0;
+    for (const auto& region : read_memory_regions()) {
+        if (!is_new(region)) {
+            continue;
+        }
+
+        auto addr = reinterpret_cast<void*>(region.begin);
+        auto size = region.end - region.begin;
+        auto weights = is_weights(region);
+        auto anonymous = region.path.empty();
+        if (weights) {
+            n_weights += size;
+        }
+
+        if (apiParams.hugePages == "weights" && weights) {
+            if (madvise(addr, size, MADV_HUGEPAGE) == 0) {
+                n_hugepage += size;
+            }
+        } else if (apiParams.hugePages == "never" && (weights || anonymous)) {
+            // khugepaged collapsing a range in a forked chat copies the whole huge page, shared parts included
+            madvise(addr, size, MADV_NOHUGEPAGE);
+        }
+
+#ifdef MADV_WIPEONFORK
+        // with heap mapping the weights themselves are anonymous, so scratch cannot be told apart from them
+        if (apiParams.scratch == "wipe" && apiParams.weightsMapping != "heap" && anonymous && size >= kMinScratchSize &&
+            !is_kept(region)) {
+            if (madvise(addr, size, MADV_WIPEONFORK) == 0) {
+                n_wiped += size;
+            }
+        }
+#endif
+    }
+
+    if (apiParams.scratch == "wipe" && apiParams.weightsMapping == "heap") {
+        fprintf(stderr, "%s: warning: scratch buffers are not wiped with heap weights mapping\n", __func__);
+    }
+
+    fprintf(stderr, "%s: weights mapping = %s, %zu MB mapped, %zu MB with huge pages, %zu MB of scratch wiped on fork\n",
+            __func__, apiParams.weightsMapping.c_str(), n_weights / (1024 * 1024), n_hugepage / (1024 * 1024),
+            n_wiped / (1024 * 1024));
+}
+
+// identifies the model file, the CPU and the settings the tuning depends on
+static std::string autotune_key(const gpt_params& params) {
+    struct stat st = {};
+    stat(params.model.c_str(), &st);
+
+    std::string cpu_model;
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    std::string line;
+    while (std::getline(cpuinfo, line)) {
+        if (line.rfind("model name", 0) == 0) {
+            cpu_model = line.substr(line.find(':') + 2);
+            break;
+        }
+    }
+
+    std::ostringstream key;
+    key << params.model << "|" << st.st_size << "|" << st.st_mtime << "|" << cpu_model << "|"
+        << std::thread::hardware_concurrency() << "|" << params.n_ctx << "|" << params.memory_f16;
+
+    // keys are stored one per line
+    auto str = key.str();
+    std::replace(str.begin(), str.end(), '\n', ' ');
+    return str;
+}
+
+static bool read_autotune_cache(const std::string& path, const std::string& key, LlamaTuning& tuning) {
+    std::ifstream file(path);
+    std::string line;
+    while (std::getline(file, line)) {
+        auto separator = line.rfind('\t');
+        if (separator == std::string::npos || line.compare(0, separator, key) != 0) {
+            continue;
+        }
+
+        std::istringstream values(line.substr(separator + 1));
+        return (bool) (values >> tuning.n_threads_prefill >> tuning.n_threads_decode >> tuning.n_batch);
+    }
+
+    return false;
+}
+
+static void write_autotune_cache(const std::string& path, const std::string& key, const LlamaTuning& tuning) {
+    std::vector<std::string> lines;
+    {
+        std::ifstream file(path);
+        std::string line;
+        while (std::getline(file, line)) {
+            if (line.rfind(key + "\t", 0) != 0) {
+                lines.push_back(line);
+            }
+        }
+    }
+    lines.push_back(key + "\t" + std::to_string(tuning.n_threads_prefill) + " " +
+                    std::to_string(tuning.n_threads_decode) + " " + std::to_string(tuning.n_batch));
+
+    // replaced at once, so that servers starting at the same time do not read a partial file
+    auto tmp_path = path + ".tmp" + std::to_string(getpid());
+    {
+        std::ofstream file(tmp_path);
+        for (const auto& line : lines) {
+            file << line << "\n";
+        }
+    }
+    if (rename(tmp_path.c_str(), path.c_str()) != 0) {
+        fprintf(stderr, "%s: warning: failed to write '%s'\n", __func__, path.c_str());
+    }
+}
+
+// tokens per second evaluating tokens from position n_past in chunks of n_batch
+static double measure_eval(llama_context* ctx, const std::vector<llama_token>& tokens, int n_past, int n_batch,
+                           int n_threads) {
+    const auto t_start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < tokens.size(); i += n_batch) {
+        const int n = std::min<int>(n_batch, tokens.size() - i);
+        if (llama_eval(ctx, tokens.data() + i, n, n_past + i, n_threads)) {
+            throw std::runtime_error("failed to eval");
+        }
+    }
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - t_start;
+
+    return tokens.size() / elapsed.count();
+}
+
+// measures prompt eval throughput over thread counts and batch sizes, and single token decode over thread counts,
+// with a synthetic prompt; prefill and decode get their own thread count, as decode is bound by memory bandwidth
+static LlamaTuning autotune_llama_model(const gpt_params& params, llama_context* ctx) {
+    const int n_hw = std::max(1u, std::thread::hardware_concurrency());
+    const int n_prompt = std::min(256, llama_n_ctx(ctx) / 2);
+    const int n_decode = 8;
+
+    std::vector<llama_token> prompt;
+    while ((int) prompt.size() < n_prompt) {
+        auto tokens = ::llama_tokenize(ctx, " The quick brown fox jumps over the lazy dog.", false);
+        prompt.insert(prompt.end(), tokens.begin(), tokens.end());
+    }
+    prompt.resize(n_prompt);
+    const std::vector<llama_token> decode(prompt.begin(), prompt.begin() + n_decode);
+
+    std::vector<int> threads_grid = {n_hw, std::max(1, n_hw / 2), params.n_threads};
+    for (int n = 1; n < n_hw; n *= 2) {
+        threads_grid.push_back(n);
+    }
+    std::sort(threads_grid.begin(), threads_grid.end());
+    threads_grid.erase(std::unique(threads_grid.begin(), threads_grid.end()), threads_grid.end());
+
+    std::vector<int> batch_grid;
+    for (int n = 8; n <= n_prompt; n *= 2) {
+        batch_grid.push_back(n);
+    }
+    if (batch_grid.empty()) {
+        batch_grid.push_back(n_prompt);
+    }
+
+    fprintf(stderr, "%s: calibrating with a %d token prompt\n", __func__, n_prompt);
+
+    // warm up the weights pages
+    measure_eval(ctx, prompt, 0, batch_grid.back(), n_hw);
+
+    LlamaTuning tuning = {params.n_threads, params.n_threads, params.n_batch};
+    const int n_batch_probe = std::min(64, n_prompt);
+
+    double best_prefill = 0.0, best_decode = 0.0;
+    for (int n_threads : threads_grid) {
+        const double prefill = measure_eval(ctx, prompt, 0, n_batch_probe, n_threads);
+        const double decode_rate = measure_eval(ctx, decode, n_prompt, 1, n_threads);
+        fprintf(stderr, "%s: n_threads = %3d: prefill %8.2f tokens/s, decode %8.2f tokens/s\n", __func__, n_threads,
+                prefill, decode_rate);
+
+        if (prefill > best_prefill) {
+            best_prefill = prefill;
+            tuning.n_threads_prefill = n_threads;
+        }
+        if (decode_rate > best_decode) {
+            best_decode = decode_rate;
+            tuning.n_threads_decode = n_threads;
+        }
+    }
+
+    best_prefill = 0.0;
+    for (int n_batch : batch_grid) {
+        const double prefill = measure_eval(ctx, prompt, 0, n_batch, tuning.n_threads_prefill);
+        fprintf(stderr, "%s: n_batch = %3d: prefill %8.2f tokens/s\n", __func__, n_batch, prefill);
+
+        // larger batches are coarser preemption points for decoding chats, so they have to be clearly faster
+        if (prefill > best_prefill * 1.05) {
+            best_prefill = prefill;
+            tuning.n_batch = n_batch;
+        }
+    }
+
+    return tuning;
+}
+
+static void load_llama_model(gpt_params& params, const ApiParams& apiParams, llama_context*& ctx, bool& logits_all,
+                             std::string& weights_path)
+{
+    if (params.embedding) {
+        fprintf(stderr, "%s: embedding mode: the embedding of the last evaluated token is kept\n", __func__);
+    }
+
+    if (params.n_ctx > 2048) {
+        fprintf(stderr, "%s: warning: model does not support context sizes greater than 2048 tokens (%d specified);"
+                "expect poor results\n", __func__, params.n_ctx);
+    }
+
+    if (params.seed <= 0) {
+        params.seed = time(NULL);
+    }
+
+    fprintf(stderr, "%s: seed = %d\n", __func__, params.seed);
+
+    // load the model
+    {
+        auto lparams = llama_context_default_params();
+
+        lparams.n_ctx      = params.n_ctx;
+        lparams.n_parts    = params.n_parts;
+        lparams.seed       = params.seed;
+        lparams.f16_kv     = params.memory_f16;
+        // with all rows every eval copies n_tokens x n_vocab floats and every chat writes its own copy of them, only
+        // speculative decoding needs them in the chat; scoring evaluates in a context of its own
+        lparams.logits_all = logits_all = apiParams.speculative != "off";
+        lparams.use_mmap   = params.use_mmap;
+        lparams.use_mlock  = params.use_mlock;
+        lparams.embedding  = params.embedding;
+
+        ctx = init_llama_context(params.model, lparams, apiParams, &weights_path);
+
+        if (ctx == NULL) {
+            fprintf(stderr, "%s: error: failed to load model '%s'\n", __func__, params.model.c_str());
+
+            throw std::runtime_error("failed to load model");
+        }
+    }
+
+    // print system information
+    {
+        fprintf(stderr, "\n");
+        fprintf(stderr, "system_info: n_threads = %d / %d | %s\n",
+                params.n_threads, std::thread::hardware_concurrency(), llama_print_system_info());
+    }
+
+    // determine the maximum memory usage needed to do inference for the given n_batch and n_predict parameters
+    // uncomment the "used_mem" line in llama.cpp to see the results
+    if (params.mem_test) {
+        throw std::runtime_error("mem_test param not supported");
+    }
+}
+
+// tunes thread counts and batch size for the host, runners forked later inherit the result
+static LlamaTuning tune_llama_model(gpt_params& params, const ApiParams& apiParams, llama_context* ctx) {
+    LlamaTuning tuning = {params.n_threads, params.n_threads, params.n_batch};
+    if (apiParams.autotune != "off") {
+        const auto key = autotune_key(params);
+        if (apiParams.autotune == "force" || !read_autotune_cache(apiParams.autotuneCache, key, tuning)) {
+            tuning = autotune_llama_model(params, ctx);
+            write_autotune_cache(apiParams.autotuneCache, key, tuning);
+        }
+        params.n_batch = tuning.n_batch;
+
+        fprintf(stderr, "%s: autotune: n_threads = %d (prefill), %d (decode), n_batch = %d\n", __func__,
+                tuning.n_threads_prefill, tuning.n_threads_decode, tuning.n_batch);
+    }
+
+    return tuning;
+}
+
+// evaluates the preamble shared by chat prompts in the root context, so that chats forked from it skip these tokens.
+// With a snapshot file the KV cache is saved after the first evaluation and loaded on later starts
+static std::vector<llama_token> load_llama_preamble(const gpt_params& params, const ApiParams& apiParams,
+                                                    const LlamaModelSettings& settings, llama_context* ctx) {
+    std::ifstream preamble_file(apiParams.preambleFile);
+    if (!preamble_file) {
+        fprintf(stderr, "%s: error: failed to open '%s'\n", __func__, apiParams.preambleFile.c_str());
+        throw std::runtime_error("failed to open preamble file");
+    }
+    std::stringstream preamble;
+    preamble << preamble_file.rdbuf();
+
+    // tokenized like the prompt in init, a token that merges across the end of the preamble just is not reused
+    auto tokens = ::llama_tokenize(ctx, " " + preamble.str(), true);
+    if ((int) tokens.size() > llama_n_ctx(ctx) - 4) {
+        throw std::runtime_error("preamble is too long");
+    }
+
+    const size_t kv_size = llama_get_kv_cache_size(ctx);
+    const auto key = autotune_key(params);
+
+    if (!apiParams.preambleSnapshot.empty()) {
+        try {
+            std::ifstream file(apiParams.preambleSnapshot, std::ios::binary);
+            if (file && read_string(file) == key && read_vector<llama_token>(file) == tokens) {
+                const auto header = read_kv_delta_header(file);
+                if (header.size == kv_size) {
+                    std::vector<uint8_t> kv(kv_size, 0);
+                    apply_kv_delta(file, kv.data(), kv.size());
+                    llama_set_kv_cache(ctx, kv.data(), kv.size(), header.nTokens);
+
+                    fprintf(stderr, "%s: %zu preamble tokens loaded from '%s'\n", __func__, tokens.size(),
+                            apiParams.preambleSnapshot.c_str());
+                    return tokens;
+                }
+            }
+        } catch (const std::exception& e) {
+            fprintf(stderr, "%s: warning: ignoring snapshot '%s': %s\n", __func__, apiParams.preambleSnapshot.c_str(),
+                    e.what());
+        }
+    }
+
+    for (size_t i = 0; i < tokens.size(); i += params.n_batch) {
+        const int n = std::min<int>(params.n_batch, tokens.size() - i);
+        if (llama_eval(ctx, tokens.data() + i, n, i, settings.n_threads_prefill)) {
+            fprintf(stderr, "%s : failed to eval\n", __func__);
+            throw std::runtime_error("failed to eval");
+        }
+    }
+    fprintf(stderr, "%s: %zu preamble tokens evaluated\n", __func__, tokens.size());
+
+    if (!apiParams.preambleSnapshot.empty()) {
+        // written aside and renamed, so that servers starting at the same time do not read a partial file
+        const auto tmp_path = apiParams.preambleSnapshot + ".tmp" + std::to_string(getpid());
+        {
+            std::ofstream file(tmp_path, std::ios::binary);
+            write_string(file, key);
+            write_vector(file, tokens);
+            write_kv_delta(file, llama_get_kv_cache(ctx), nullptr, kv_size, llama_get_kv_cache_token_count(ctx),
+                           false);
+        }
+        if (rename(tmp_path.c_str(), apiParams.preambleSnapshot.c_str()) != 0) {
+            fprintf(stderr, "%s: warning: failed to write '%s'\n", __func__, apiParams.preambleSnapshot.c_str());
+        }
+    }
+
+    return tokens;
+}
+
+static void load_llama_draft_model(const gpt_params& params, const ApiParams& apiParams, llama_context* ctx,
+                                   llama_context*& draft_ctx)
+{
+    auto lparams = llama_context_default_params();
+
+    lparams.n_ctx      = params.n_ctx;
+    lparams.seed       = params.seed;
+    lparams.f16_kv     = params.memory_f16;
+    lparams.use_mmap   = params.use_mmap;
+    lparams.use_mlock  = params.use_mlock;
+
+    draft_ctx = init_llama_context(apiParams.draftModel, lparams, apiParams);
+
+    if (draft_ctx == NULL) {
+        fprintf(stderr, "%s: error: failed to load draft model '%s'\n", __func__, apiParams.draftModel.c_str());
+
+        throw std::runtime_error("failed to load draft model");
+    }
+
+    if (llama_n_vocab(draft_ctx) != llama_n_vocab(ctx)) {
+        fprintf(stderr, "%s: error: draft model vocabulary does not match the model\n", __func__);
+
+        throw std::runtime_error("draft model vocabulary mismatch");
+    }
+
+    fprintf(stderr, "%s: draft model loaded from '%s'\n", __func__, apiParams.draftModel.c_str());
+}
+
+static void init_llama_model(gpt_params& params, const char* input_prefix, const char* output_prefix,
+                             llama_context*& ctx, std::vector<llama_token>& inp_pfx, std::vector<llama_token>& inp_sfx,
+                             std::vector<llama_token>& embd_inp, std::vector<llama_token>& embd,
+                             std::vector<llama_token>& last_n_tokens, std::vector<llama_token>& llama_token_newline,
+                             int& n_remain, int& n_past, int& n_ctx, int& n_consumed, std::atomic<bool>& is_interacting,
+                             bool& input_noecho, bool& is_antiprompt, bool& waiting_input,
+                             const std::vector<llama_token>& prompt_tokens)
+{
+    std::cout << params.prompt << std::endl;
+    if (prompt_tokens.empty()) {
+        // Add a space in front of the first character to match OG llama tokenizer behavior
+        params.prompt.insert(0, 1, ' ');
+
+        // tokenize the prompt
+        embd_inp = ::llama_tokenize(ctx, params.prompt, true);
+    } else {
+        // the client tokenized the prompt itself
+        embd_inp = prompt_tokens;
+    }
+
+    n_ctx = llama_n_ctx(ctx);
+
+    if ((int) embd_inp.size() > n_ctx - 4) {
+        fprintf(stderr, "%s: error: prompt is too long (%d tokens, max %d)\n", __func__, (int) embd_inp.size(), n_ctx - 4);
+        throw std::runtime_error("prompt is too long");
+    }
+
+    // number of tokens to keep when resetting context
+    if (params.n_keep < 0 || params.n_keep > (int)embd_inp.size() || params.instruct) {
+        params.n_keep = (int)embd_inp.size();
+    }
+
+    // prefix & suffix for instruct mode
+    inp_pfx = ::llama_tokenize(ctx, input_prefix, true);
+    inp_sfx = ::llama_tokenize(ctx, output_prefix, false);
+
+    // in instruct mode, we inject a prefix and a suffix to each input by the user
+    if (params.instruct) {
+        params.interactive_start = true;
+        params.antiprompt.push_back(input_prefix);
+    }
+
+    // enable interactive mode if reverse prompt or interactive start is specified
+    if (params.antiprompt.size() != 0 || params.interactive_start) {
+        params.interactive = true;
+    }
+
+    // determine newline token
+    llama_token_newline = ::llama_tokenize(ctx, "\n", false);
+
+    if (params.verbose_prompt) {
+        fprintf(stderr, "\n");
+        fprintf(stderr, "%s: prompt: '%s'\n", __func__, params.prompt.c_str());
+        fprintf(stderr, "%s: number of tokens in prompt = %zu\n", __func__, embd_inp.size());
+        for (int i = 0; i < (int) embd_inp.size(); i++) {
+            fprintf(stderr, "%6d -> '%s'\n", embd_inp[i], llama_token_to_str(ctx, embd_inp[i]));
+        }
+        if (params.n_keep > 0) {
+        fprintf(stderr, "%s: static prompt based on n_keep: '", __func__);
+            for (int i = 0; i < params.n_keep; i++) {
+                fprintf(stderr, "%s", llama_token_to_str(ctx, embd_inp[i]));
+            }
+            fprintf(stderr, "'\n");
+        }
+        fprintf(stderr, "\n");
+    }
+
+    if (params.interactive) {
+        fprintf(stderr, "%s: interactive mode on.\n", __func__);
+
+        if (params.antiprompt.size()) {
+            for (auto antiprompt : params.antiprompt) {
+                fprintf(stderr, "Reverse prompt: '%s'\n", antiprompt.c_str());
+            }
+        }
+
+        if (!params.input_prefix.empty()) {
+            fprintf(stderr, "Input prefix: '%s'\n", params.input_prefix.c_str());
+        }
+    }
+    fprintf(stderr, "sampling: temp = %f, top_k = %d, top_p = %f, repeat_last_n = %i, repeat_penalty = %f\n",
+        params.temp, params.top_k, params.top_p, params.repeat_last_n, params.repeat_penalty);
+    fprintf(stderr, "generate: n_ctx = %d, n_batch = %d, n_predict = %d, n_keep = %d\n", n_ctx, params.n_batch, params.n_predict, params.n_keep);
+    fprintf(stderr, "\n\n");
+
+    // TODO: replace with ring-buffer
+    last_n_tokens.resize(n_ctx);
+    std::fill(last_n_tokens.begin(), last_n_tokens.end(), 0);
+
+    if (params.interactive) {
+        fprintf(stderr, "== Running in interactive mode. ==\n"
+#if defined (__unix__) || (defined (__APPLE__) && defined (__MACH__)) || defined (_WIN32)
+               " - Press Ctrl+C to interject at any time.\n"
+#endif
+               " - Press Return to return control to LLaMa.\n"
+               " - If you want to submit another line, end your input in '\\'.\n\n");
+        is_interacting = params.interactive_start;
+    }
+
+    is_antiprompt = false;
+    input_noecho  = false;
+
+    n_past     = 0;
+    n_remain   = params.n_predict;
+    n_consumed = 0;
+
+    embd.clear();
+    waiting_input = false;
+}
+
+static void init_llama_model(gpt_params& params, const char* inputPrefix, const char* outputPrefix,
+                             LlamaModelContext& context, const std::vector<llama_token>& prompt_tokens = {})
+{
+    init_llama_model(params, inputPrefix, outputPrefix, context.ctx, context.inp_pfx, context.inp_sfx, context.embd_inp,
+                     context.embd, context.last_n_tokens, context.llama_token_newline, context.n_remain, context.n_past,
+                     context.n_ctx, context.n_consumed, context.is_interacting, context.input_noecho,
+                     context.is_antiprompt, context.waiting_input, prompt_tokens);
+
+    // the prompt tokens the root already evaluated as the preamble are reused, at least one token is evaluated to get
+    // its logits
+    size_t n_reuse = 0;
+    while (n_reuse < context.ctx_tokens.size() && n_reuse + 1 < context.embd_inp.size() &&
+           context.ctx_tokens[n_reuse] == context.embd_inp[n_reuse]) {
+        ++n_reuse;
+    }
+    for (size_t i = 0; i < n_reuse; ++i) {
+        context.last_n_tokens.erase(context.last_n_tokens.begin());
+        context.last_n_tokens.push_back(context.embd_inp[i]);
+    }
+    context.ctx_tokens.resize(n_reuse);
+    context.n_past = context.n_consumed = n_reuse;
+    context.stats.n_prompt_reused = n_reuse;
+
+    context.speculative.clear();
+    context.overflow = LlamaOverflowState();
+}
+
+// drops the part of a streamed input evaluated so far, the chat waits for input as it did before the first piece. The
+// KV entries of the input are overwritten by the next one
+static void rollback_llama_input(const gpt_params& params, LlamaModelContext& context) {
+    auto& stream = context.stream;
+
+    // rollovers since the input started moved its start, or dropped it along with all turns before it, so that the
+    // context keeps nothing after n_keep that came before the input
+    int n_start = params.n_keep;
+    if (!context.overflow.turn_starts.empty()) {
+        n_start = context.overflow.turn_starts.back();
+        context.overflow.turn_starts.pop_back();
+    }
+
+    // tokens pending in front of the input are still evaluated with the next one
+    context.n_past = std::min(context.n_past, n_start);
+    context.embd.resize(std::min<int>(context.embd.size(), n_start - context.n_past));
+    context.ctx_tokens.resize(std::min<size_t>(context.ctx_tokens.size(), context.n_past));
+
+    context.embd_inp.resize(stream.n_turn_start);
+    context.n_consumed = std::min<int>(context.n_consumed, stream.n_turn_start);
+    context.last_n_tokens = std::move(stream.last_n_tokens);
+
+    context.speculative.clear();
+    context.stream = LlamaInputStream();
+    context.waiting_input = true;
+}
+
+// frees context space: keeps the n_keep first tokens and moves some of the recent ones, as the policy says and at most
+// n_budget, in front of embd to be evaluated again after them
+static void rollover_llama_context(const gpt_params& params, const LlamaModelSettings& settings, int n_ctx, int& n_past,
+                                   std::vector<llama_token>& embd, const std::vector<llama_token>& last_n_tokens,
+                                   LlamaOverflowState& overflow, int n_budget) {
+    const int n_left = n_past - params.n_keep;
+
+    int n_recent = n_left/2;
+    if (settings.overflow == OverflowPolicy::window) {
+        // a window close to the whole context would roll over again after a few tokens
+        n_recent = std::min(n_left*3/4, settings.overflow_window);
+    } else if (settings.overflow == OverflowPolicy::turns) {
+        // the earliest turn that fits, otherwise half as usual
+        for (auto start : overflow.turn_starts) {
+            if (start >= params.n_keep && start <= n_past && n_past - start <= std::min(n_left/2, n_budget)) {
+                n_recent = n_past - start;
+                break;
+            }
+        }
+    }
+    n_recent = std::max(0, std::min({n_recent, n_budget, n_ctx - params.n_keep - (int) embd.size()}));
+
+    // last_n_tokens ends with embd, which is not evaluated yet
+    embd.insert(embd.begin(), last_n_tokens.end() - embd.size() - n_recent, last_n_tokens.end() - embd.size());
+
+    // positions of the kept turns move with the tokens
+    const int n_first = n_past - n_recent;
+    std::vector<int> turn_starts;
+    for (auto start : overflow.turn_starts) {
+        if (start >= n_first) {
+            turn_starts.push_back(params.n_keep + start - n_first);
+        }
+    }
+    overflow.turn_starts = std::move(turn_starts);
+    overflow.rollover_pending = true;
+
+    n_past = params.n_keep;
+}
+
+// pieces of the vocabulary do not have a space after another character, so text cut before such a space tokenizes the
+// same as when it goes on; returns where the last such cut is, the text after it may still merge with what follows
+static size_t get_llama_stable_text_size(const std::string& text) {
+    for (size_t i = text.size(); i-- > 1;) {
+        if (text[i] == ' ' && text[i - 1] != ' ') {
+            return i;
+        }
+    }
+    return 0;
+}
+
+template <typename UpdateFunction>
+void run_llama_model(const gpt_params& params, llama_context* ctx, std::vector<llama_token>& inp_pfx,
+                     std::vector<llama_token>& inp_sfx, std::vector<llama_token>& embd_inp,
+                     std::vector<llama_token>& embd, std::vector<llama_token>& last_n_tokens,
+                     std::vector<llama_token>& llama_token_newline, int& n_remain, int& n_past, int& n_ctx,
+                     int& n_consumed, std::atomic<bool>& is_interacting, bool& input_noecho, bool& is_antiprompt,
+                     bool& waiting_input, std::mt19937& rng, double& logprob, std::vector<llama_token>& ctx_tokens,
+                     LlamaSamplerScratch& sampler, LlamaSpeculativeState& speculative, llama_context* draft_ctx,
+                     LlamaOverflowState& overflow, ModelTurn& turn, LlamaReplay& replay, LlamaInputStream& stream,
+                     LlamaModelStats& stats, CpuArbiter* cpu_arbiter, bool logits_all, int& last_logits_row,
+                     const LlamaModelSettings& settings, const std::string& input, UpdateFunction update)
+{
+    const int n_vocab = llama_n_vocab(ctx);
+
+    while (waiting_input || n_remain != 0 || params.interactive) {
+        if (!waiting_input) {
+            // predict
+            if (embd.size() > 0) {
+                // infinite text generation via context swapping
+                // if we run out of context:
+                // - take the n_keep first tokens from the original prompt (via n_past)
+                // - take some of the last (n_ctx - n_keep) tokens, as the overflow policy says, and recompute the
+                //   logits in a batch
+                if (n_past + (int) embd.size() > n_ctx) {
+                    const int n_before = embd.size();
+                    rollover_llama_context(params, settings, n_ctx, n_past, embd, last_n_tokens, overflow, n_ctx);
+                    ++stats.n_rollovers;
+                    stats.n_rollover_tokens += embd.size() - n_before;
+
+                    speculative.clear();
+                }
+
+                if (embd.size() == 1 && speculative.n_accepted < speculative.draft.size() &&
+                    embd[0] == speculative.draft[speculative.n_accepted]) {
+                    // sampled token matches the draft, it is already evaluated
+                    ++speculative.n_accepted;
+                    ++stats.n_accepted;
+                } else {
+                    speculative.clear();
+
+                    // speculative decoding: propose draft tokens to verify along with the sampled one
+                    std::vector<llama_token> draft;
+                    const bool sampling = embd.size() == 1 && (int) embd_inp.size() <= n_consumed && !is_interacting &&
+                                          !stream.open;
+                    if (sampling && settings.speculative != SpeculativeMode::off) {
+                        int n_draft = std::min(settings.draft_n, n_ctx - n_past - 1);
+                        if (n_remain > 0) {
+                            n_draft = std::min(n_draft, n_remain - 1);
+                        }
+
+                        if (n_draft > 0) {
+                            if (settings.speculative == SpeculativeMode::ngram) {
+                                draft = propose_ngram_draft(last_n_tokens, settings.ngram_n, n_draft);
+                            } else {
+                                auto tokens = ctx_tokens;
+                                tokens.resize(n_past);
+                                tokens.push_back(embd[0]);
+                                draft = propose_model_draft(params, draft_ctx, speculative.draft_ctx_tokens, tokens,
+                                                            n_draft, settings.n_threads_decode, cpu_arbiter, stats);
+                            }
+                        }
+                    }
+
+                    auto batch = embd;
+                    batch.insert(batch.end(), draft.begin(), draft.end());
+
+                    // prefill, including the tokens recomputed after context swapping and a replayed reply, goes in
+                    // n_batch chunks
+                    const auto kind = sampling ? CpuArbiter::eDecode : CpuArbiter::ePrefill;
+                    const int n_chunk = sampling ? batch.size() : params.n_batch;
+                    const int64_t t_eval_us = llama_time_us();
+                    for (int i = 0; i < (int) batch.size(); i += n_chunk) {
+                        const int n = std::min<int>(n_chunk, batch.size() - i);
+                        const int n_threads = sampling ? settings.n_threads_decode : settings.n_threads_prefill;
+                        if (eval_llama(ctx, batch.data() + i, n, n_past + i, n_threads, cpu_arbiter, kind, stats)) {
+                            fprintf(stderr, "%s : failed to eval\n", __func__);
+                            throw std::runtime_error("failed to eval");
+                        }
+                        last_logits_row = logits_all ? n - 1 : 0;
+                    }
+
+                    if (overflow.rollover_pending) {
+                        overflow.rollover_pending = false;
+                        stats.last_rollover_us = llama_time_us() - t_eval_us;
+                        stats.t_rollover_us += stats.last_rollover_us;
+                    }
+
+                    if (!draft.empty()) {
+                        const float* logits = llama_get_logits(ctx);
+                        speculative.draft = std::move(draft);
+                        speculative.logits.assign(logits, logits + batch.size()*n_vocab);
+                        stats.n_drafted += speculative.draft.size();
+                    }
+                }
+
+                ctx_tokens.resize(n_past);
+                ctx_tokens.insert(ctx_tokens.end(), embd.begin(), embd.end());
+            }
+
+            n_past += embd.size();
+            embd.clear();
+
+            // a replayed reply that does not fit would roll the context over at another token than the recorded
+            // run did, so it is generated instead
+            bool replayed = false;
+            if (replay.pending && (int) embd_inp.size() <= n_consumed && !is_interacting) {
+                replay.pending = false;
+                if (n_past + (int) replay.tokens.size() <= n_ctx) {
+                    embd = replay.tokens;
+                    for (auto id : replay.tokens) {
+                        last_n_tokens.erase(last_n_tokens.begin());
+                        last_n_tokens.push_back(id);
+                    }
+                    n_remain -= replay.n_sampled;
+                    overflow.n_reply_tokens += replay.n_sampled;
+                    input_noecho = false;
+                    replay.applied = true;
+                    replayed = true;
+                }
+            }
+
+            if (!replayed && (int) embd_inp.size() <= n_consumed && !is_interacting && !stream.open) {
+                // out of user input, sample next token
+                const int32_t top_k          = params.top_k;
+                const float   top_p          = params.top_p;
+                const float   temp           = params.temp;
+                const float   repeat_penalty = params.repeat_penalty;
+
+                llama_token id = 0;
+
+                {
+                    // logits of the last accepted draft token, if the last eval was speculative
+                    auto logits = speculative.logits.empty()
+                            ? llama_get_logits(ctx) + last_logits_row*n_vocab
+                            : speculative.logits.data() + speculative.n_accepted*n_vocab;
+
+                    // the reply log-probability is taken from the unmodified logits, so eos is restored after sampling
+                    const float eos_logit = logits[llama_token_eos()];
+                    if (params.ignore_eos) {
+                        logits[llama_token_eos()] = 0;
+                    }
+
+                    const auto t_start = std::chrono::steady_clock::now();
+                    if (settings.sampler == SamplerMode::reference) {
+                        id = sample_top_p_top_k(logits, n_vocab, rng,
+                                last_n_tokens.data() + n_ctx - params.repeat_last_n,
+                                params.repeat_last_n, top_k, top_p, temp, repeat_penalty);
+                    } else {
+                        id = sample_top_p_top_k_fast(logits, n_vocab, rng,
+                                last_n_tokens.data() + n_ctx - params.repeat_last_n,
+                                params.repeat_last_n, top_k, top_p, temp, repeat_penalty, sampler);
+                    }
+                    stats.t_sample_us += std::chrono::duration_cast<std::chrono::microseconds>(
+                            std::chrono::steady_clock::now() - t_start).count();
+
+                    logits[llama_token_eos()] = eos_logit;
+                    logprob += token_logprob(logits, n_vocab, id);
+                    ++stats.n_sampled;
+                    ++overflow.n_reply_tokens;
+
+                    const int64_t t_token_us = llama_time_us();
+                    if (stats.t_last_token_us == 0) {
+                        stats.last_ttft_us = t_token_us - stats.t_input_us;
+                    } else {
+                        const int64_t t_gap_us = t_token_us - stats.t_last_token_us;
+                        stats.t_inter_token_us += t_gap_us;
+                        ++stats.n_inter_token;
+                        stats.last_max_inter_token_us = std::max<int64_t>(stats.last_max_inter_token_us, t_gap_us);
+                    }
+                    stats.t_last_token_us = t_token_us;
+
+                    last_n_tokens.erase(last_n_tokens.begin());
+                    last_n_tokens.push_back(id);
+                }
+
+                // replace end of text token with newline token when in interactive mode
                 if (id == llama_token_eos() && params.interactive && !params.instruct) {
                     id = llama_token_newline.front();
                     if (params.antiprompt.size() != 0) {
@@ -291,7 +1461,7 @@ void run_llama_model(const gpt_params& params, llama_context* ctx, std::vector<l
 
                 // decrement remaining sampling budget
                 --n_remain;
-            } else {
+            } else if (!stream.open || (int) embd_inp.size() - n_consumed >= params.n_batch) {
                 // some user input remains from prompt or interaction, forward it to processing
                 while ((int) embd_inp.size() > n_consumed) {
                     embd.push_back(embd_inp[n_consumed]);
@@ -308,13 +1478,20 @@ void run_llama_model(const gpt_params& params, llama_context* ctx, std::vector<l
             if (!input_noecho) {
                 for (auto id : embd) {
                     update(llama_token_to_str(ctx, id));
+                    turn.output.push_back(id);
                 }
             }
         }
 
+        // a streamed prompt or input returns for its next piece once less than a batch of it is left
+        if (stream.open && !waiting_input && embd.empty() && (int) embd_inp.size() - n_consumed < params.n_batch) {
+            waiting_input = !stream.prompt;
+            return;
+        }
+
         // in interactive mode, and not currently processing queued inputs;
         // check if we should prompt the user for more
-        if (waiting_input || (params.interactive && (int) embd_inp.size() <= n_consumed)) {
+        if (waiting_input || (params.interactive && !stream.open && (int) embd_inp.size() <= n_consumed)) {
             if (!waiting_input) {
                 // check for reverse prompt
                 if (params.antiprompt.size()) {
@@ -343,68 +1520,543 @@ void run_llama_model(const gpt_params& params, llama_context* ctx, std::vector<l
 
                 waiting_input = false;
 
-                std::string buffer;
-                if (!params.input_prefix.empty()) {
+                // the following pieces of a streamed input only add their tokens to the turn
+                const bool continued = stream.started;
+                if (!continued) {
+                    // only tokens from n_consumed on are evaluated, the consumed ones are dropped except for the last
+                    // n_input_history, so that input of a long chat does not grow with every turn
+                    const int n_drop = n_consumed - std::min(n_consumed, settings.n_input_history);
+                    if (n_drop > 0) {
+                        embd_inp.erase(embd_inp.begin(), embd_inp.begin() + n_drop);
+                        n_consumed -= n_drop;
+                        if (embd_inp.capacity() > 2*embd_inp.size()) {
+                            embd_inp.shrink_to_fit();
+                        }
+                    }
+
+                    if (overflow.n_reply_tokens > 0) {
+                        overflow.reply_tokens_avg = overflow.reply_tokens_avg == 0.0 ? overflow.n_reply_tokens
+                                : 0.75*overflow.reply_tokens_avg + 0.25*overflow.n_reply_tokens;
+                        overflow.n_reply_tokens = 0;
+                    }
+
+                    // the turn starts after the pending tokens
+                    overflow.turn_starts.push_back(n_past + embd.size() + embd_inp.size() - n_consumed);
+                }
+
+                std::string buffer = std::move(stream.text);
+                stream.text.clear();
+                if (!continued && !params.input_prefix.empty()) {
                     buffer += params.input_prefix;
                 }
 
-                buffer += input;
+                buffer += input;
+                const bool tokenized = !stream.tokens.empty();
+
+                // the end of a piece may tokenize differently together with the next one, so it waits for it
+                if (stream.open) {
+                    const size_t n_stable = get_llama_stable_text_size(buffer);
+                    stream.text = buffer.substr(n_stable);
+                    buffer.resize(n_stable);
+                }
+
+                // Add tokens to embd only if the input buffer is non-empty
+                // Entering a empty line lets the user pass control back
+                if (continued || stream.open || tokenized || buffer.length() > 1) {
+                    if (!continued) {
+                        stream.n_turn_start = embd_inp.size();
+                        if (stream.open) {
+                            stream.last_n_tokens = last_n_tokens;
+                        }
+
+                        // instruct mode: insert instruction prefix
+                        if (params.instruct && !is_antiprompt) {
+                            n_consumed = embd_inp.size();
+                            embd_inp.insert(embd_inp.end(), inp_pfx.begin(), inp_pfx.end());
+                        }
+                    }
+
+                    if (!buffer.empty()) {
+                        auto line_inp = ::llama_tokenize(ctx, buffer, false);
+                        embd_inp.insert(embd_inp.end(), line_inp.begin(), line_inp.end());
+                        stream.n_tokens += line_inp.size();
+                    }
+                    embd_inp.insert(embd_inp.end(), stream.tokens.begin(), stream.tokens.end());
+                    stream.n_tokens += stream.tokens.size();
+                    stream.started = stream.open;
+                }
+
+                if (!stream.open && (continued || tokenized || buffer.length() > 1)) {
+                    // instruct mode: insert response suffix
+                    if (params.instruct) {
+                        embd_inp.insert(embd_inp.end(), inp_sfx.begin(), inp_sfx.end());
+                    }
+
+                    turn.input.assign(embd_inp.begin() + stream.n_turn_start, embd_inp.end());
+
+                    n_remain -= stream.n_tokens;
+
+                    // roll over now if the input and the reply predicted from the previous ones would not fit, so
+                    // that the reply does not stall in the middle
+                    const int n_pending = embd.size() + embd_inp.size() - n_consumed;
+                    int n_expected = std::ceil(overflow.reply_tokens_avg);
+                    if (params.n_predict > 0) {
+                        n_expected = std::min(n_expected, params.n_predict);
+                    }
+                    if (settings.overflow_proactive && n_past > params.n_keep &&
+                        n_past + n_pending + n_expected > n_ctx) {
+                        const int n_before = embd.size();
+                        rollover_llama_context(params, settings, n_ctx, n_past, embd, last_n_tokens, overflow,
+                                               n_ctx - params.n_keep - n_pending - n_expected);
+                        ++stats.n_rollovers;
+                        ++stats.n_rollovers_proactive;
+                        stats.n_rollover_tokens += embd.size() - n_before;
+                        speculative.clear();
+                    }
+                }
+                if (!stream.open) {
+                    stream = LlamaInputStream();
+                }
+
+                input_noecho = true; // do not echo this again
+            }
+
+            if (n_past > 0) {
+                is_interacting = false;
+            }
+        }
+
+        // end of text token
+        if (!embd.empty() && embd.back() == llama_token_eos()) {
+            if (params.instruct) {
+                is_interacting = true;
+            } else {
+                fprintf(stderr, " [end of text]\n");
+                break;
+            }
+        }
+
+        // In interactive mode, respect the maximum number of tokens and drop back to user input when reached.
+        if (params.interactive && n_remain <= 0 && params.n_predict != -1) {
+            n_remain = params.n_predict;
+            is_interacting = true;
+        }
+    }
+}
+
+template <typename UpdateFunction>
+void run_llama_model(const gpt_params& params, const LlamaModelSettings& settings, LlamaModelContext& context,
+                     const std::string& input, UpdateFunction update)
+{
+    run_llama_model(params, context.ctx, context.inp_pfx, context.inp_sfx, context.embd_inp, context.embd,
+                    context.last_n_tokens, context.llama_token_newline, context.n_remain, context.n_past, context.n_ctx,
+                    context.n_consumed, context.is_interacting, context.input_noecho, context.is_antiprompt,
+                    context.waiting_input, context.rng, context.logprob, context.ctx_tokens, context.sampler,
+                    context.speculative, context.draft_ctx, context.overflow, context.turn, context.replay,
+                    context.stream, context.stats, context.cpu_arbiter,
+                    context.logits_all, context.last_logits_row, settings, input, update);
+}
+
+// a context that keeps logits for all tokens, with the KV cache of ctx. It maps the weights ctx mapped, so only its KV
+// cache and buffers take memory, for as long as it lives
+static llama_context* init_llama_score_context(const gpt_params& params, llama_context* ctx,
+                                               const std::string& weights_path) {
+    auto lparams = llama_context_default_params();
+
+    lparams.n_ctx      = params.n_ctx;
+    lparams.n_parts    = params.n_parts;
+    lparams.seed       = params.seed;
+    lparams.f16_kv     = params.memory_f16;
+    lparams.logits_all = true;
+    lparams.use_mmap   = true;
+
+    auto score_ctx = llama_init_from_file(weights_path.c_str(), lparams);
+    if (score_ctx == NULL) {
+        fprintf(stderr, "%s: error: failed to map '%s'\n", __func__, weights_path.c_str());
+        throw std::runtime_error("failed to create scoring context");
+    }
+    if (llama_get_kv_cache_size(score_ctx) != llama_get_kv_cache_size(ctx)) {
+        llama_free(score_ctx);
+        throw std::runtime_error("scoring context has a different KV cache");
+    }
+
+    llama_set_kv_cache(score_ctx, llama_get_kv_cache(ctx), llama_get_kv_cache_size(ctx),
+                       llama_get_kv_cache_token_count(ctx));
+    return score_ctx;
+}
+
+// evaluates the text as a continuation of the current context and returns log-probability of each of its tokens;
+// the context is left with evaluated tokens past n_past, so it should be called on a disposable (forked) chat.
+// Batches need logits for all tokens, which a chat keeps only for speculative decoding, otherwise the text goes to a
+// scoring context. With the weights on the heap there is none and the text is evaluated a token at a time
+static std::vector<double> score_llama_model(const gpt_params& params, const LlamaModelSettings& settings,
+                                             LlamaModelContext& context, const std::string& text)
+{
+    llama_context* ctx = context.ctx;
+    const int n_vocab = llama_n_vocab(ctx);
+
+    std::unique_ptr<llama_context, decltype(&llama_free)> score_ctx(nullptr, llama_free);
+    if (!context.logits_all && !context.weights_path.empty()) {
+        score_ctx.reset(init_llama_score_context(params, context.ctx, context.weights_path));
+        ctx = score_ctx.get();
+    }
+
+    const auto tokens = ::llama_tokenize(ctx, text, false);
+
+    // tokens sampled but not evaluated yet go first, otherwise re-evaluate the last token to get its logits
+    std::vector<llama_token> input = context.embd;
+    int start = context.n_past;
+    if (input.empty()) {
+        if (context.n_past == 0) {
+            throw std::runtime_error("chat is not initialized");
+        }
+        input.push_back(context.last_n_tokens.back());
+        --start;
+    }
+    const size_t n_prefix = input.size();
+    input.insert(input.end(), tokens.begin(), tokens.end());
+
+    if (start + (int) input.size() > context.n_ctx) {
+        throw std::runtime_error("text does not fit in context");
+    }
+
+    const int n_chunk = context.logits_all || score_ctx ? params.n_batch : 1;
+
+    std::vector<double> logprobs;
+    logprobs.reserve(tokens.size());
+
+    for (size_t i = 0; i < input.size(); i += n_chunk) {
+        const int n = std::min<int>(n_chunk, input.size() - i);
+        if (eval_llama(ctx, input.data() + i, n, start + i, settings.n_threads_prefill, context.cpu_arbiter,
+                       CpuArbiter::ePrefill, context.stats)) {
+            fprintf(stderr, "%s : failed to eval\n", __func__);
+            throw std::runtime_error("failed to eval");
+        }
+
+        const float* logits = llama_get_logits(ctx);
+        for (int j = 0; j < n; ++j) {
+            const size_t pos = i + j;
+            if (pos + 1 < n_prefix || pos + 1 >= input.size()) {
+                continue;
+            }
 
-                // Add tokens to embd only if the input buffer is non-empty
-                // Entering a empty line lets the user pass control back
-                if (buffer.length() > 1) {
+            logprobs.push_back(token_logprob(logits + j*n_vocab, n_vocab, input[pos + 1]));
+        }
+    }
 
-                    // instruct mode: insert instruction prefix
-                    if (params.instruct && !is_antiprompt) {
-                        n_consumed = embd_inp.size();
-                        embd_inp.insert(embd_inp.end(), inp_pfx.begin(), inp_pfx.end());
-                    }
+    return logprobs;
+}
 
-                    auto line_inp = ::llama_tokenize(ctx, buffer, false);
-                    embd_inp.insert(embd_inp.end(), line_inp.begin(), line_inp.end());
+// evaluates every text on its own from the start of the context and returns the embedding of its last token. Texts are
+// evaluated in token order, so that a text reuses the tokens it starts with that the one before it evaluated already;
+// the context is left in undefined state, so it should be called on a disposable (forked) chat
+static std::vector<std::vector<float>> embed_llama_model(const gpt_params& params, const LlamaModelSettings& settings,
+                                                         LlamaModelContext& context,
+                                                         const std::vector<std::string>& texts) {
+    llama_context* ctx = context.ctx;
+    const int n_embd = llama_n_embd(ctx);
+
+    if (!params.embedding) {
+        throw std::runtime_error("embeddings are off, start the server with --embedding");
+    }
 
-                    // instruct mode: insert response suffix
-                    if (params.instruct) {
-                        embd_inp.insert(embd_inp.end(), inp_sfx.begin(), inp_sfx.end());
-                    }
+    // tokenized like the prompt in init, as the embedding example of llama.cpp does
+    std::vector<std::vector<llama_token>> inputs(texts.size());
+    for (size_t i = 0; i < texts.size(); ++i) {
+        inputs[i] = ::llama_tokenize(ctx, " " + texts[i], true);
+        if ((int) inputs[i].size() > context.n_ctx) {
+            throw std::runtime_error("text " + std::to_string(i) + " does not fit in context");
+        }
+    }
 
-                    n_remain -= line_inp.size();
-                }
+    std::vector<size_t> order(texts.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return inputs[a] < inputs[b]; });
 
-                input_noecho = true; // do not echo this again
-            }
+    // a chat forked from a root starts with the preamble in its context
+    auto& evaluated = context.ctx_tokens;
 
-            if (n_past > 0) {
-                is_interacting = false;
+    std::vector<std::vector<float>> embeddings(texts.size());
+    for (auto index : order) {
+        const auto& input = inputs[index];
+
+        // at least the last token is evaluated to get its embedding
+        size_t n_reuse = 0;
+        while (n_reuse < evaluated.size() && n_reuse + 1 < input.size() && evaluated[n_reuse] == input[n_reuse]) {
+            ++n_reuse;
+        }
+        evaluated.resize(n_reuse);
+
+        for (size_t i = n_reuse; i < input.size(); i += params.n_batch) {
+            const int n = std::min<int>(params.n_batch, input.size() - i);
+            if (eval_llama(ctx, input.data() + i, n, i, settings.n_threads_prefill, context.cpu_arbiter,
+                           CpuArbiter::ePrefill, context.stats)) {
+                fprintf(stderr, "%s : failed to eval\n", __func__);
+                throw std::runtime_error("failed to eval");
             }
+            evaluated.insert(evaluated.end(), input.begin() + i, input.begin() + i + n);
         }
 
-        // end of text token
-        if (!embd.empty() && embd.back() == llama_token_eos()) {
-            if (params.instruct) {
-                is_interacting = true;
-            } else {
-                fprintf(stderr, " [end of text]\n");
-                break;
-            }
+        const float* embedding = llama_get_embeddings(ctx);
+        embeddings[index].assign(embedding, embedding + n_embd);
+    }
+    context.n_past = evaluated.size();
+
+    return embeddings;
+}
+
+using llama_kv_buffer = std::unique_ptr<uint8_t, std::function<void(uint8_t*)>>;
+
+// KV cache saved to the chain of delta files, each applied on top of the previous one, starting from zeros. The zeros
+// are an anonymous mapping, its pages are allocated only where a delta writes, so reading the chain costs as much as
+// the deltas and not a whole cache per chat
+static llama_kv_buffer read_llama_kv_chain(const std::vector<std::string>& paths, size_t size) {
+    void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+        throw std::runtime_error("failed to map KV cache base");
+    }
+    llama_kv_buffer kv(static_cast<uint8_t*>(addr), [size](uint8_t* data) { munmap(data, size); });
+
+    for (const auto& path : paths) {
+        std::ifstream file(path, std::ios::binary);
+        const auto header = read_kv_delta_header(file);
+        if (header.size != size) {
+            throw std::runtime_error("KV cache checkpoint does not match the model: " + path);
         }
+        apply_kv_delta(file, kv.get(), size);
+    }
 
-        // In interactive mode, respect the maximum number of tokens and drop back to user input when reached.
-        if (params.interactive && n_remain <= 0 && params.n_predict != -1) {
-            n_remain = params.n_predict;
-            is_interacting = true;
+    return kv;
+}
+
+// clears the pages that are not zero already, the others stay shared with the parent
+static void clear_llama_kv_pages(uint8_t* data, size_t size) {
+    const size_t page = sysconf(_SC_PAGESIZE);
+    for (size_t offset = 0; offset < size; offset += page) {
+        const size_t n = std::min(page, size - offset);
+        if (std::any_of(data + offset, data + offset + n, [](uint8_t b) { return b != 0; })) {
+            memset(data + offset, 0, n);
         }
     }
 }
 
-template <typename UpdateFunction>
-void run_llama_model(const gpt_params& params, LlamaModelContext& context, const std::string& input,
-                     UpdateFunction update)
-{
-    run_llama_model(params, context.ctx, context.inp_pfx, context.inp_sfx, context.embd_inp, context.embd,
-                    context.last_n_tokens, context.llama_token_newline, context.n_remain, context.n_past, context.n_ctx,
-                    context.n_consumed, context.is_interacting, context.input_noecho, context.is_antiprompt,
-                    context.waiting_input, input, update);
+// everything the reply to the next input depends on: the tokens it is conditioned on, whether they are evaluated yet or
+// not, the sampler state and the settings that change how tokens are picked or where the context rolls over
+static std::string get_llama_state_key(const gpt_params& params, const LlamaModelSettings& settings,
+                                       const LlamaModelContext& context) {
+    std::ostringstream stream;
+
+    const size_t n_evaluated = std::min<size_t>(context.n_past, context.ctx_tokens.size());
+    std::vector<llama_token> tokens(context.ctx_tokens.begin(), context.ctx_tokens.begin() + n_evaluated);
+    tokens.insert(tokens.end(), context.embd.begin(), context.embd.end());
+    tokens.insert(tokens.end(), context.embd_inp.begin() + context.n_consumed, context.embd_inp.end());
+    write_vector(stream, tokens);
+    write_vector(stream, context.last_n_tokens);
+    write_pod<int32_t>(stream, context.n_ctx);
+    write_pod<int32_t>(stream, context.n_remain);
+    write_pod<uint8_t>(stream, context.input_noecho);
+    write_pod<uint8_t>(stream, context.is_antiprompt);
+    write_pod<uint8_t>(stream, context.is_interacting);
+    write_pod<uint8_t>(stream, context.waiting_input);
+    write_vector(stream, context.overflow.turn_starts);
+    write_pod(stream, context.overflow.reply_tokens_avg);
+
+    write_pod<int32_t>(stream, static_cast<int32_t>(settings.sampler));
+    write_pod<int32_t>(stream, static_cast<int32_t>(settings.speculative));
+    write_pod<int32_t>(stream, settings.draft_n);
+    write_pod<int32_t>(stream, settings.ngram_n);
+    write_pod<int32_t>(stream, static_cast<int32_t>(settings.overflow));
+    write_pod<int32_t>(stream, settings.overflow_window);
+    write_pod<uint8_t>(stream, settings.overflow_proactive);
+
+    write_pod(stream, params.temp);
+    write_pod(stream, params.top_k);
+    write_pod(stream, params.top_p);
+    write_pod(stream, params.repeat_penalty);
+    write_pod(stream, params.repeat_last_n);
+    write_pod(stream, params.n_predict);
+    write_pod(stream, params.n_keep);
+    write_pod<uint8_t>(stream, params.ignore_eos);
+    write_pod<uint8_t>(stream, params.interactive);
+    write_pod<uint8_t>(stream, params.instruct);
+    write_string(stream, params.input_prefix);
+    for (const auto& antiprompt : params.antiprompt) {
+        write_string(stream, antiprompt);
+    }
+
+    stream << context.rng;
+    return stream.str();
+}
+
+static std::string write_llama_replay(const LlamaReplay& replay) {
+    std::ostringstream stream;
+    write_vector(stream, replay.tokens);
+    write_pod<int32_t>(stream, replay.n_sampled);
+    write_pod(stream, replay.logprob);
+    write_string(stream, replay.rng);
+    return stream.str();
+}
+
+static bool read_llama_replay(const std::string& data, LlamaReplay& replay) {
+    std::istringstream stream(data);
+    try {
+        replay.tokens = read_vector<llama_token>(stream);
+        replay.n_sampled = read_pod<int32_t>(stream);
+        replay.logprob = read_pod<double>(stream);
+        replay.rng = read_string(stream);
+    } catch (const std::exception& e) {
+        fprintf(stderr, "%s: damaged replay: %s\n", __func__, e.what());
+        return false;
+    }
+    return !replay.tokens.empty();
+}
+
+// writes the chat: parameters changed by init, per-chat settings, context fields, sampler RNG and the logits the next
+// token would be sampled from; the KV cache goes to kv_path as a delta against the base chain
+static void save_llama_state(const gpt_params& params, const LlamaModelSettings& settings, LlamaModelContext& context,
+                             std::ostream& stream, const std::string& kv_path,
+                             const std::vector<std::string>& base_paths) {
+    llama_context* ctx = context.ctx;
+    const int n_vocab = llama_n_vocab(ctx);
+
+    write_string(stream, params.prompt);
+    write_pod<int32_t>(stream, params.n_keep);
+    write_pod<uint8_t>(stream, params.interactive);
+    write_pod<uint8_t>(stream, params.interactive_start);
+    write_pod<uint64_t>(stream, params.antiprompt.size());
+    for (const auto& antiprompt : params.antiprompt) {
+        write_string(stream, antiprompt);
+    }
+
+    write_pod<int32_t>(stream, static_cast<int32_t>(settings.sampler));
+    write_pod<int32_t>(stream, static_cast<int32_t>(settings.speculative));
+    write_pod<int32_t>(stream, settings.draft_n);
+    write_pod<int32_t>(stream, settings.ngram_n);
+    write_pod<int32_t>(stream, static_cast<int32_t>(settings.overflow));
+    write_pod<int32_t>(stream, settings.overflow_window);
+    write_pod<uint8_t>(stream, settings.overflow_proactive);
+
+    write_vector(stream, context.embd_inp);
+    write_vector(stream, context.inp_pfx);
+    write_vector(stream, context.inp_sfx);
+    write_vector(stream, context.llama_token_newline);
+    write_vector(stream, context.last_n_tokens);
+    write_vector(stream, context.embd);
+    write_vector(stream, context.ctx_tokens);
+    write_pod<int32_t>(stream, context.n_ctx);
+    write_pod<int32_t>(stream, context.n_past);
+    write_pod<int32_t>(stream, context.n_remain);
+    write_pod<int32_t>(stream, context.n_consumed);
+    write_pod<uint8_t>(stream, context.input_noecho);
+    write_pod<uint8_t>(stream, context.is_antiprompt);
+    write_pod<uint8_t>(stream, context.waiting_input);
+    write_pod<uint8_t>(stream, context.is_interacting.load());
+    write_pod(stream, context.logprob);
+    write_vector(stream, context.overflow.turn_starts);
+    write_pod<int32_t>(stream, context.overflow.n_reply_tokens);
+    write_pod(stream, context.overflow.reply_tokens_avg);
+
+    std::ostringstream rng;
+    rng << context.rng;
+    write_string(stream, rng.str());
+
+    // pending draft tokens are dropped, the sampled token is evaluated again after restore
+    std::vector<float> logits;
+    if (context.n_past > 0) {
+        const float* row = context.speculative.logits.empty()
+                ? llama_get_logits(ctx) + context.last_logits_row*n_vocab
+                : context.speculative.logits.data() + context.speculative.n_accepted*n_vocab;
+        logits.assign(row, row + n_vocab);
+    }
+    write_vector(stream, logits);
+
+    if (!stream) {
+        throw std::runtime_error("failed to write chat state");
+    }
+
+    // the parent may have moved on since it was saved, so its saved KV cache is read back from the chain
+    const size_t kv_size = llama_get_kv_cache_size(ctx);
+    llama_kv_buffer base;
+    if (!base_paths.empty()) {
+        base = read_llama_kv_chain(base_paths, kv_size);
+    }
+
+    // restored chats do not set the token count of the cache, n_past is what evaluation goes by
+    std::ofstream kv_file(kv_path, std::ios::binary);
+    write_kv_delta(kv_file, llama_get_kv_cache(ctx), base.get(), kv_size, context.n_past, base != nullptr);
+    if (!kv_file) {
+        throw std::runtime_error("failed to write " + kv_path);
+    }
+}
+
+static void load_llama_state(gpt_params& params, LlamaModelSettings& settings, LlamaModelContext& context,
+                             std::istream& stream, const std::string& kv_path) {
+    llama_context* ctx = context.ctx;
+
+    params.prompt = read_string(stream);
+    params.n_keep = read_pod<int32_t>(stream);
+    params.interactive = read_pod<uint8_t>(stream);
+    params.interactive_start = read_pod<uint8_t>(stream);
+    params.antiprompt.resize(read_pod<uint64_t>(stream));
+    for (auto& antiprompt : params.antiprompt) {
+        antiprompt = read_string(stream);
+    }
+
+    settings.sampler = static_cast<SamplerMode>(read_pod<int32_t>(stream));
+    settings.speculative = static_cast<SpeculativeMode>(read_pod<int32_t>(stream));
+    settings.draft_n = read_pod<int32_t>(stream);
+    settings.ngram_n = read_pod<int32_t>(stream);
+    settings.overflow = static_cast<OverflowPolicy>(read_pod<int32_t>(stream));
+    settings.overflow_window = read_pod<int32_t>(stream);
+    settings.overflow_proactive = read_pod<uint8_t>(stream);
+
+    context.embd_inp = read_vector<llama_token>(stream);
+    context.inp_pfx = read_vector<llama_token>(stream);
+    context.inp_sfx = read_vector<llama_token>(stream);
+    context.llama_token_newline = read_vector<llama_token>(stream);
+    context.last_n_tokens = read_vector<llama_token>(stream);
+    context.embd = read_vector<llama_token>(stream);
+    context.ctx_tokens = read_vector<llama_token>(stream);
+    context.n_ctx = read_pod<int32_t>(stream);
+    context.n_past = read_pod<int32_t>(stream);
+    context.n_remain = read_pod<int32_t>(stream);
+    context.n_consumed = read_pod<int32_t>(stream);
+    context.input_noecho = read_pod<uint8_t>(stream);
+    context.is_antiprompt = read_pod<uint8_t>(stream);
+    context.waiting_input = read_pod<uint8_t>(stream);
+    context.is_interacting = read_pod<uint8_t>(stream);
+    context.logprob = read_pod<double>(stream);
+    context.overflow.turn_starts = read_vector<int>(stream);
+    context.overflow.n_reply_tokens = read_pod<int32_t>(stream);
+    context.overflow.reply_tokens_avg = read_pod<double>(stream);
+
+    std::istringstream rng(read_string(stream));
+    rng >> context.rng;
+
+    if (context.n_ctx != llama_n_ctx(ctx)) {
+        throw std::runtime_error("checkpoint was saved with a different context size");
+    }
+
+    // sampling reads the saved logits until the next eval
+    context.speculative.clear();
+    context.speculative.draft_ctx_tokens.clear();
+    context.speculative.logits = read_vector<float>(stream);
+    context.last_logits_row = 0;
+
+    std::ifstream kv_file(kv_path, std::ios::binary);
+    const auto header = read_kv_delta_header(kv_file);
+    const size_t kv_size = llama_get_kv_cache_size(ctx);
+    if (header.size != kv_size) {
+        throw std::runtime_error("KV cache checkpoint does not match the model");
+    }
+
+    // the chat is forked from its restored parent, so the delta is applied in place on the cache it shares with the
+    // parent and only the pages the delta writes are copied. Setting the cache would copy all of it into every chat
+    auto kv = const_cast<uint8_t*>(llama_get_kv_cache(ctx));
+    if (!header.hasBase) {
+        clear_llama_kv_pages(kv, kv_size);
+    }
+    apply_kv_delta(kv_file, kv, kv_size);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -412,51 +2064,530 @@ void run_llama_model(const gpt_params& params, LlamaModelContext& context, const
 class LlamaModel final : public Model
 {
 public:
-    LlamaModel(const gpt_params& params, std::string inputPrefix, std::string outputPrefix)
+    LlamaModel(const gpt_params& params, const ApiParams& apiParams, std::string inputPrefix, std::string outputPrefix)
         : m_params(params), m_inputPrefix(std::move(inputPrefix)), m_outputPrefix(std::move(outputPrefix))
     {
-        load_llama_model(m_params, m_context.ctx);
+        const auto t_start_us = llama_time_us();
+        auto regions = read_memory_regions();
+
+        load_llama_model(m_params, apiParams, m_context.ctx, m_context.logits_all, m_context.weights_path);
+        if (!apiParams.draftModel.empty())
+        {
+            load_llama_draft_model(m_params, apiParams, m_context.ctx, m_context.draft_ctx);
+        }
+        auto t_phase_us = llama_time_us();
+        m_startupTimes.t_load_us = t_phase_us - t_start_us;
+
+        std::vector<std::string> modelPaths;
+        std::vector<const void*> keep;
+        for (const auto& [path, ctx] : {std::make_pair(m_params.model, m_context.ctx),
+                                        std::make_pair(apiParams.draftModel, m_context.draft_ctx)})
+        {
+            if (!ctx)
+            {
+                continue;
+            }
+
+            char resolved[PATH_MAX];
+            modelPaths.emplace_back(realpath(path.c_str(), resolved) ? resolved : path);
+            keep.push_back(llama_get_kv_cache(ctx));
+            keep.push_back(llama_get_logits(ctx));
+            keep.push_back(llama_get_embeddings(ctx));
+        }
+        apply_mapping_policy(apiParams, regions, modelPaths, keep);
+        m_startupTimes.t_mapping_us = llama_time_us() - t_phase_us;
+        t_phase_us = llama_time_us();
+
+        auto tuning = tune_llama_model(m_params, apiParams, m_context.ctx);
+        m_startupTimes.t_autotune_us = llama_time_us() - t_phase_us;
+
+        if (apiParams.cpuArbiter)
+        {
+            m_pCpuArbiter = std::make_unique<CpuArbiter>(apiParams.cpuCores, apiParams.prefillShare);
+            m_context.cpu_arbiter = m_pCpuArbiter.get();
+            fprintf(stderr, "%s: cpu arbiter: %d cores shared between chats, at most %d per chat unless alone\n",
+                    __func__, m_pCpuArbiter->getCoreCount(),
+                    std::max(tuning.n_threads_prefill, tuning.n_threads_decode));
+        }
+
+        m_context.rng.seed(m_params.seed);
+        m_context.logprob = 0.0;
+
+        m_settings.draft_n = apiParams.draftN;
+        m_settings.ngram_n = apiParams.ngramN;
+        m_settings.n_threads_prefill = tuning.n_threads_prefill;
+        m_settings.n_threads_decode = tuning.n_threads_decode;
+        m_settings.n_input_history = apiParams.inputHistory;
+        m_settings.overflow_window = apiParams.overflowWindow;
+        m_settings.overflow_proactive = apiParams.overflowProactive;
+        m_settings.sampler = SamplerMode::fast;
+        m_settings.speculative = SpeculativeMode::off;
+        configure("speculative", apiParams.speculative);
+        configure("overflow", apiParams.overflow);
+
+        if (!apiParams.preambleFile.empty())
+        {
+            t_phase_us = llama_time_us();
+            m_context.ctx_tokens = load_llama_preamble(m_params, apiParams, m_settings, m_context.ctx);
+            m_startupTimes.t_preamble_us = llama_time_us() - t_phase_us;
+        }
+
+        m_startupTimes.t_total_us = llama_time_us() - t_start_us;
+        fprintf(stderr, "%s: startup: load %.1f ms, mapping %.1f ms, autotune %.1f ms, preamble %.1f ms, "
+                        "total %.1f ms\n", __func__, m_startupTimes.t_load_us / 1000.0,
+                m_startupTimes.t_mapping_us / 1000.0, m_startupTimes.t_autotune_us / 1000.0,
+                m_startupTimes.t_preamble_us / 1000.0, m_startupTimes.t_total_us / 1000.0);
     }
 
     ~LlamaModel()
     {
+        if (m_context.draft_ctx)
+        {
+            llama_free(m_context.draft_ctx);
+        }
         llama_free(m_context.ctx);
     }
 
     void stop() override
     {
+        m_stopped = true;
         m_context.is_interacting = true;
     }
 
+    void reseed(uint32_t value) override
+    {
+        std::seed_seq seq{static_cast<uint32_t>(m_context.rng()), value};
+        m_context.rng.seed(seq);
+    }
+
+    double getLogProb() override
+    {
+        return m_context.logprob;
+    }
+
+    int getReplyLength() override
+    {
+        return m_context.turn.output.size();
+    }
+
+    std::string getStateKey() override
+    {
+        return get_llama_state_key(m_params, m_settings, m_context);
+    }
+
+    std::string getReplay() override
+    {
+        return m_replay;
+    }
+
+    std::vector<std::vector<float>> embed(const std::vector<std::string>& texts) override
+    {
+        return embed_llama_model(m_params, m_settings, m_context, texts);
+    }
+
+    std::string detokenize(const std::vector<int>& tokens) override
+    {
+        const int n_vocab = llama_n_vocab(m_context.ctx);
+
+        std::string text;
+        for (auto token : tokens)
+        {
+            if (token < 0 || token >= n_vocab)
+            {
+                throw std::out_of_range("token id " + std::to_string(token) + " is not in the vocabulary");
+            }
+            text += llama_token_to_str(m_context.ctx, token);
+        }
+        return text;
+    }
+
+    std::vector<double> score(const std::string& text) override
+    {
+        return score_llama_model(m_params, m_settings, m_context, text);
+    }
+
+    std::string configure(const std::string& key, const std::string& value) override
+    {
+        try
+        {
+            if (key == "sampler")
+            {
+                if (value == "fast")
+                {
+                    m_settings.sampler = SamplerMode::fast;
+                }
+                else if (value == "reference")
+                {
+                    m_settings.sampler = SamplerMode::reference;
+                }
+                else
+                {
+                    return "unknown sampler: " + value;
+                }
+            }
+            else if (key == "speculative")
+            {
+                if (value == "off")
+                {
+                    m_settings.speculative = SpeculativeMode::off;
+                }
+                else if (value == "ngram" || value == "draft")
+                {
+                    if (!m_context.logits_all)
+                    {
+                        return "speculative decoding requires the server to be started with --speculative";
+                    }
+                    if (value == "draft" && !m_context.draft_ctx)
+                    {
+                        return "draft mode requires the server to be started with --draft-model";
+                    }
+                    m_settings.speculative = value == "ngram" ? SpeculativeMode::ngram : SpeculativeMode::draft;
+                }
+                else
+                {
+                    return "unknown speculative mode: " + value;
+                }
+            }
+            else if (key == "overflow")
+            {
+                if (value == "halve")
+                {
+                    m_settings.overflow = OverflowPolicy::halve;
+                }
+                else if (value == "window")
+                {
+                    m_settings.overflow = OverflowPolicy::window;
+                }
+                else if (value == "turns")
+                {
+                    m_settings.overflow = OverflowPolicy::turns;
+                }
+                else
+                {
+                    return "unknown overflow policy: " + value;
+                }
+            }
+            else if (key == "overflow_window")
+            {
+                m_settings.overflow_window = std::stoi(value);
+            }
+            else if (key == "overflow_proactive")
+            {
+                if (value != "on" && value != "off")
+                {
+                    return "unknown proactive overflow mode: " + value;
+                }
+                m_settings.overflow_proactive = value == "on";
+            }
+            else if (key == "draft_n")
+            {
+                m_settings.draft_n = std::stoi(value);
+            }
+            else if (key == "ngram_n")
+            {
+                m_settings.ngram_n = std::stoi(value);
+            }
+            else
+            {
+                return "unknown setting: " + key;
+            }
+        }
+        catch (const std::exception& e)
+        {
+            return key + ": " + e.what();
+        }
+
+        return "";
+    }
+
+    void save(std::ostream& stream, const std::string& kvPath, const std::vector<std::string>& basePaths) override
+    {
+        save_llama_state(m_params, m_settings, m_context, stream, kvPath, basePaths);
+    }
+
+    ModelMetrics getMetrics() override
+    {
+        const auto& stats = m_context.stats;
+        const double n_sampled = stats.n_sampled.load();
+        const double n_drafted = stats.n_drafted.load();
+        const double n_accepted = stats.n_accepted.load();
+        const double n_evals = stats.n_evals.load();
+        const double n_inter_token = stats.n_inter_token.load();
+        const double n_rollovers = stats.n_rollovers.load();
+
+        return {
+            {"tokens_sampled", n_sampled},
+            {"tokens_per_second", stats.last_tokens_per_second.load()},
+            {"sampler_us_per_token", n_sampled > 0 ? stats.t_sample_us / n_sampled : 0.0},
+            {"speculative_drafted", n_drafted},
+            {"speculative_accepted", n_accepted},
+            {"speculative_acceptance_rate", n_drafted > 0 ? n_accepted / n_drafted : 0.0},
+            {"cpu_threads", static_cast<double>(stats.last_n_threads.load())},
+            {"cpu_threads_prefill", static_cast<double>(m_settings.n_threads_prefill)},
+            {"cpu_threads_decode", static_cast<double>(m_settings.n_threads_decode)},
+            {"batch_size", static_cast<double>(m_params.n_batch)},
+            {"cpu_wait_us_per_eval", n_evals > 0 ? stats.t_cpu_wait_us / n_evals : 0.0},
+            {"time_to_first_token_ms", stats.last_ttft_us / 1000.0},
+            {"inter_token_latency_ms", n_inter_token > 0 ? stats.t_inter_token_us / n_inter_token / 1000.0 : 0.0},
+            {"inter_token_latency_max_ms", stats.last_max_inter_token_us / 1000.0},
+            {"prompt_tokens_reused", static_cast<double>(stats.n_prompt_reused.load())},
+            {"rollovers", n_rollovers},
+            {"rollovers_proactive", static_cast<double>(stats.n_rollovers_proactive.load())},
+            {"rollover_tokens", static_cast<double>(stats.n_rollover_tokens.load())},
+            {"rollover_ms", n_rollovers > 0 ? stats.t_rollover_us / n_rollovers / 1000.0 : 0.0},
+            {"rollover_last_ms", stats.last_rollover_us / 1000.0},
+            {"startup_load_ms", m_startupTimes.t_load_us / 1000.0},
+            {"startup_mapping_ms", m_startupTimes.t_mapping_us / 1000.0},
+            {"startup_autotune_ms", m_startupTimes.t_autotune_us / 1000.0},
+            {"startup_preamble_ms", m_startupTimes.t_preamble_us / 1000.0},
+            {"startup_total_ms", m_startupTimes.t_total_us / 1000.0},
+        };
+    }
+
 protected:
+    void loadImpl(std::istream& stream, const std::string& kvPath) override
+    {
+        load_llama_state(m_params, m_settings, m_context, stream, kvPath);
+    }
+
     void initImpl(const std::string& prompt) override
     {
         m_params.prompt = prompt;
-        init_llama_model(m_params, m_inputPrefix.c_str(), m_outputPrefix.c_str(), m_context);
-        run_llama_model(m_params, m_context, "", [](auto){});
-        done();
+        runPrompt({});
+    }
+
+    void initTokensImpl(const std::vector<int>& tokens) override
+    {
+        m_params.prompt = detokenize(tokens);
+        runPrompt(tokens);
     }
 
     void processUserInputImpl(const std::string& input) override
     {
-        run_llama_model(m_params, m_context, input, [&](const std::string& output)
+        runTurn(input);
+    }
+
+    void processReplayImpl(const std::string& input, const std::string& replay) override
+    {
+        m_context.replay.pending = read_llama_replay(replay, m_context.replay);
+        runTurn(input);
+    }
+
+    void processTokensImpl(const std::vector<int>& tokens) override
+    {
+        m_context.stream.tokens = tokens;
+        runTurn("");
+    }
+
+    void processPieceImpl(const std::string& piece, bool last, bool prompt) override
+    {
+        if (prompt)
+        {
+            processPromptPiece(piece, last);
+            return;
+        }
+
+        if (!m_context.stream.started)
+        {
+            beginTurn();
+        }
+        m_context.stream.open = !last;
+        if (last)
+        {
+            startReply();
+        }
+        run_llama_model(m_params, m_settings, m_context, piece, [&](const std::string& output)
         {
             update(output);
         });
-        done();
+
+        if (last)
+        {
+            finishTurn();
+        }
+        else
+        {
+            idle();
+        }
+    }
+
+    void abortPiecesImpl() override
+    {
+        rollback_llama_input(m_params, m_context);
     }
 
 private:
+    void processPromptPiece(const std::string& piece, bool last)
+    {
+        auto& stream = m_context.stream;
+        auto text = stream.text + piece;
+        stream.text.clear();
+
+        if (!stream.started)
+        {
+            if (last)
+            {
+                initImpl(text);
+                return;
+            }
+
+            // init puts a space in front of the prompt, the first word has to be complete to tokenize as it would
+            const auto n_stable = get_llama_stable_text_size(text);
+            if (n_stable == 0)
+            {
+                stream.text = std::move(text);
+                idle();
+                return;
+            }
+
+            stream.open = stream.prompt = stream.started = true;
+            stream.n_keep = m_params.n_keep;
+            stream.text = text.substr(n_stable);
+            m_params.prompt = text.substr(0, n_stable);
+            startReply();
+            init_llama_model(m_params, m_inputPrefix.c_str(), m_outputPrefix.c_str(), m_context);
+        }
+        else
+        {
+            const auto n_stable = last ? text.size() : get_llama_stable_text_size(text);
+            stream.text = text.substr(n_stable);
+            text.resize(n_stable);
+            if (!text.empty())
+            {
+                const auto tokens = ::llama_tokenize(m_context.ctx, text, false);
+                m_context.embd_inp.insert(m_context.embd_inp.end(), tokens.begin(), tokens.end());
+                m_params.prompt += text;
+            }
+
+            if ((int) m_context.embd_inp.size() > m_context.n_ctx - 4)
+            {
+                fprintf(stderr, "%s: error: prompt is too long (%d tokens, max %d)\n", __func__,
+                        (int) m_context.embd_inp.size(), m_context.n_ctx - 4);
+                throw std::runtime_error("prompt is too long");
+            }
+        }
+
+        if (!last)
+        {
+            run_llama_model(m_params, m_settings, m_context, "", [](auto){});
+            idle();
+            return;
+        }
+
+        // init kept as many tokens as it saw of the prompt
+        const int n_prompt = m_context.embd_inp.size();
+        m_params.n_keep = stream.n_keep < 0 || stream.n_keep > n_prompt || m_params.instruct ? n_prompt : stream.n_keep;
+        stream = LlamaInputStream();
+
+        const auto prompt_tokens = m_context.embd_inp;
+        run_llama_model(m_params, m_settings, m_context, "", [](auto){});
+        turn(ModelTurn{prompt_tokens, {}});
+        done();
+    }
+
+    void runPrompt(const std::vector<llama_token>& tokens)
+    {
+        startReply();
+        init_llama_model(m_params, m_inputPrefix.c_str(), m_outputPrefix.c_str(), m_context, tokens);
+        const auto prompt_tokens = m_context.embd_inp;
+        run_llama_model(m_params, m_settings, m_context, "", [](auto){});
+
+        // output of the prompt is not shown, it is the prompt echoed
+        turn(ModelTurn{prompt_tokens, {}});
+        done();
+    }
+
+    void runTurn(const std::string& input)
+    {
+        beginTurn();
+        startReply();
+        run_llama_model(m_params, m_settings, m_context, input, [&](const std::string& output)
+        {
+            update(output);
+        });
+        finishTurn();
+    }
+
+    void beginTurn()
+    {
+        m_turnSampled = m_context.stats.n_sampled;
+        m_turnRollovers = m_context.stats.n_rollovers;
+
+        m_context.logprob = 0.0;
+        m_context.turn = ModelTurn();
+        m_stopped = false;
+    }
+
+    void finishTurn()
+    {
+        const auto n_sampled = m_turnSampled;
+        const auto n_rollovers = m_turnRollovers;
+
+        // a replayed reply leaves the sampler where the recorded run did, so the chat goes on as if it had generated it
+        auto& replay = m_context.replay;
+        if (replay.applied)
+        {
+            std::istringstream(replay.rng) >> m_context.rng;
+            m_context.logprob = replay.logprob;
+            m_replay = write_llama_replay(replay);
+        }
+        else if (!m_stopped && m_context.stats.n_rollovers == n_rollovers && !m_context.turn.output.empty())
+        {
+            replay.tokens = m_context.turn.output;
+            replay.n_sampled = m_context.stats.n_sampled - n_sampled;
+            replay.logprob = m_context.logprob;
+            std::ostringstream rng;
+            rng << m_context.rng;
+            replay.rng = rng.str();
+            m_replay = write_llama_replay(replay);
+        }
+        else
+        {
+            m_replay.clear();
+        }
+        replay = LlamaReplay();
+
+        turn(m_context.turn);
+
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - m_turnStart;
+        if (elapsed.count() > 0)
+        {
+            m_context.stats.last_tokens_per_second = (m_context.stats.n_sampled - n_sampled) / elapsed.count();
+        }
+        done();
+    }
+
+    void startReply()
+    {
+        m_turnStart = std::chrono::steady_clock::now();
+        m_context.stats.t_input_us = llama_time_us();
+        m_context.stats.t_last_token_us = 0;
+        m_context.stats.last_max_inter_token_us = 0;
+    }
+
     gpt_params m_params;
+    LlamaModelSettings m_settings;
     std::string m_inputPrefix, m_outputPrefix;
     LlamaModelContext m_context;
+    std::unique_ptr<CpuArbiter> m_pCpuArbiter;
+    LlamaStartupTimes m_startupTimes;
+
+    // reply to the last input for the response cache, empty if it was stopped or the context rolled over
+    std::string m_replay;
+    std::atomic<bool> m_stopped = false;
+
+    // counters at the start of the current turn, the time when its input was complete
+    int64_t m_turnSampled = 0;
+    int64_t m_turnRollovers = 0;
+    std::chrono::steady_clock::time_point m_turnStart;
 };
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-std::unique_ptr<Model> create_llama_model(const gpt_params& params, const char* inputPrefix, const char* outputPrefix)
+std::unique_ptr<Model> create_llama_model(const gpt_params& params, const ApiParams& apiParams, const char* inputPrefix,
+                                          const char* outputPrefix)
 {
-    return std::make_unique<LlamaModel>(params, inputPrefix, outputPrefix);
+    return std::make_unique<LlamaModel>(params, apiParams, inputPrefix, outputPrefix);
 }
 
 }
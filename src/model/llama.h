@@ -8,11 +8,13 @@
 #include "llama.cpp/examples/common.h"
 
 #include "model/model.h"
+#include "params.h"
 
 namespace llama_cpp_api
 {
 
-std::unique_ptr<Model> create_llama_model(const gpt_params& params, const char* inputPrefix, const char* outputPrefix);
+std::unique_ptr<Model> create_llama_model(const gpt_params& params, const ApiParams& apiParams, const char* inputPrefix,
+                                          const char* outputPrefix);
 
 }
 
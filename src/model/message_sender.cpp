@@ -21,6 +21,11 @@ public:
         m_pQueue->put(PolyM::DataMsg<std::string>(ModelMessageId::eUpdate, output));
     }
 
+    void turn(const ModelTurn& turn) override
+    {
+        m_pQueue->put(PolyM::DataMsg<ModelTurn>(ModelMessageId::eTurn, turn));
+    }
+
     void done() override
     {
         m_pQueue->put(PolyM::Msg(ModelMessageId::eDone));
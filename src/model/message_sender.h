@@ -21,6 +21,7 @@ enum ModelMessageId : char
 {
     eUpdate = 1,
     eDone = 2,
+    eTurn = 3,
 };
 
 std::unique_ptr<ModelSubscriber> create_model_message_sender(PolyM::Queue* pQueue);
@@ -33,8 +33,11 @@ bool Model::processUserInput(const std::string& input)
 
     m_isBusy = true;
 
-    assert(m_pThread);
-    m_pThread->join();
+    // restored chats have not run a thread yet
+    if (m_pThread)
+    {
+        m_pThread->join();
+    }
     m_pThread = std::make_unique<std::thread>([this, input]()
     {
         processUserInputImpl(input);
@@ -42,6 +45,123 @@ bool Model::processUserInput(const std::string& input)
     return true;
 }
 
+bool Model::processReplay(const std::string& input, const std::string& replay)
+{
+    if (m_isBusy || !m_isInitialized)
+    {
+        return false;
+    }
+
+    m_isBusy = true;
+
+    if (m_pThread)
+    {
+        m_pThread->join();
+    }
+    m_pThread = std::make_unique<std::thread>([this, input, replay]()
+    {
+        processReplayImpl(input, replay);
+    });
+    return true;
+}
+
+bool Model::initTokens(const std::vector<int>& tokens)
+{
+    if (m_isBusy)
+    {
+        return false;
+    }
+
+    m_isBusy = true;
+    m_isInitialized = true;
+
+    assert(!m_pThread);
+    m_pThread = std::make_unique<std::thread>([this, tokens]()
+    {
+        initTokensImpl(tokens);
+    });
+    return true;
+}
+
+bool Model::processTokens(const std::vector<int>& tokens)
+{
+    if (m_isBusy || !m_isInitialized)
+    {
+        return false;
+    }
+
+    m_isBusy = true;
+
+    if (m_pThread)
+    {
+        m_pThread->join();
+    }
+    m_pThread = std::make_unique<std::thread>([this, tokens]()
+    {
+        processTokensImpl(tokens);
+    });
+    return true;
+}
+
+bool Model::processPiece(const std::string& piece, bool last)
+{
+    if (m_isBusy)
+    {
+        return false;
+    }
+
+    // the first piece tells whether the pieces are the prompt
+    if (!m_isStreaming)
+    {
+        m_isStreamingPrompt = !m_isInitialized;
+    }
+    m_isStreaming = !last;
+
+    m_isBusy = true;
+    m_isInitialized = true;
+
+    if (m_pThread)
+    {
+        m_pThread->join();
+    }
+    m_pThread = std::make_unique<std::thread>([this, piece, last, prompt = m_isStreamingPrompt]()
+    {
+        processPieceImpl(piece, last, prompt);
+    });
+    return true;
+}
+
+bool Model::abortPieces()
+{
+    // a prompt is not rolled back, the chat is of no use without it
+    if (m_isBusy || !m_isStreaming || m_isStreamingPrompt)
+    {
+        return false;
+    }
+
+    m_isStreaming = false;
+
+    if (m_pThread)
+    {
+        m_pThread->join();
+        m_pThread.reset();
+    }
+    abortPiecesImpl();
+    return true;
+}
+
+bool Model::load(std::istream& stream, const std::string& kvPath)
+{
+    if (m_isBusy || m_isInitialized)
+    {
+        return false;
+    }
+
+    loadImpl(stream, kvPath);
+    m_isInitialized = true;
+    return true;
+}
+
 void Model::subscribe(ModelSubscriber* pSubscriber)
 {
     assert(!m_isBusy && "This is not thread-safe");
@@ -67,6 +187,19 @@ void Model::update(const std::string& output)
     }
 }
 
+void Model::turn(const ModelTurn& turn)
+{
+    if (m_pSubscriber)
+    {
+        m_pSubscriber->turn(turn);
+    }
+}
+
+void Model::idle()
+{
+    m_isBusy = false;
+}
+
 void Model::done()
 {
     m_isBusy = false;
@@ -3,16 +3,21 @@
 #ifndef LLAMA_CPP_API_MODEL_MODEL_H
 #define LLAMA_CPP_API_MODEL_MODEL_H
 
+#include <istream>
+#include <ostream>
 #include <string>
 #include <memory>
 #include <atomic>
 #include <thread>
+#include <vector>
 
 #include "model/subscriber.h"
 
 namespace llama_cpp_api
 {
 
+using ModelMetrics = std::vector<std::pair<std::string, double>>;
+
 class Model
 {
 public:
@@ -20,24 +25,93 @@ public:
 
     bool init(const std::string& prompt);
     bool processUserInput(const std::string& input);
+
+    /// Same as processUserInput, but the reply is one getReplay returned in a chat in the same state, which is
+    /// evaluated instead of generated
+    bool processReplay(const std::string& input, const std::string& replay);
+
+    /// Passes a piece of a prompt, before the chat is initialized, or of an input that arrives in pieces cut
+    /// anywhere. The model is busy while it tokenizes the piece and evaluates whole batches of it, the last piece
+    /// starts the reply as init and processUserInput do
+    bool processPiece(const std::string& piece, bool last);
+
+    /// Drops the pieces of an input passed so far, before the last one, the chat waits for input as before the first
+    /// piece. False if the model is busy or no input is arriving in pieces
+    bool abortPieces();
+
+    /// Same as init and processUserInput with the text tokenized by the client, the ids are not checked here
+    bool initTokens(const std::vector<int>& tokens);
+    bool processTokens(const std::vector<int>& tokens);
+
+    /// Text of the tokens, throws std::out_of_range if an id is not in the vocabulary
+    virtual std::string detokenize(const std::vector<int>& tokens) = 0;
+
     virtual void stop() = 0;
 
+    /// Derives a new sampler RNG state from the current one and the given value, used to diverge forked chats from
+    /// each other and from the chat they were forked from
+    virtual void reseed(uint32_t value) = 0;
+
+    /// Cumulative log-probability of the tokens generated in reply to the last input
+    virtual double getLogProb() = 0;
+
+    /// Number of tokens generated in reply to the last input
+    virtual int getReplyLength() = 0;
+
+    /// Log-probability of each token of the text as a continuation of the chat, leaves the chat in undefined state
+    virtual std::vector<double> score(const std::string& text) = 0;
+
+    /// Embedding of each text evaluated on its own, leaves the chat in undefined state. Throws if the model was not
+    /// loaded with embeddings
+    virtual std::vector<std::vector<float>> embed(const std::vector<std::string>& texts) = 0;
+
+    /// Changes a per-chat setting, returns error message or empty string
+    virtual std::string configure(const std::string& key, const std::string& value) = 0;
+
+    /// Everything the reply to the next input depends on besides the input, empty if the reply cannot be replayed
+    virtual std::string getStateKey() = 0;
+
+    /// Reply to the last input in the form processReplay takes, empty if it cannot be replayed, e.g. it was stopped
+    virtual std::string getReplay() = 0;
+
+    /// Named counters and gauges describing the chat
+    virtual ModelMetrics getMetrics() = 0;
+
+    /// Writes the chat state to the stream and its KV cache to kvPath, as a delta against the KV caches saved to
+    /// basePaths, applied in order, or against zeros without them. Throws on failure
+    virtual void save(std::ostream& stream, const std::string& kvPath, const std::vector<std::string>& basePaths) = 0;
+
+    /// Reads a state written by save into a chat that is not initialized. A KV delta with a base is applied to the
+    /// current KV cache, so the chat has to be a fork of the chat restored from the base
+    bool load(std::istream& stream, const std::string& kvPath);
+
     void subscribe(ModelSubscriber* pSubscriber);
     bool isBusy();
     bool isInitialized();
 
 protected:
     void update(const std::string& output);
+    void turn(const ModelTurn& turn);
     void done();
 
+    /// Ends a piece that is not the last one, no reply is reported
+    void idle();
+
     virtual void initImpl(const std::string& input) = 0;
     virtual void processUserInputImpl(const std::string& input) = 0;
+    virtual void processReplayImpl(const std::string& input, const std::string& replay) = 0;
+    virtual void processPieceImpl(const std::string& piece, bool last, bool prompt) = 0;
+    virtual void abortPiecesImpl() = 0;
+    virtual void initTokensImpl(const std::vector<int>& tokens) = 0;
+    virtual void processTokensImpl(const std::vector<int>& tokens) = 0;
+    virtual void loadImpl(std::istream& stream, const std::string& kvPath) = 0;
 
 private:
     ModelSubscriber* m_pSubscriber;
 
     std::unique_ptr<std::thread> m_pThread;
     std::atomic<bool> m_isBusy = false, m_isInitialized = false;
+    bool m_isStreaming = false, m_isStreamingPrompt = false;
 };
 
 }
@@ -13,6 +13,11 @@ public:
         std::cout << output << std::flush;
     }
 
+    void turn(const ModelTurn&) override
+    {
+        // nop
+    }
+
     void done() override
     {
         // nop
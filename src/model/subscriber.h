@@ -4,16 +4,25 @@
 #define LLAMA_CPP_API_MODEL_SUBSCRIBER_H
 
 #include <string>
+#include <vector>
 
 namespace llama_cpp_api
 {
 
+/// Tokens of the input and of the output of a turn
+struct ModelTurn
+{
+    std::vector<int> input;
+    std::vector<int> output;
+};
+
 class ModelSubscriber
 {
 public:
     virtual ~ModelSubscriber() = default;
 
     virtual void update(const std::string& output) = 0;
+    virtual void turn(const ModelTurn& turn) = 0; // sent before done
     virtual void done() = 0;
 };
 
@@ -0,0 +1,90 @@
+#include "model/vocabulary.h"
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+#include "llama.cpp/llama.h"
+#include "llama.cpp/examples/common.h"
+
+namespace llama_cpp_api
+{
+
+static_assert(sizeof(int) == sizeof(int32_t) && sizeof(llama_token) == sizeof(int), "token ids are 32-bit");
+
+Vocabulary::Vocabulary(const std::string& modelPath)
+{
+    // the weights are not read
+    auto lparams = llama_context_default_params();
+    lparams.vocab_only = true;
+    lparams.use_mmap = false;
+
+    m_pContext = llama_init_from_file(modelPath.c_str(), lparams);
+    if (!m_pContext)
+    {
+        throw std::runtime_error("failed to load the vocabulary of " + modelPath);
+    }
+}
+
+Vocabulary::~Vocabulary()
+{
+    llama_free(m_pContext);
+}
+
+int Vocabulary::size() const
+{
+    return llama_n_vocab(m_pContext);
+}
+
+std::vector<int> Vocabulary::tokenize(const std::string& text, bool prompt) const
+{
+    // init puts a space in front of the prompt to match the original tokenizer
+    return prompt ? ::llama_tokenize(m_pContext, " " + text, true) : ::llama_tokenize(m_pContext, text, false);
+}
+
+std::string Vocabulary::detokenize(const std::vector<int>& tokens) const
+{
+    if (!contains(tokens))
+    {
+        throw std::out_of_range("Token id is not in the vocabulary");
+    }
+
+    std::string text;
+    for (auto token : tokens)
+    {
+        text += llama_token_to_str(m_pContext, token);
+    }
+    return text;
+}
+
+bool Vocabulary::contains(const std::vector<int>& tokens) const
+{
+    const int n_vocab = size();
+    for (auto token : tokens)
+    {
+        if (token < 0 || token >= n_vocab)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::string write_token_ids(const std::vector<int>& tokens)
+{
+    return std::string(reinterpret_cast<const char*>(tokens.data()), tokens.size() * sizeof(int));
+}
+
+bool read_token_ids(const char* data, size_t size, std::vector<int>& tokens)
+{
+    if (size % sizeof(int) != 0)
+    {
+        return false;
+    }
+
+    tokens.resize(size / sizeof(int));
+    std::memcpy(tokens.data(), data, size);
+    return true;
+}
+
+}
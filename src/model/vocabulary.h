@@ -0,0 +1,50 @@
+#pragma once
+
+#ifndef LLAMA_CPP_API_MODEL_VOCABULARY_H
+#define LLAMA_CPP_API_MODEL_VOCABULARY_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+struct llama_context;
+
+namespace llama_cpp_api
+{
+
+/// Vocabulary of the model loaded without its weights, so that the server tokenizes text without asking a chat.
+/// Tokenizing only reads the vocabulary, so all server threads use it at once
+class Vocabulary
+{
+public:
+    /// Throws if the model cannot be loaded
+    explicit Vocabulary(const std::string& modelPath);
+    ~Vocabulary();
+
+    Vocabulary(const Vocabulary&) = delete;
+    Vocabulary& operator=(const Vocabulary&) = delete;
+
+    int size() const;
+
+    /// Tokens of the text as a chat gets them: a prompt with a space in front of it and the start token, an input as
+    /// it is
+    std::vector<int> tokenize(const std::string& text, bool prompt) const;
+
+    /// Throws std::out_of_range if an id is not in the vocabulary
+    std::string detokenize(const std::vector<int>& tokens) const;
+
+    bool contains(const std::vector<int>& tokens) const;
+
+private:
+    llama_context* m_pContext;
+};
+
+/// Token ids as /init and /send take them and /tokenize returns them: 32-bit integers in host byte order
+std::string write_token_ids(const std::vector<int>& tokens);
+
+/// Returns false if the size is not a multiple of an id
+bool read_token_ids(const char* data, size_t size, std::vector<int>& tokens);
+
+}
+
+#endif // LLAMA_CPP_API_MODEL_VOCABULARY_H
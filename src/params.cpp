@@ -0,0 +1,309 @@
+#include "params.h"
+
+#include <cstdio>
+#include <stdexcept>
+
+namespace llama_cpp_api
+{
+
+static void print_api_usage()
+{
+    fprintf(stderr, "server options:\n");
+    fprintf(stderr, "  --speculative MODE    default speculative decoding mode for new chats: off, ngram or draft (default: off)\n");
+    fprintf(stderr, "  --draft-model FNAME   draft model for speculative decoding in draft mode\n");
+    fprintf(stderr, "  --draft-n N           maximum number of draft tokens verified at once (default: 4)\n");
+    fprintf(stderr, "  --ngram-n N           n-gram size for prompt lookup in ngram mode (default: 3)\n");
+    fprintf(stderr, "  --weights-mapping MODE\n");
+    fprintf(stderr, "                        how weights are shared between chats: mmap, memfd or heap (default: mmap)\n");
+    fprintf(stderr, "  --huge-pages MODE     huge pages for model buffers: default, never or weights (default: default)\n");
+    fprintf(stderr, "  --scratch MODE        scratch buffers of forked chats: keep or wipe (default: keep)\n");
+    fprintf(stderr, "  --overflow MODE       what is kept when the context is full: halve, window or turns (default: halve)\n");
+    fprintf(stderr, "  --overflow-window N   recent tokens kept by the window policy (default: 256)\n");
+    fprintf(stderr, "  --overflow-proactive MODE\n");
+    fprintf(stderr, "                        roll over before a reply predicted to overflow: on or off (default: off)\n");
+    fprintf(stderr, "  --input-history N     consumed input tokens kept per chat (default: 0)\n");
+    fprintf(stderr, "  --autotune MODE       tune n_threads and n_batch at startup: off, on (cached) or force (default: off)\n");
+    fprintf(stderr, "  --autotune-cache FNAME\n");
+    fprintf(stderr, "                        file with tuning results (default: llama_cpp_api.autotune)\n");
+    fprintf(stderr, "  --preamble-file FNAME text chat prompts start with, evaluated once at startup and reused by /init\n");
+    fprintf(stderr, "  --preamble-snapshot FNAME\n");
+    fprintf(stderr, "                        file the evaluated preamble is cached in between starts\n");
+    fprintf(stderr, "  --cpu-arbiter MODE    share cores between chats evaluating at the same time: on or off (default: on)\n");
+    fprintf(stderr, "  --cpu-cores N         number of cores shared between chats, 0 - all available (default: 0)\n");
+    fprintf(stderr, "  --prefill-share F     part of the cores prompts are evaluated on while other chats generate (default: 0.5)\n");
+    fprintf(stderr, "  --numa MODE           one model replica per NUMA node: on or off (default: off)\n");
+    fprintf(stderr, "  --numa-simulate N     with --numa on, split the CPUs into N nodes instead of reading the topology\n");
+    fprintf(stderr, "  --max-chats N         chats that may exist at once, 0 - no limit (default: 0)\n");
+    fprintf(stderr, "  --max-generating N    chats that may generate at once, 0 - no limit (default: 0)\n");
+    fprintf(stderr, "  --reserved-interactive N\n");
+    fprintf(stderr, "                        generation slots kept for interactive chats (default: 1)\n");
+    fprintf(stderr, "  --queue-size N        requests that may wait for a generation slot (default: 16)\n");
+    fprintf(stderr, "  --queue-timeout MS    how long a request waits for a generation slot (default: 10000)\n");
+    fprintf(stderr, "  --init-coalesce MS    /init with the prompt of a chat initialized this recently forks it,\n");
+    fprintf(stderr, "                        0 - off (default: 10000)\n");
+    fprintf(stderr, "  --retry-after S       Retry-After of requests rejected with 429 (default: 1)\n");
+    fprintf(stderr, "  --output-rings N      chats whose output the server reads from shared memory (default: 256)\n");
+    fprintf(stderr, "  --output-ring-size N  bytes of unread output a chat may have in shared memory (default: 65536)\n");
+    fprintf(stderr, "  --viewer-timeout MS   how long a viewer or the consumer may not read before it is dropped (default: 30000)\n");
+    fprintf(stderr, "  --transcript-dir DIR  log inputs and outputs of every chat to DIR for /history (default: none)\n");
+    fprintf(stderr, "  --input-piece-size N  prompts and inputs larger than this are passed to the chat in pieces\n");
+    fprintf(stderr, "                        of this size while they arrive, 0 - whole (default: 65536)\n");
+    fprintf(stderr, "  --response-cache N    bytes of shared memory for replies to repeated inputs (default: 0, off)\n");
+    fprintf(stderr, "  --response-cache-entry N\n");
+    fprintf(stderr, "                        bytes of chat state, input and reply an entry holds (default: 65536)\n");
+    fprintf(stderr, "  --checkpoint-dir DIR  directory chats are saved to by /admin/checkpoint (default: checkpoint)\n");
+    fprintf(stderr, "  --warm-restart MODE   restore chats from the checkpoint at startup, save them on shutdown: on or off (default: off)\n");
+    fprintf(stderr, "  --request-timeout MS  how long to wait for a chat to reply, 0 - no limit (default: 30000)\n");
+    fprintf(stderr, "  --generation-timeout MS\n");
+    fprintf(stderr, "                        how long to wait for a chat to finish generating, 0 - no limit (default: 0)\n");
+    fprintf(stderr, "\n");
+}
+
+bool api_params_parse(int& argc, char** argv, ApiParams& params)
+{
+    int n_rest = 1;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+
+        auto value = [&]() -> std::string
+        {
+            if (++i >= argc)
+            {
+                throw std::invalid_argument("missing value for " + arg);
+            }
+            return argv[i];
+        };
+
+        try
+        {
+            if (arg == "--speculative")
+            {
+                params.speculative = value();
+                if (params.speculative != "off" && params.speculative != "ngram" && params.speculative != "draft")
+                {
+                    throw std::invalid_argument("unknown speculative mode: " + params.speculative);
+                }
+            }
+            else if (arg == "--draft-model")
+            {
+                params.draftModel = value();
+            }
+            else if (arg == "--draft-n")
+            {
+                params.draftN = std::stoi(value());
+            }
+            else if (arg == "--ngram-n")
+            {
+                params.ngramN = std::stoi(value());
+            }
+            else if (arg == "--weights-mapping")
+            {
+                params.weightsMapping = value();
+                if (params.weightsMapping != "mmap" && params.weightsMapping != "memfd" && params.weightsMapping != "heap")
+                {
+                    throw std::invalid_argument("unknown weights mapping: " + params.weightsMapping);
+                }
+            }
+            else if (arg == "--huge-pages")
+            {
+                params.hugePages = value();
+                if (params.hugePages != "default" && params.hugePages != "never" && params.hugePages != "weights")
+                {
+                    throw std::invalid_argument("unknown huge pages mode: " + params.hugePages);
+                }
+            }
+            else if (arg == "--scratch")
+            {
+                params.scratch = value();
+                if (params.scratch != "keep" && params.scratch != "wipe")
+                {
+                    throw std::invalid_argument("unknown scratch mode: " + params.scratch);
+                }
+            }
+            else if (arg == "--overflow")
+            {
+                params.overflow = value();
+                if (params.overflow != "halve" && params.overflow != "window" && params.overflow != "turns")
+                {
+                    throw std::invalid_argument("unknown overflow policy: " + params.overflow);
+                }
+            }
+            else if (arg == "--overflow-window")
+            {
+                params.overflowWindow = std::stoi(value());
+            }
+            else if (arg == "--overflow-proactive")
+            {
+                auto mode = value();
+                if (mode != "on" && mode != "off")
+                {
+                    throw std::invalid_argument("unknown proactive overflow mode: " + mode);
+                }
+                params.overflowProactive = mode == "on";
+            }
+            else if (arg == "--input-history")
+            {
+                params.inputHistory = std::stoi(value());
+                if (params.inputHistory < 0)
+                {
+                    throw std::invalid_argument("input history must not be negative");
+                }
+            }
+            else if (arg == "--autotune")
+            {
+                params.autotune = value();
+                if (params.autotune != "off" && params.autotune != "on" && params.autotune != "force")
+                {
+                    throw std::invalid_argument("unknown autotune mode: " + params.autotune);
+                }
+            }
+            else if (arg == "--autotune-cache")
+            {
+                params.autotuneCache = value();
+            }
+            else if (arg == "--preamble-file")
+            {
+                params.preambleFile = value();
+            }
+            else if (arg == "--preamble-snapshot")
+            {
+                params.preambleSnapshot = value();
+            }
+            else if (arg == "--cpu-arbiter")
+            {
+                auto mode = value();
+                if (mode != "on" && mode != "off")
+                {
+                    throw std::invalid_argument("unknown cpu arbiter mode: " + mode);
+                }
+                params.cpuArbiter = mode == "on";
+            }
+            else if (arg == "--cpu-cores")
+            {
+                params.cpuCores = std::stoi(value());
+            }
+            else if (arg == "--prefill-share")
+            {
+                params.prefillShare = std::stod(value());
+                if (params.prefillShare <= 0.0 || params.prefillShare > 1.0)
+                {
+                    throw std::invalid_argument("prefill share must be in (0, 1]");
+                }
+            }
+            else if (arg == "--numa")
+            {
+                auto mode = value();
+                if (mode != "on" && mode != "off")
+                {
+                    throw std::invalid_argument("unknown numa mode: " + mode);
+                }
+                params.numa = mode == "on";
+            }
+            else if (arg == "--numa-simulate")
+            {
+                params.numaSimulate = std::stoi(value());
+            }
+            else if (arg == "--max-chats")
+            {
+                params.maxChats = std::stoi(value());
+            }
+            else if (arg == "--max-generating")
+            {
+                params.maxGenerating = std::stoi(value());
+            }
+            else if (arg == "--reserved-interactive")
+            {
+                params.reservedInteractive = std::stoi(value());
+            }
+            else if (arg == "--queue-size")
+            {
+                params.queueSize = std::stoi(value());
+            }
+            else if (arg == "--queue-timeout")
+            {
+                params.queueTimeoutMs = std::stoull(value());
+            }
+            else if (arg == "--init-coalesce")
+            {
+                params.initCoalesceMs = std::stoull(value());
+            }
+            else if (arg == "--retry-after")
+            {
+                params.retryAfterS = std::stoi(value());
+            }
+            else if (arg == "--output-rings")
+            {
+                params.outputRings = std::stoi(value());
+            }
+            else if (arg == "--output-ring-size")
+            {
+                params.outputRingSize = std::stoi(value());
+            }
+            else if (arg == "--viewer-timeout")
+            {
+                params.viewerTimeoutMs = std::stoull(value());
+            }
+            else if (arg == "--transcript-dir")
+            {
+                params.transcriptDir = value();
+            }
+            else if (arg == "--input-piece-size")
+            {
+                params.inputPieceSize = std::stoull(value());
+            }
+            else if (arg == "--response-cache")
+            {
+                params.responseCacheSize = std::stoull(value());
+            }
+            else if (arg == "--response-cache-entry")
+            {
+                params.responseCacheEntrySize = std::stoull(value());
+            }
+            else if (arg == "--checkpoint-dir")
+            {
+                params.checkpointDir = value();
+            }
+            else if (arg == "--warm-restart")
+            {
+                auto mode = value();
+                if (mode != "on" && mode != "off")
+                {
+                    throw std::invalid_argument("unknown warm restart mode: " + mode);
+                }
+                params.warmRestart = mode == "on";
+            }
+            else if (arg == "--request-timeout")
+            {
+                params.requestTimeoutMs = std::stoull(value());
+            }
+            else if (arg == "--generation-timeout")
+            {
+                params.generationTimeoutMs = std::stoull(value());
+            }
+            else
+            {
+                argv[n_rest++] = argv[i];
+            }
+        }
+        catch (const std::exception& e)
+        {
+            fprintf(stderr, "error: %s\n", e.what());
+            print_api_usage();
+            return false;
+        }
+    }
+
+    if (params.speculative == "draft" && params.draftModel.empty())
+    {
+        fprintf(stderr, "error: draft mode requires --draft-model\n");
+        print_api_usage();
+        return false;
+    }
+
+    argc = n_rest;
+    argv[argc] = nullptr;
+    return true;
+}
+
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#ifndef LLAMA_CPP_API_PARAMS_H
+#define LLAMA_CPP_API_PARAMS_H
+
+#include <cstdint>
+#include <string>
+
+namespace llama_cpp_api
+{
+
+/// Server options that are not part of gpt_params
+struct ApiParams
+{
+    // speculative decoding
+    std::string speculative = "off"; // default mode for new chats: off, ngram or draft
+    std::string draftModel;          // small model proposing draft tokens in draft mode
+    int draftN = 4;                  // maximum number of draft tokens verified in one eval
+    int ngramN = 3;                  // length of the suffix looked up in history in ngram mode
+
+    // memory mapping of the weights, shared by all forked chats
+    std::string weightsMapping = "mmap"; // mmap - map the model file, memfd - copy it to a sealed memfd, heap - read it
+    std::string hugePages = "default";   // default - leave to the system, never - no huge pages for model buffers,
+                                         // weights - ask for huge pages on the weights mapping
+    std::string scratch = "keep";        // keep - scratch buffers are copied on write in forks, wipe - forks get them zeroed
+
+    // context overflow, default for new chats
+    std::string overflow = "halve";   // halve, window - keep overflowWindow recent tokens, turns - keep whole turns
+    int overflowWindow = 256;         // recent tokens kept by the window policy
+    bool overflowProactive = false;   // roll over before a reply that is predicted to overflow
+
+    // consumed input tokens kept per chat, the context itself is in the KV cache
+    int inputHistory = 0;
+
+    // startup calibration of n_threads and n_batch
+    std::string autotune = "off";                        // off, on - use cached result if any, force - calibrate again
+    std::string autotuneCache = "llama_cpp_api.autotune"; // results keyed by model and CPU
+
+    // preamble shared by chat prompts, evaluated once by the root
+    std::string preambleFile;      // text chat prompts usually start with, empty - none
+    std::string preambleSnapshot;  // file the evaluated preamble is saved to and loaded from on later starts
+
+    // CPU sharing between chats
+    bool cpuArbiter = true; // divide cores between chats evaluating at the same time, each gets at most n_threads
+    int cpuCores = 0;       // cores to divide, 0 - all the process may run on
+    double prefillShare = 0.5; // part of the cores prompt evaluation may take while other chats are generating
+
+    // NUMA placement
+    bool numa = false;      // one root model per NUMA node, chats are forked from the least loaded one
+    int numaSimulate = 0;   // split the CPUs into this many nodes instead of reading the topology, 0 - off
+
+    // admission control
+    int maxChats = 0;                    // chats that may exist at once, 0 - no limit
+    int maxGenerating = 0;               // chats that may generate at once, 0 - no limit
+    int reservedInteractive = 1;         // generation slots batch chats never take
+    int queueSize = 16;                  // requests waiting for a generation slot
+    uint64_t queueTimeoutMs = 10000;     // how long a request waits for a generation slot
+    uint64_t initCoalesceMs = 10000;     // /init with the prompt of a chat initialized this recently forks it, 0 - off
+    int retryAfterS = 1;                 // Retry-After of rejected requests
+
+    // output of the chats, read by the server from shared memory
+    int outputRings = 256;               // chats that get a ring, the others release output through IPC
+    int outputRingSize = 65536;          // bytes of output a chat may have unread before it waits for the reader
+    uint64_t viewerTimeoutMs = 30000;    // viewers that do not read for this long stop holding output back
+    std::string transcriptDir;           // inputs and outputs of every chat are logged here, empty - no transcripts
+
+    // prompts and inputs
+    size_t inputPieceSize = 65536;       // larger ones are passed to the chat in pieces while they arrive, 0 - whole
+
+    // replies to inputs chats in the same state received before
+    size_t responseCacheSize = 0;        // bytes of shared memory for cached replies, 0 - no cache
+    size_t responseCacheEntrySize = 65536; // bytes of state, input and reply an entry holds, larger ones are not cached
+
+    // checkpoint of all chats
+    std::string checkpointDir = "checkpoint"; // written by POST /admin/checkpoint
+    bool warmRestart = false;                 // restore chats from checkpointDir at startup, save them on shutdown
+
+    // supervision
+    uint64_t requestTimeoutMs = 30000;   // how long to wait for a runner reply, 0 - no limit
+    uint64_t generationTimeoutMs = 0;    // how long to wait for a runner to finish generating, 0 - no limit
+};
+
+/// Parses and removes ApiParams options from argv, so that the rest can be passed to gpt_params_parse
+bool api_params_parse(int& argc, char** argv, ApiParams& params);
+
+}
+
+#endif // LLAMA_CPP_API_PARAMS_H
@@ -0,0 +1,131 @@
+#include "process/admission.h"
+
+#include <cerrno>
+#include <new>
+#include <pthread.h>
+#include <signal.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace llama_cpp_api
+{
+
+static constexpr int kMaxSlots = 1024;
+
+struct GenerationSlotsState
+{
+    pthread_mutex_t mutex;
+    pid_t owners[kMaxSlots]; // 0 - free
+};
+
+bool parse_chat_priority(const std::string& str, ChatPriority& priority)
+{
+    if (str == "interactive")
+    {
+        priority = eInteractive;
+    }
+    else if (str == "batch")
+    {
+        priority = eBatch;
+    }
+    else
+    {
+        return false;
+    }
+
+    return true;
+}
+
+GenerationSlots::GenerationSlots(int maxGenerating, int reservedInteractive)
+    : m_maxGenerating(std::min(maxGenerating, kMaxSlots)), m_reservedInteractive(reservedInteractive)
+{
+    auto pMemory = mmap(nullptr, sizeof(GenerationSlotsState), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                        -1, 0);
+    if (pMemory == MAP_FAILED)
+    {
+        throw std::runtime_error("failed to map generation slots");
+    }
+    m_pState = new (pMemory) GenerationSlotsState();
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&m_pState->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+GenerationSlots::~GenerationSlots()
+{
+    munmap(m_pState, sizeof(GenerationSlotsState));
+}
+
+bool GenerationSlots::tryAcquire(ChatPriority priority)
+{
+    if (m_maxGenerating <= 0)
+    {
+        return true;
+    }
+
+    auto pid = getpid();
+
+    if (pthread_mutex_lock(&m_pState->mutex) == EOWNERDEAD)
+    {
+        pthread_mutex_consistent(&m_pState->mutex);
+    }
+
+    // slots of runners that died while generating are free
+    int nUsed = 0, free = -1;
+    bool owned = false;
+    for (int i = 0; i < m_maxGenerating; ++i)
+    {
+        auto owner = m_pState->owners[i];
+        if (owner != 0 && owner != pid && kill(owner, 0) != 0 && errno == ESRCH)
+        {
+            m_pState->owners[i] = owner = 0;
+        }
+
+        owned = owned || owner == pid;
+        nUsed += owner != 0;
+        if (owner == 0 && free < 0)
+        {
+            free = i;
+        }
+    }
+
+    auto limit = priority == eInteractive ? m_maxGenerating : std::max(m_maxGenerating - m_reservedInteractive, 1);
+    auto acquired = owned || (free >= 0 && nUsed < limit);
+    if (acquired && !owned)
+    {
+        m_pState->owners[free] = pid;
+    }
+
+    pthread_mutex_unlock(&m_pState->mutex);
+    return acquired;
+}
+
+void GenerationSlots::release()
+{
+    if (m_maxGenerating <= 0)
+    {
+        return;
+    }
+
+    auto pid = getpid();
+
+    if (pthread_mutex_lock(&m_pState->mutex) == EOWNERDEAD)
+    {
+        pthread_mutex_consistent(&m_pState->mutex);
+    }
+    for (int i = 0; i < m_maxGenerating; ++i)
+    {
+        if (m_pState->owners[i] == pid)
+        {
+            m_pState->owners[i] = 0;
+        }
+    }
+    pthread_mutex_unlock(&m_pState->mutex);
+}
+
+}
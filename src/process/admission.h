@@ -0,0 +1,224 @@
+#pragma once
+
+#ifndef LLAMA_CPP_API_PROCESS_ADMISSION_H
+#define LLAMA_CPP_API_PROCESS_ADMISSION_H
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace llama_cpp_api
+{
+
+enum ChatPriority : int
+{
+    eInteractive,
+    eBatch,
+};
+
+bool parse_chat_priority(const std::string& str, ChatPriority& priority);
+
+struct GenerationSlotsState;
+
+/// Limits the number of runners generating at the same time, enforced by the runners themselves.
+/// The state lives in a shared anonymous mapping, so it has to be created before runners are forked
+class GenerationSlots
+{
+public:
+    /// maxGenerating 0 - no limit; batch chats never take the last reservedInteractive slots
+    GenerationSlots(int maxGenerating, int reservedInteractive);
+    ~GenerationSlots();
+
+    GenerationSlots(const GenerationSlots&) = delete;
+    GenerationSlots& operator=(const GenerationSlots&) = delete;
+
+    /// Takes a slot for the calling process, returns false if there is none for its priority
+    bool tryAcquire(ChatPriority priority);
+
+    /// Returns the slot of the calling process, if it has one
+    void release();
+
+private:
+    GenerationSlotsState* m_pState;
+    int m_maxGenerating, m_reservedInteractive;
+};
+
+/// Bounded queue of server requests waiting for a generation slot, interactive ones go first
+class AdmissionQueue
+{
+public:
+    AdmissionQueue(int size, uint64_t timeoutMs)
+        : m_size(size), m_timeoutMs(timeoutMs)
+    { }
+
+    /// Calls tryAdmit until it returns true. While it returns false the request waits in the queue, retrying when it
+    /// is its turn. A request is tried right away only if no request of the same or a higher priority is waiting.
+    /// Returns false if the queue is full or the request waited longer than the timeout
+    template <typename TryFunction>
+    bool admit(ChatPriority priority, TryFunction tryAdmit)
+    {
+        if (!isWaiting(priority) && tryAdmit())
+        {
+            return true;
+        }
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (static_cast<int>(m_queues[eInteractive].size() + m_queues[eBatch].size()) >= m_size)
+        {
+            return false;
+        }
+
+        auto ticket = m_nextTicket++;
+        auto& queue = m_queues[priority];
+        queue.push_back(ticket);
+
+        auto leave = [&]()
+        {
+            queue.erase(std::find(queue.begin(), queue.end(), ticket));
+            m_cv.notify_all();
+        };
+
+        auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(m_timeoutMs);
+        bool admitted = false;
+        while (!admitted && std::chrono::steady_clock::now() < end)
+        {
+            m_cv.wait_for(lock, kRetryInterval);
+            if (queue.front() != ticket || (priority == eBatch && !m_queues[eInteractive].empty()))
+            {
+                continue;
+            }
+
+            // the runner is asked without the lock, the queue order is kept by the check above
+            lock.unlock();
+            try
+            {
+                admitted = tryAdmit();
+            }
+            catch (...)
+            {
+                lock.lock();
+                leave();
+                throw;
+            }
+            lock.lock();
+        }
+
+        leave();
+        return admitted;
+    }
+
+private:
+    bool isWaiting(ChatPriority priority)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return !m_queues[eInteractive].empty() || (priority == eBatch && !m_queues[eBatch].empty());
+    }
+
+    static constexpr auto kRetryInterval = std::chrono::milliseconds(50);
+
+    int m_size;
+    uint64_t m_timeoutMs;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<uint64_t> m_queues[2];
+    uint64_t m_nextTicket = 0;
+};
+
+/// Coalesces /init requests with the same prompt. The first one initializes a chat, the ones that arrive while it is
+/// in flight, or within the window after it, wait for it and fork that chat instead of evaluating the prompt again
+class InitCoalescer
+{
+public:
+    /// windowMs 0 - every request initializes its own chat
+    explicit InitCoalescer(uint64_t windowMs)
+        : m_windowMs(windowMs)
+    { }
+
+    /// Returns true if the caller is the first with prompt, it has to initialize the chat and call finish. Otherwise
+    /// waits until the first one has finished and sets id to its chat, -1 if there is none to fork or the deadline
+    /// passed first, then the caller initializes a chat of its own
+    bool join(const std::string& prompt, int& id, std::chrono::steady_clock::time_point deadline)
+    {
+        id = -1;
+        if (m_windowMs == 0)
+        {
+            return false;
+        }
+
+        std::unique_lock<std::mutex> lock(m_mutex);
+
+        auto now = std::chrono::steady_clock::now();
+        for (auto it = m_flights.begin(); it != m_flights.end();)
+        {
+            it = it->second->finished && now > it->second->expires ? m_flights.erase(it) : std::next(it);
+        }
+
+        auto& pFlight = m_flights[prompt];
+        if (!pFlight)
+        {
+            pFlight = std::make_shared<Flight>();
+            return true;
+        }
+
+        auto pJoined = pFlight;
+        if (m_cv.wait_until(lock, deadline, [&]() { return pJoined->finished; }))
+        {
+            id = pJoined->id;
+        }
+        return false;
+    }
+
+    /// id -1 - no chat was initialized, the waiting requests initialize their own
+    void finish(const std::string& prompt, int id)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_flights.find(prompt);
+        if (it != m_flights.end() && !it->second->finished)
+        {
+            it->second->id = id;
+            it->second->finished = true;
+            it->second->expires = std::chrono::steady_clock::now() + std::chrono::milliseconds(m_windowMs);
+            if (id < 0)
+            {
+                m_flights.erase(it);
+            }
+        }
+        m_cv.notify_all();
+    }
+
+    /// Chat id cannot be forked for prompt anymore, e.g. it has received input, the next request starts a new flight
+    void forget(const std::string& prompt, int id)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_flights.find(prompt);
+        if (it != m_flights.end() && it->second->finished && it->second->id == id)
+        {
+            m_flights.erase(it);
+        }
+    }
+
+private:
+    struct Flight
+    {
+        int id = -1;
+        bool finished = false;
+        std::chrono::steady_clock::time_point expires;
+    };
+
+    uint64_t m_windowMs;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::map<std::string, std::shared_ptr<Flight>> m_flights;
+};
+
+}
+
+#endif // LLAMA_CPP_API_PROCESS_ADMISSION_H
@@ -0,0 +1,168 @@
+#include "process/checkpoint.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+namespace llama_cpp_api
+{
+
+static constexpr uint32_t kKvDeltaMagic = 0x44564b4c; // "LKVD"
+static constexpr uint32_t kKvDeltaVersion = 1;
+static const std::string kIndexHeader = "llama_cpp_api checkpoint 1";
+
+// equal bytes between differing ones are stored as part of the run while the gap is shorter than this, so that
+// transposed V rows with a few changed positions do not become a run per position
+static constexpr size_t kMaxRunGap = 64;
+
+void write_checkpoint_index(const std::string& dir, const std::vector<CheckpointEntry>& entries)
+{
+    std::ofstream file(dir + "/index");
+    file << kIndexHeader << "\n";
+    for (const auto& entry : entries)
+    {
+        file << entry.id << " " << entry.parentId << " " << entry.rootIndex << " " << entry.priority << "\n";
+    }
+
+    if (!file)
+    {
+        throw std::runtime_error("failed to write checkpoint index to " + dir);
+    }
+}
+
+std::vector<CheckpointEntry> read_checkpoint_index(const std::string& dir)
+{
+    std::ifstream file(dir + "/index");
+    std::string line;
+    if (!std::getline(file, line) || line != kIndexHeader)
+    {
+        throw std::runtime_error("no checkpoint index in " + dir);
+    }
+
+    std::vector<CheckpointEntry> entries;
+    while (std::getline(file, line))
+    {
+        std::istringstream stream(line);
+        CheckpointEntry entry;
+        int priority;
+        if (!(stream >> entry.id >> entry.parentId >> entry.rootIndex >> priority))
+        {
+            throw std::runtime_error("damaged checkpoint index in " + dir);
+        }
+        entry.priority = static_cast<ChatPriority>(priority);
+        entries.push_back(entry);
+    }
+
+    return entries;
+}
+
+std::string get_checkpoint_state_path(const std::string& dir, int id)
+{
+    return dir + "/" + std::to_string(id) + ".state";
+}
+
+std::string get_checkpoint_kv_path(const std::string& dir, int id)
+{
+    return dir + "/" + std::to_string(id) + ".kv";
+}
+
+void write_kv_delta(std::ostream& stream, const uint8_t* data, const uint8_t* base, size_t size, int nTokens,
+                    bool hasBase)
+{
+    write_pod(stream, kKvDeltaMagic);
+    write_pod(stream, kKvDeltaVersion);
+    write_pod<uint64_t>(stream, size);
+    write_pod<int32_t>(stream, nTokens);
+    write_pod<uint8_t>(stream, hasBase);
+
+    // compares a word at a time, the tail byte by byte
+    auto differs = [&](size_t offset)
+    {
+        if (offset + sizeof(uint64_t) <= size)
+        {
+            uint64_t a, b = 0;
+            std::memcpy(&a, data + offset, sizeof(a));
+            if (base)
+            {
+                std::memcpy(&b, base + offset, sizeof(b));
+            }
+            return a != b;
+        }
+        for (auto i = offset; i < size; ++i)
+        {
+            if (data[i] != (base ? base[i] : 0))
+            {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    size_t offset = 0;
+    while (offset < size)
+    {
+        if (!differs(offset))
+        {
+            offset += sizeof(uint64_t);
+            continue;
+        }
+
+        auto end = offset, runEnd = offset;
+        while (end < size && end - runEnd < kMaxRunGap)
+        {
+            auto isDifferent = differs(end);
+            end = std::min(end + sizeof(uint64_t), size);
+            if (isDifferent)
+            {
+                runEnd = end;
+            }
+        }
+
+        write_pod<uint64_t>(stream, offset);
+        write_pod<uint64_t>(stream, runEnd - offset);
+        stream.write(reinterpret_cast<const char*>(data + offset), runEnd - offset);
+        offset = end;
+    }
+
+    // end of runs
+    write_pod<uint64_t>(stream, 0);
+    write_pod<uint64_t>(stream, 0);
+}
+
+KvDeltaHeader read_kv_delta_header(std::istream& stream)
+{
+    if (read_pod<uint32_t>(stream) != kKvDeltaMagic || read_pod<uint32_t>(stream) != kKvDeltaVersion)
+    {
+        throw std::runtime_error("not a KV cache checkpoint");
+    }
+
+    KvDeltaHeader header;
+    header.size = read_pod<uint64_t>(stream);
+    header.nTokens = read_pod<int32_t>(stream);
+    header.hasBase = read_pod<uint8_t>(stream) != 0;
+    return header;
+}
+
+void apply_kv_delta(std::istream& stream, uint8_t* data, size_t size)
+{
+    while (true)
+    {
+        auto offset = read_pod<uint64_t>(stream);
+        auto length = read_pod<uint64_t>(stream);
+        if (length == 0)
+        {
+            return;
+        }
+        if (offset + length > size)
+        {
+            throw std::runtime_error("KV cache checkpoint does not match the model");
+        }
+        if (!stream.read(reinterpret_cast<char*>(data + offset), length))
+        {
+            throw std::runtime_error("unexpected end of checkpoint");
+        }
+    }
+}
+
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#ifndef LLAMA_CPP_API_PROCESS_CHECKPOINT_H
+#define LLAMA_CPP_API_PROCESS_CHECKPOINT_H
+
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "process/admission.h"
+
+namespace llama_cpp_api
+{
+
+/// Chat in the checkpoint index, parents are listed before their children
+struct CheckpointEntry
+{
+    int id;
+    int parentId;  // -1 - forked from a root runner
+    int rootIndex; // NUMA node of the root runner the chat descends from
+    ChatPriority priority;
+};
+
+void write_checkpoint_index(const std::string& dir, const std::vector<CheckpointEntry>& entries);
+
+/// Throws if the index is missing or damaged
+std::vector<CheckpointEntry> read_checkpoint_index(const std::string& dir);
+
+/// Chat state: runner fields followed by the model state
+std::string get_checkpoint_state_path(const std::string& dir, int id);
+
+/// KV cache of the chat, stored as a delta against the KV cache of its parent
+std::string get_checkpoint_kv_path(const std::string& dir, int id);
+
+/// Writes data as runs of bytes that differ from base, base nullptr - zeros
+void write_kv_delta(std::ostream& stream, const uint8_t* data, const uint8_t* base, size_t size, int nTokens,
+                    bool hasBase);
+
+struct KvDeltaHeader
+{
+    uint64_t size;
+    int32_t nTokens;
+    bool hasBase; // false - the delta is against zeros
+};
+
+KvDeltaHeader read_kv_delta_header(std::istream& stream);
+
+/// Applies runs written by write_kv_delta to data of header.size bytes
+void apply_kv_delta(std::istream& stream, uint8_t* data, size_t size);
+
+template <typename T>
+void write_pod(std::ostream& stream, const T& value)
+{
+    static_assert(std::is_trivially_copyable<T>::value, "not a POD");
+    stream.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <typename T>
+T read_pod(std::istream& stream)
+{
+    static_assert(std::is_trivially_copyable<T>::value, "not a POD");
+    T value;
+    if (!stream.read(reinterpret_cast<char*>(&value), sizeof(value)))
+    {
+        throw std::runtime_error("unexpected end of checkpoint");
+    }
+    return value;
+}
+
+template <typename T>
+void write_vector(std::ostream& stream, const std::vector<T>& values)
+{
+    write_pod<uint64_t>(stream, values.size());
+    stream.write(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(T));
+}
+
+template <typename T>
+std::vector<T> read_vector(std::istream& stream)
+{
+    std::vector<T> values(read_pod<uint64_t>(stream));
+    if (!stream.read(reinterpret_cast<char*>(values.data()), values.size() * sizeof(T)))
+    {
+        throw std::runtime_error("unexpected end of checkpoint");
+    }
+    return values;
+}
+
+inline void write_string(std::ostream& stream, const std::string& str)
+{
+    write_vector(stream, std::vector<char>(str.begin(), str.end()));
+}
+
+inline std::string read_string(std::istream& stream)
+{
+    auto chars = read_vector<char>(stream);
+    return std::string(chars.begin(), chars.end());
+}
+
+}
+
+#endif // LLAMA_CPP_API_PROCESS_CHECKPOINT_H
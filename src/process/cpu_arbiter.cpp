@@ -0,0 +1,278 @@
+#include "process/cpu_arbiter.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <new>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <thread>
+#include <unistd.h>
+
+using namespace std::chrono_literals;
+
+namespace llama_cpp_api
+{
+
+static constexpr int kMaxCores = 256;
+static constexpr int kMaxClients = 256;
+
+// a chat that evaluated recently is likely to evaluate again, so it keeps counting towards the share of others
+static constexpr int64_t kActiveWindowUs = 200000;
+
+// how long a prefill chunk yields to waiting decoding chats before it takes its share anyway
+static constexpr int64_t kMaxPrefillYieldUs = 50000;
+
+struct CpuArbiterClient
+{
+    pid_t pid;
+    int64_t lastActiveUs;
+    CpuArbiter::EvalKind kind;
+    bool waiting;
+};
+
+struct CpuArbiterState
+{
+    pthread_mutex_t mutex;
+    int nCores;
+    int cpus[kMaxCores];
+    pid_t owners[kMaxCores]; // 0 - free
+    CpuArbiter::EvalKind ownerKinds[kMaxCores];
+    CpuArbiterClient clients[kMaxClients];
+};
+
+static int64_t now_us()
+{
+    // steady clock is CLOCK_MONOTONIC, which is the same in all processes
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static bool is_process_alive(pid_t pid)
+{
+    return kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+// the mutex is robust, a runner killed while holding it does not block the others
+static void lock_state(CpuArbiterState* pState)
+{
+    if (pthread_mutex_lock(&pState->mutex) == EOWNERDEAD)
+    {
+        pthread_mutex_consistent(&pState->mutex);
+    }
+}
+
+CpuArbiter::CpuArbiter(int nCores, double prefillShare)
+    : m_prefillShare(prefillShare)
+{
+    auto pMemory = mmap(nullptr, sizeof(CpuArbiterState), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (pMemory == MAP_FAILED)
+    {
+        throw std::runtime_error("failed to map CPU arbiter state");
+    }
+    m_pState = new (pMemory) CpuArbiterState();
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&m_pState->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    sched_getaffinity(0, sizeof(set), &set);
+    for (int cpu = 0; cpu < CPU_SETSIZE && m_pState->nCores < kMaxCores; ++cpu)
+    {
+        if (nCores > 0 && m_pState->nCores == nCores)
+        {
+            break;
+        }
+        if (CPU_ISSET(cpu, &set))
+        {
+            m_pState->cpus[m_pState->nCores++] = cpu;
+        }
+    }
+}
+
+CpuArbiter::~CpuArbiter()
+{
+    // the mapping stays alive in the other processes
+    munmap(m_pState, sizeof(CpuArbiterState));
+}
+
+std::vector<int> CpuArbiter::acquire(int maxThreads, EvalKind kind, uint64_t& waitUs)
+{
+    auto pid = getpid();
+    auto start = now_us();
+
+    std::vector<int> cores;
+    while (true)
+    {
+        lock_state(m_pState);
+
+        auto now = now_us();
+        auto nCores = m_pState->nCores;
+
+        // return cores of runners that died during eval
+        int nHeld = 0, nPrefillHeld = 0;
+        for (int i = 0; i < nCores; ++i)
+        {
+            auto owner = m_pState->owners[i];
+            if (owner != 0 && owner != pid && !is_process_alive(owner))
+            {
+                m_pState->owners[i] = 0;
+            }
+            nHeld += m_pState->owners[i] == pid;
+            nPrefillHeld += m_pState->owners[i] != 0 && m_pState->ownerKinds[i] == ePrefill;
+        }
+
+        // runners in the middle of a long eval hold cores, they are active regardless of when they started
+        auto isActive = [&](const CpuArbiterClient& client)
+        {
+            if (client.pid == 0)
+            {
+                return false;
+            }
+            if (now - client.lastActiveUs <= kActiveWindowUs)
+            {
+                return true;
+            }
+            return std::find(m_pState->owners, m_pState->owners + nCores, client.pid) != m_pState->owners + nCores;
+        };
+
+        // register the caller, reusing slots of runners that are gone or idle
+        CpuArbiterClient* pSelf = nullptr;
+        CpuArbiterClient* pFree = nullptr;
+        for (auto& client : m_pState->clients)
+        {
+            if (client.pid == pid)
+            {
+                pSelf = &client;
+                break;
+            }
+            if (!pFree && (!isActive(client) || !is_process_alive(client.pid)))
+            {
+                pFree = &client;
+            }
+        }
+        if (!pSelf)
+        {
+            pSelf = pFree;
+        }
+        if (pSelf)
+        {
+            pSelf->pid = pid;
+            pSelf->lastActiveUs = now;
+            pSelf->kind = kind;
+        }
+
+        int nDecode = 0, nPrefill = 0, rank = 0;
+        bool decodeWaiting = false;
+        for (const auto& client : m_pState->clients)
+        {
+            if (!isActive(client))
+            {
+                continue;
+            }
+            if (&client == pSelf)
+            {
+                rank = client.kind == eDecode ? nDecode : nPrefill;
+            }
+            else if (client.kind == eDecode && client.waiting)
+            {
+                decodeWaiting = true;
+            }
+            (client.kind == eDecode ? nDecode : nPrefill)++;
+        }
+
+        // prefill gets a bounded part of the cores while chats are decoding, decoding chats divide the rest
+        auto nPrefillCores = nPrefill == 0 ? 0 :
+                             nDecode == 0 ? nCores :
+                             std::max(1, std::min(static_cast<int>(nCores * m_prefillShare), nCores - 1));
+        auto nDecodeCores = nCores - nPrefillCores;
+
+        auto nGroup = std::max(kind == eDecode ? nDecode : nPrefill, 1);
+        auto nGroupCores = kind == eDecode ? nDecodeCores : nPrefillCores;
+        auto groupStart = kind == eDecode ? 0 : nDecodeCores;
+
+        // the share is the number of cores divided by the number of active runners, the remainder goes to the first.
+        // The only active runner is not capped by maxThreads, the other runners are idle and lend it their cores
+        auto share = nGroupCores / nGroup + (rank < nGroupCores % nGroup ? 1 : 0);
+        auto cap = nDecode + nPrefill <= 1 ? nCores : maxThreads;
+        auto want = std::min(cap, std::max(share, 1)) - nHeld;
+        if (kind == ePrefill && nDecode > 0)
+        {
+            want = std::min(want, nPrefillCores - nPrefillHeld);
+            if (decodeWaiting && now - start < kMaxPrefillYieldUs)
+            {
+                want = 0;
+            }
+        }
+
+        // runners start from different offsets, so that they keep using the same cores
+        auto offset = groupStart + nGroupCores * rank / nGroup;
+        for (int i = 0; i < nCores && want > 0; ++i)
+        {
+            auto core = (offset + i) % nCores;
+            if (m_pState->owners[core] == 0)
+            {
+                m_pState->owners[core] = pid;
+                m_pState->ownerKinds[core] = kind;
+                cores.push_back(core);
+                --want;
+            }
+        }
+
+        if (pSelf)
+        {
+            pSelf->waiting = cores.empty();
+        }
+
+        pthread_mutex_unlock(&m_pState->mutex);
+
+        if (!cores.empty())
+        {
+            break;
+        }
+
+        std::this_thread::sleep_for(500us);
+    }
+
+    waitUs = now_us() - start;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (auto core : cores)
+    {
+        CPU_SET(m_pState->cpus[core], &set);
+    }
+    sched_setaffinity(0, sizeof(set), &set);
+
+    return cores;
+}
+
+void CpuArbiter::release(const std::vector<int>& cores)
+{
+    auto pid = getpid();
+
+    lock_state(m_pState);
+    for (auto core : cores)
+    {
+        if (m_pState->owners[core] == pid)
+        {
+            m_pState->owners[core] = 0;
+        }
+    }
+    pthread_mutex_unlock(&m_pState->mutex);
+}
+
+int CpuArbiter::getCoreCount() const
+{
+    return m_pState->nCores;
+}
+
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#ifndef LLAMA_CPP_API_PROCESS_CPU_ARBITER_H
+#define LLAMA_CPP_API_PROCESS_CPU_ARBITER_H
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace llama_cpp_api
+{
+
+struct CpuArbiterState;
+
+/// Divides cores between runner processes, so that chats generating at the same time do not oversubscribe the CPU.
+/// The state lives in a shared anonymous mapping, so the arbiter has to be created before runners are forked
+class CpuArbiter
+{
+public:
+    enum EvalKind
+    {
+        eDecode,  // generating tokens, has priority
+        ePrefill, // evaluating prompt or input in chunks, gets at most prefillShare of cores while others decode
+    };
+
+    /// Uses the cores the process is allowed to run on, or the first nCores of them
+    explicit CpuArbiter(int nCores = 0, double prefillShare = 0.5);
+    ~CpuArbiter();
+
+    CpuArbiter(const CpuArbiter&) = delete;
+    CpuArbiter& operator=(const CpuArbiter&) = delete;
+
+    /// Claims a fair share of cores for the calling process, waiting until at least one is free. The share is at most
+    /// maxThreads, unless the caller is the only runner evaluating, then it gets all cores.
+    /// Prefill chunks also wait while decoding chats are waiting, for a bounded time.
+    /// Pins the calling thread to them, threads it creates inherit the affinity. Returns indices of claimed cores
+    std::vector<int> acquire(int maxThreads, EvalKind kind, uint64_t& waitUs);
+
+    /// Returns cores claimed by acquire
+    void release(const std::vector<int>& cores);
+
+    int getCoreCount() const;
+
+private:
+    CpuArbiterState* m_pState;
+    double m_prefillShare;
+};
+
+/// Holds cores of a CpuArbiter for the duration of a scope
+class CpuGrant
+{
+public:
+    CpuGrant(CpuArbiter* pArbiter, int maxThreads, CpuArbiter::EvalKind kind)
+        : m_pArbiter(pArbiter), m_threads(maxThreads)
+    {
+        if (m_pArbiter)
+        {
+            m_cores = m_pArbiter->acquire(maxThreads, kind, m_waitUs);
+            m_threads = static_cast<int>(m_cores.size());
+        }
+    }
+
+    ~CpuGrant()
+    {
+        if (m_pArbiter)
+        {
+            m_pArbiter->release(m_cores);
+        }
+    }
+
+    CpuGrant(const CpuGrant&) = delete;
+    CpuGrant& operator=(const CpuGrant&) = delete;
+
+    int getThreads() const
+    {
+        return m_threads;
+    }
+
+    uint64_t getWaitUs() const
+    {
+        return m_waitUs;
+    }
+
+private:
+    CpuArbiter* m_pArbiter;
+    std::vector<int> m_cores;
+    int m_threads;
+    uint64_t m_waitUs = 0;
+};
+
+}
+
+#endif // LLAMA_CPP_API_PROCESS_CPU_ARBITER_H
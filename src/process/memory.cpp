@@ -0,0 +1,156 @@
+#include "process/memory.h"
+
+#include <fstream>
+#include <sstream>
+#include <string>
+
+namespace llama_cpp_api
+{
+
+static bool parse_smaps_field(const std::string& line, std::string& key, uint64_t& bytes)
+{
+    std::istringstream stream(line);
+    std::string unit;
+    if (!(stream >> key >> bytes >> unit) || key.empty() || key.back() != ':' || unit != "kB")
+    {
+        return false;
+    }
+
+    key.pop_back();
+    bytes *= 1024;
+    return true;
+}
+
+static bool read_rollup(ProcessMemory& memory)
+{
+    std::ifstream file("/proc/self/smaps_rollup");
+    if (!file)
+    {
+        return false;
+    }
+
+    std::string line, key;
+    uint64_t bytes;
+    while (std::getline(file, line))
+    {
+        if (!parse_smaps_field(line, key, bytes))
+        {
+            continue;
+        }
+
+        if (key == "Rss") memory.rss = bytes;
+        else if (key == "Pss") memory.pss = bytes;
+        else if (key == "Shared_Clean") memory.sharedClean = bytes;
+        else if (key == "Shared_Dirty") memory.sharedDirty = bytes;
+        else if (key == "Private_Clean") memory.privateClean = bytes;
+        else if (key == "Private_Dirty") memory.privateDirty = bytes;
+        else if (key == "Anonymous") memory.anonymous = bytes;
+        else if (key == "Swap") memory.swap = bytes;
+    }
+
+    return true;
+}
+
+// smaps_rollup has no per-mapping breakdown, so dirty pages of file mappings are summed from smaps. When rollup is
+// missing (kernels before 4.14) the totals are summed here as well
+static bool read_smaps(ProcessMemory& memory, bool totals)
+{
+    std::ifstream file("/proc/self/smaps");
+    if (!file)
+    {
+        return false;
+    }
+
+    bool fileMapping = false;
+    std::string line, key;
+    uint64_t bytes;
+    while (std::getline(file, line))
+    {
+        if (!parse_smaps_field(line, key, bytes))
+        {
+            // mapping header: address perms offset dev inode [path]
+            std::istringstream stream(line);
+            std::string address, perms, offset, dev, inode, path;
+            if (stream >> address >> perms >> offset >> dev >> inode && address.find('-') != std::string::npos)
+            {
+                stream >> path;
+                fileMapping = inode != "0" && !path.empty() && path[0] == '/';
+            }
+            continue;
+        }
+
+        if (key == "Private_Dirty" && fileMapping)
+        {
+            memory.filePrivateDirty += bytes;
+        }
+
+        if (!totals)
+        {
+            continue;
+        }
+
+        if (key == "Rss") memory.rss += bytes;
+        else if (key == "Pss") memory.pss += bytes;
+        else if (key == "Shared_Clean") memory.sharedClean += bytes;
+        else if (key == "Shared_Dirty") memory.sharedDirty += bytes;
+        else if (key == "Private_Clean") memory.privateClean += bytes;
+        else if (key == "Private_Dirty") memory.privateDirty += bytes;
+        else if (key == "Anonymous") memory.anonymous += bytes;
+        else if (key == "Swap") memory.swap += bytes;
+    }
+
+    return true;
+}
+
+bool read_process_memory(ProcessMemory& memory)
+{
+    memory = ProcessMemory();
+    auto hasRollup = read_rollup(memory);
+    return read_smaps(memory, !hasRollup);
+}
+
+std::vector<MemoryRegion> read_memory_regions()
+{
+    std::vector<MemoryRegion> regions;
+
+    std::ifstream file("/proc/self/maps");
+    std::string line;
+    while (std::getline(file, line))
+    {
+        // address perms offset dev inode [path]
+        std::istringstream stream(line);
+        std::string address, perms, offset, dev, inode;
+        if (!(stream >> address >> perms >> offset >> dev >> inode))
+        {
+            continue;
+        }
+
+        auto separator = address.find('-');
+        if (separator == std::string::npos)
+        {
+            continue;
+        }
+
+        MemoryRegion region;
+        region.begin = std::stoull(address.substr(0, separator), nullptr, 16);
+        region.end = std::stoull(address.substr(separator + 1), nullptr, 16);
+        std::getline(stream >> std::ws, region.path);
+        regions.push_back(std::move(region));
+    }
+
+    return regions;
+}
+
+void append_memory_metrics(const ProcessMemory& memory, ModelMetrics& metrics)
+{
+    metrics.emplace_back("memory_rss_bytes", static_cast<double>(memory.rss));
+    metrics.emplace_back("memory_pss_bytes", static_cast<double>(memory.pss));
+    metrics.emplace_back("memory_shared_bytes", static_cast<double>(memory.sharedClean + memory.sharedDirty));
+    metrics.emplace_back("memory_private_clean_bytes", static_cast<double>(memory.privateClean));
+    metrics.emplace_back("memory_private_dirty_bytes", static_cast<double>(memory.privateDirty));
+    metrics.emplace_back("memory_anonymous_bytes", static_cast<double>(memory.anonymous));
+    metrics.emplace_back("memory_swap_bytes", static_cast<double>(memory.swap));
+    metrics.emplace_back("memory_file_private_dirty_bytes", static_cast<double>(memory.filePrivateDirty));
+}
+
+}
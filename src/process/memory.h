@@ -0,0 +1,47 @@
+#pragma once
+
+#ifndef LLAMA_CPP_API_PROCESS_MEMORY_H
+#define LLAMA_CPP_API_PROCESS_MEMORY_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "model/model.h"
+
+namespace llama_cpp_api
+{
+
+/// Memory of the calling process as seen by the kernel, all values in bytes
+struct ProcessMemory
+{
+    uint64_t rss = 0;
+    uint64_t pss = 0;               // shared pages are divided between the processes mapping them
+    uint64_t sharedClean = 0;
+    uint64_t sharedDirty = 0;
+    uint64_t privateClean = 0;
+    uint64_t privateDirty = 0;      // pages copied on write or allocated by this process only
+    uint64_t anonymous = 0;
+    uint64_t swap = 0;
+    uint64_t filePrivateDirty = 0;  // private dirty pages of file mappings, e.g. modified model weights
+};
+
+/// Reads /proc/self/smaps_rollup, and /proc/self/smaps for file mappings, returns false if they are not available
+bool read_process_memory(ProcessMemory& memory);
+
+struct MemoryRegion
+{
+    uintptr_t begin;
+    uintptr_t end;
+    std::string path; // empty for anonymous mappings
+};
+
+/// Reads mappings of the calling process from /proc/self/maps
+std::vector<MemoryRegion> read_memory_regions();
+
+/// Appends memory figures to metrics with memory_ prefix
+void append_memory_metrics(const ProcessMemory& memory, ModelMetrics& metrics);
+
+}
+
+#endif // LLAMA_CPP_API_PROCESS_MEMORY_H
@@ -1,9 +1,12 @@
 #include "process/model_runner.h"
 
 #include <cassert>
+#include <fstream>
 #include <string>
 #include <thread>
 #include <memory>
+#include <vector>
+#include <sstream>
 #include <iostream>
 #include <unistd.h>
 
@@ -11,18 +14,26 @@
 
 #include "model/model.h"
 #include "model/message_sender.h"
+#include "model/vocabulary.h"
+#include "process/checkpoint.h"
+#include "process/memory.h"
 
 using namespace std::chrono_literals;
 
 namespace llama_cpp_api
 {
 
+static const std::string kCheckpointHeader = "llama_cpp_api chat 4";
+
 class ModelRunner final : public Process
 {
 public:
-    ModelRunner(int processId, uint64_t timeoutMs, std::unique_ptr<Model> pModel)
+    ModelRunner(int processId, uint64_t timeoutMs, std::unique_ptr<Model> pModel, GenerationSlots* pSlots,
+                OutputRings* pRings, std::unique_ptr<TranscriptWriter> pTranscript, ResponseCache* pCache,
+                ChatPriority priority)
         : Process(processId, timeoutMs), m_pModel(std::move(pModel)),
-        m_pMessageSender(create_model_message_sender(&m_queue))
+        m_pMessageSender(create_model_message_sender(&m_queue)), m_pSlots(pSlots), m_priority(priority),
+        m_pRings(pRings), m_pTranscript(std::move(pTranscript)), m_pCache(pCache)
     {
         m_pModel->subscribe(m_pMessageSender.get());
     }
@@ -32,12 +43,12 @@ private:
     {
         if (size < calc_message_size_from_data_size(0))
         {
-            handleMessageFromModel(m_queue.get(getTimeout()));
-            return nullptr;
+            return handleMessageFromModel(m_queue.get(getTimeout()));
         }
 
         auto senderId = sender_id_in_buffer(data);
         auto messageId = message_id_in_buffer(data);
+        message_sequence() = sequence_in_buffer(data);
 
         switch (messageId)
         {
@@ -49,7 +60,8 @@ private:
                 pid = fork();
                 if (pid == 0)
                 {
-                    return make_model_runner(getpid(), getTimeout(), std::move(m_pModel));
+                    return make_model_runner(getpid(), getTimeout(), std::move(m_pModel), m_pSlots, m_pRings,
+                                             m_pTranscript->fork(), m_pCache, m_priority);
                 }
             }
 
@@ -57,12 +69,61 @@ private:
             response.send(get_channel_name(senderId), getBuffer());
             break;
         }
+        case ModelRunnerMessageId::eForkManyRequest:
+        {
+            auto message = ModelRunnerForkManyRequest::receive(data, size);
+
+            std::vector<int> pids;
+            if (!isBusy())
+            {
+                for (int i = 0; i < *message.pValue; ++i)
+                {
+                    auto pid = fork();
+                    if (pid == 0)
+                    {
+                        m_pModel->reseed(i + 1);
+                        return make_model_runner(getpid(), getTimeout(), std::move(m_pModel), m_pSlots, m_pRings,
+                                                 m_pTranscript->fork(), m_pCache, m_priority);
+                    }
+                    if (pid < 0)
+                    {
+                        break;
+                    }
+                    pids.push_back(pid);
+
+                    // the next fork, also of a later request, starts from another state, otherwise a second fan-out
+                    // would get the same seeds and replies as the first
+                    m_pModel->reseed(0);
+                }
+            }
+
+            ModelRunnerForkManyResponse response{getProcessId(), reinterpret_cast<const char*>(pids.data()),
+                                                 pids.size() * sizeof(int)};
+            response.send(get_channel_name(senderId), getBuffer());
+            break;
+        }
+        case ModelRunnerMessageId::eForkInitRequest:
+        {
+            if (m_keepInitReply && m_pModel->isBusy())
+            {
+                m_forkInit.push_back({senderId, message_sequence()});
+            }
+            else if (auto pChild = forkInit(senderId))
+            {
+                return pChild;
+            }
+            break;
+        }
         case ModelRunnerMessageId::eKillRequest:
         {
             stopModel();
+            releaseSlot();
+            releaseRing();
             ModelRunnerKillResponse response{getProcessId()};
             response.send(get_channel_name(senderId), getBuffer());
-            return nullptr;
+
+            // the model thread is not joined, so skip destructors
+            _exit(0);
         }
         case ModelRunnerMessageId::eInitRequest:
         {
@@ -82,8 +143,43 @@ private:
             response.send(get_channel_name(senderId), getBuffer());
             break;
         }
+        case ModelRunnerMessageId::eInputPieceRequest:
+        {
+            auto message = ModelRunnerInputPieceRequest::receive(data, size);
+
+            auto result = receivePiece(std::string(message.data, message.size));
+            ModelRunnerInputPieceResponse response{getProcessId(), result.data(), result.size()};
+            response.send(get_channel_name(senderId), getBuffer());
+            break;
+        }
+        case ModelRunnerMessageId::eAbortInputRequest:
+        {
+            auto result = abortPieces();
+            ModelRunnerAbortInputResponse response{getProcessId(), result.data(), result.size()};
+            response.send(get_channel_name(senderId), getBuffer());
+            break;
+        }
+        case ModelRunnerMessageId::eInitTokensRequest:
+        {
+            auto message = ModelRunnerInitTokensRequest::receive(data, size);
+
+            auto result = initTokens(message.data, message.size);
+            ModelRunnerInitTokensResponse response{getProcessId(), result.data(), result.size()};
+            response.send(get_channel_name(senderId), getBuffer());
+            break;
+        }
+        case ModelRunnerMessageId::eReceiveTokensRequest:
+        {
+            auto message = ModelRunnerReceiveTokensRequest::receive(data, size);
+
+            auto result = receiveTokens(message.data, message.size);
+            ModelRunnerReceiveTokensResponse response{getProcessId(), result.data(), result.size()};
+            response.send(get_channel_name(senderId), getBuffer());
+            break;
+        }
         case ModelRunnerMessageId::eStopModelRequest:
         {
+            dropInitReply();
             stopModel();
             ModelRunnerStopModelResponse response{getProcessId()};
             response.send(get_channel_name(senderId), getBuffer());
@@ -98,28 +194,88 @@ private:
         }
         case ModelRunnerMessageId::eNotifyWhenReadyRequest:
         {
-            if (!m_pModel->isBusy())
+            if (!isBusy())
             {
                 ModelRunnerDone response{getProcessId()};
                 response.send(get_channel_name(senderId).c_str(), getBuffer());
             }
             else
             {
-                m_notify.emplace_back(senderId);
+                m_notify.push_back({senderId, message_sequence()});
             }
             break;
         }
+        case ModelRunnerMessageId::eScoreRequest:
+        {
+            auto message = ModelRunnerScoreRequest::receive(data, size);
+
+            auto result = score(std::string(message.data, message.size));
+            ModelRunnerScoreResponse response{getProcessId(), result.data(), result.size()};
+            response.send(get_channel_name(senderId), getBuffer());
+            break;
         }
+        case ModelRunnerMessageId::eEmbedRequest:
+        {
+            auto message = ModelRunnerEmbedRequest::receive(data, size);
 
-        handleMessageFromModel(m_queue.get(getTimeout()));
-        return nullptr;
+            auto result = embed(std::string(message.data, message.size));
+            ModelRunnerEmbedResponse response{getProcessId(), result.data(), result.size()};
+            response.send(get_channel_name(senderId), getBuffer());
+            break;
+        }
+        case ModelRunnerMessageId::eConfigureRequest:
+        {
+            auto message = ModelRunnerConfigureRequest::receive(data, size);
+
+            auto result = configure(std::string(message.data, message.size));
+            ModelRunnerConfigureResponse response{getProcessId(), result.data(), result.size()};
+            response.send(get_channel_name(senderId), getBuffer());
+            break;
+        }
+        case ModelRunnerMessageId::eMetricsRequest:
+        {
+            auto result = getMetrics();
+            ModelRunnerMetricsResponse response{getProcessId(), result.data(), result.size()};
+            response.send(get_channel_name(senderId), getBuffer());
+            break;
+        }
+        case ModelRunnerMessageId::eCheckpointRequest:
+        {
+            auto message = ModelRunnerCheckpointRequest::receive(data, size);
+
+            auto result = checkpoint(std::string(message.data, message.size));
+            ModelRunnerCheckpointResponse response{getProcessId(), result.data(), result.size()};
+            response.send(get_channel_name(senderId), getBuffer());
+            break;
+        }
+        case ModelRunnerMessageId::eRestoreRequest:
+        {
+            auto message = ModelRunnerRestoreRequest::receive(data, size);
+
+            auto result = restore(std::string(message.data, message.size));
+            ModelRunnerRestoreResponse response{getProcessId(), result.data(), result.size()};
+            response.send(get_channel_name(senderId), getBuffer());
+            break;
+        }
+        case ModelRunnerMessageId::eLogProbRequest:
+        {
+            ModelRunnerReplyLogProb logprob{m_pModel->getLogProb(), m_pModel->getReplyLength()};
+            ModelRunnerLogProbResponse response{getProcessId(), &logprob};
+            response.send(get_channel_name(senderId), getBuffer());
+            break;
+        }
+        }
+
+        return handleMessageFromModel(m_queue.get(getTimeout()));
     }
 
-    void handleMessageFromModel(std::unique_ptr<PolyM::Msg> msg)
+    std::unique_ptr<Process> handleMessageFromModel(std::unique_ptr<PolyM::Msg> msg)
     {
         if (!msg)
         {
-            return;
+            feedPieces();
+            publishOutput();
+            return nullptr;
         }
 
         switch (msg->getMsgId())
@@ -129,23 +285,64 @@ private:
             receiveModelOutput(static_cast<PolyM::DataMsg<std::string>*>(msg.get())->getPayload());
             break;
         }
+        case ModelMessageId::eTurn:
+        {
+            m_pTranscript->endTurn(static_cast<PolyM::DataMsg<ModelTurn>*>(msg.get())->getPayload());
+            break;
+        }
         case ModelMessageId::eDone:
         {
             assert(!m_pModel->isBusy());
 
-            for (auto senderId : m_notify)
+            releaseSlot();
+
+            if (!m_cacheKey.empty())
             {
+                auto replay = m_pModel->getReplay();
+                if (!replay.empty())
+                {
+                    m_pCache->insert(m_cacheKey, m_cacheInput, replay);
+                }
+                m_cacheKey.clear();
+            }
+
+            // readers waiting for eReady find the whole reply in the ring
+            m_generating = false;
+            publishOutput();
+
+            for (const auto& request : m_notify)
+            {
+                message_sequence() = request.sequence;
                 ModelRunnerDone message{getProcessId()};
-                message.send(get_channel_name(senderId).c_str(), getBuffer());
+                message.send(get_channel_name(request.senderId).c_str(), getBuffer());
             }
             m_notify.clear();
+
+            while (!m_forkInit.empty())
+            {
+                auto request = m_forkInit.back();
+                m_forkInit.pop_back();
+                message_sequence() = request.sequence;
+                if (auto pChild = forkInit(request.senderId))
+                {
+                    return pChild;
+                }
+            }
             break;
         }
         }
+
+        feedPieces();
+        publishOutput();
+        return nullptr;
     }
 
     std::string init(const char* prompt)
     {
+        if (m_streaming)
+        {
+            return finishPieces(prompt, true);
+        }
         if (m_pModel->isBusy())
         {
             return "Error: Model is busy";
@@ -154,17 +351,114 @@ private:
         {
             return "Error: Already initialized";
         }
+        if (!acquireSlot())
+        {
+            return "Busy: Too many chats generating";
+        }
         if (!m_pModel->init(prompt))
         {
+            releaseSlot();
+            return "Error: Unknown error";
+        }
+
+        m_pTranscript->appendInput(prompt);
+        m_initReply.clear();
+        m_keepInitReply = true;
+        startGenerating();
+        return "Success";
+    }
+
+    // the prompt is tokenized by the client, the transcript gets the text of the tokens
+    std::string initTokens(const char* data, size_t size)
+    {
+        std::vector<int> tokens;
+        std::string prompt;
+        if (!read_token_ids(data, size, tokens) || tokens.empty())
+        {
+            return "Error: Expected token ids";
+        }
+        if (isBusy())
+        {
+            return "Error: Model is busy";
+        }
+        if (m_pModel->isInitialized())
+        {
+            return "Error: Already initialized";
+        }
+        try
+        {
+            prompt = m_pModel->detokenize(tokens);
+        }
+        catch (const std::exception& e)
+        {
+            return std::string("Error: ") + e.what();
+        }
+        if (!acquireSlot())
+        {
+            return "Busy: Too many chats generating";
+        }
+        if (!m_pModel->initTokens(tokens))
+        {
+            releaseSlot();
             return "Error: Unknown error";
         }
 
+        m_pTranscript->appendInput(prompt);
+        m_initReply.clear();
+        m_keepInitReply = true;
+        startGenerating();
         return "Success";
     }
 
+    // the new chat is in the state a chat initialized with the same prompt would be in, so it gets the same reply
+    std::unique_ptr<Process> forkInit(int senderId)
+    {
+        int pid = -1;
+        if (m_keepInitReply && !isBusy())
+        {
+            pid = fork();
+            if (pid == 0)
+            {
+                auto pChild = std::make_unique<ModelRunner>(getpid(), getTimeout(), std::move(m_pModel), m_pSlots,
+                                                            m_pRings, m_pTranscript->fork(), m_pCache,
+                                                            m_priority);
+                pChild->m_modelOutput = m_initReply;
+                pChild->acquireRing();
+                pChild->publishOutput();
+                return pChild;
+            }
+        }
+
+        ModelRunnerForkInitResponse response{getProcessId(), &pid};
+        response.send(get_channel_name(senderId), getBuffer());
+        return nullptr;
+    }
+
+    // anything but reading output changes the chat, so that it cannot be forked as a freshly initialized one anymore
+    void dropInitReply()
+    {
+        m_keepInitReply = false;
+        m_initReply = std::string();
+        // called while handling another request, which is answered after this
+        const auto sequence = message_sequence();
+        for (const auto& request : m_forkInit)
+        {
+            int pid = -1;
+            message_sequence() = request.sequence;
+            ModelRunnerForkInitResponse response{getProcessId(), &pid};
+            response.send(get_channel_name(request.senderId), getBuffer());
+        }
+        m_forkInit.clear();
+        message_sequence() = sequence;
+    }
+
     std::string receiveInput(const char* input)
     {
-        if (!m_modelOutput.empty())
+        if (m_streaming)
+        {
+            return finishPieces(input, false);
+        }
+        if (!m_modelOutput.empty() || (m_ring >= 0 && !m_pRings->peek(m_ring).empty()))
         {
             return "Error: Read pending output first";
         }
@@ -172,17 +466,420 @@ private:
         {
             return "Error: Model is busy";
         }
-        if (!m_pModel->processUserInput(input))
+        if (!acquireSlot())
+        {
+            return "Busy: Too many chats generating";
+        }
+
+        // a cached reply is evaluated in n_batch chunks like a prefill instead of being sampled token by token
+        std::string reply;
+        m_cacheKey.clear();
+        if (m_pCache && m_pCache->isEnabled())
+        {
+            m_cacheKey = m_pModel->getStateKey();
+            m_cacheInput = input;
+            if (!m_cacheKey.empty() && m_pCache->find(m_cacheKey, m_cacheInput, reply))
+            {
+                m_cacheKey.clear();
+            }
+        }
+
+        if (!(reply.empty() ? m_pModel->processUserInput(input) : m_pModel->processReplay(input, reply)))
+        {
+            releaseSlot();
+            return "Error: Unknown error";
+        }
+
+        dropInitReply();
+        m_pTranscript->appendInput(input);
+        startGenerating();
+        return "Success";
+    }
+
+    // replies to tokenized inputs are not cached, the cache is keyed by text
+    std::string receiveTokens(const char* data, size_t size)
+    {
+        std::vector<int> tokens;
+        std::string input;
+        if (!read_token_ids(data, size, tokens) || tokens.empty())
+        {
+            return "Error: Expected token ids";
+        }
+        if (!m_modelOutput.empty() || (m_ring >= 0 && !m_pRings->peek(m_ring).empty()))
+        {
+            return "Error: Read pending output first";
+        }
+        if (isBusy())
+        {
+            return "Error: Model is busy";
+        }
+        try
+        {
+            input = m_pModel->detokenize(tokens);
+        }
+        catch (const std::exception& e)
+        {
+            return std::string("Error: ") + e.what();
+        }
+        if (!acquireSlot())
+        {
+            return "Busy: Too many chats generating";
+        }
+        if (!m_pModel->processTokens(tokens))
+        {
+            releaseSlot();
+            return "Error: Unknown error";
+        }
+
+        m_cacheKey.clear();
+        dropInitReply();
+        m_pTranscript->appendInput(input);
+        startGenerating();
+        return "Success";
+    }
+
+    // the first piece is checked as init and receiveInput check the whole text, the model takes the pieces received
+    // meanwhile whenever it is done with the previous ones. The generation slot is taken for the last piece, which
+    // starts the reply, an upload that is slow to arrive does not hold it
+    std::string receivePiece(const std::string& piece)
+    {
+        if (!m_streaming)
+        {
+            if (!m_modelOutput.empty() || (m_ring >= 0 && !m_pRings->peek(m_ring).empty()))
+            {
+                return "Error: Read pending output first";
+            }
+            if (m_pModel->isBusy())
+            {
+                return "Error: Model is busy";
+            }
+
+            m_streaming = true;
+            m_streamingPrompt = !m_pModel->isInitialized();
+            if (!m_streamingPrompt)
+            {
+                dropInitReply();
+            }
+        }
+        else if (m_lastPiece)
+        {
+            return "Error: Input is complete";
+        }
+
+        m_input += piece;
+        m_pieces += piece;
+        feedPieces();
+        return "Success";
+    }
+
+    // the rest of the text after its pieces, the reply is generated as after init or receiveInput
+    std::string finishPieces(const char* text, bool prompt)
+    {
+        if (m_lastPiece)
+        {
+            return "Error: Input is complete";
+        }
+        if (prompt != m_streamingPrompt)
+        {
+            return prompt ? "Error: Already initialized" : "Error: Chat is not initialized";
+        }
+        if (!acquireSlot())
+        {
+            return "Busy: Too many chats generating";
+        }
+
+        // the transcript gets the input once it is complete, an aborted one leaves no trace
+        m_pTranscript->appendInput(m_input + text);
+        m_input = std::string();
+        m_pieces += text;
+        m_lastPiece = true;
+        if (prompt)
+        {
+            m_initReply.clear();
+            m_keepInitReply = true;
+        }
+        startGenerating();
+        feedPieces();
+        return "Success";
+    }
+
+    // the pieces the model has taken are rolled back once it is done with them, the rest are dropped
+    std::string abortPieces()
+    {
+        if (!m_streaming)
+        {
+            return "Error: No input is arriving";
+        }
+        if (m_lastPiece)
+        {
+            return "Error: Input is complete";
+        }
+        if (m_streamingPrompt)
+        {
+            return "Error: Chat is not initialized";
+        }
+
+        while (m_pModel->isBusy())
+        {
+            std::this_thread::sleep_for(10ms);
+        }
+        if (!m_pModel->abortPieces())
         {
             return "Error: Unknown error";
         }
 
+        m_pieces = std::string();
+        m_input = std::string();
+        m_streaming = false;
+        return "Success";
+    }
+
+    void feedPieces()
+    {
+        if (!m_streaming || m_pModel->isBusy() || (m_pieces.empty() && !m_lastPiece))
+        {
+            return;
+        }
+
+        if (m_pModel->processPiece(m_pieces, m_lastPiece))
+        {
+            m_pieces = std::string();
+            m_streaming = !m_lastPiece;
+            m_lastPiece = false;
+        }
+    }
+
+    std::string score(const std::string& text)
+    {
+        if (isBusy())
+        {
+            return "Error: Model is busy";
+        }
+
+        std::vector<double> logprobs;
+        try
+        {
+            logprobs = m_pModel->score(text);
+        }
+        catch (const std::exception& e)
+        {
+            return std::string("Error: ") + e.what();
+        }
+
+        std::string result(1 + logprobs.size() * sizeof(double), 'S');
+        std::memcpy(&result[1], logprobs.data(), logprobs.size() * sizeof(double));
+        return result;
+    }
+
+    std::string embed(const std::string& body)
+    {
+        if (isBusy())
+        {
+            return "Error: Model is busy";
+        }
+
+        std::vector<std::string> texts;
+        std::istringstream stream(body);
+        std::string line;
+        while (std::getline(stream, line))
+        {
+            texts.push_back(line);
+        }
+
+        if (!acquireSlot())
+        {
+            return "Busy: Too many chats generating";
+        }
+
+        std::vector<std::vector<float>> embeddings;
+        try
+        {
+            embeddings = m_pModel->embed(texts);
+        }
+        catch (const std::exception& e)
+        {
+            releaseSlot();
+            return std::string("Error: ") + e.what();
+        }
+        releaseSlot();
+
+        int32_t dimensions = embeddings.empty() ? 0 : embeddings.front().size();
+        std::string result(1 + sizeof(dimensions), 'S');
+        std::memcpy(&result[1], &dimensions, sizeof(dimensions));
+        result.reserve(result.size() + embeddings.size() * dimensions * sizeof(float));
+        for (const auto& embedding : embeddings)
+        {
+            result.append(reinterpret_cast<const char*>(embedding.data()), embedding.size() * sizeof(float));
+        }
+        return result;
+    }
+
+    std::string configure(const std::string& settings)
+    {
+        if (isBusy())
+        {
+            return "Error: Model is busy";
+        }
+        dropInitReply();
+
+        std::istringstream stream(settings);
+        std::string line;
+        while (std::getline(stream, line))
+        {
+            if (line.empty())
+            {
+                continue;
+            }
+
+            auto separator = line.find('=');
+            if (separator == std::string::npos)
+            {
+                return "Error: Expected key=value, got " + line;
+            }
+
+            // priority belongs to the runner, the rest to the model
+            auto key = line.substr(0, separator);
+            auto value = line.substr(separator + 1);
+            if (key == "priority")
+            {
+                if (!parse_chat_priority(value, m_priority))
+                {
+                    return "Error: Unknown priority " + value;
+                }
+                continue;
+            }
+
+            auto error = m_pModel->configure(key, value);
+            if (!error.empty())
+            {
+                return "Error: " + error;
+            }
+        }
+
+        return "Success";
+    }
+
+    std::string getMetrics()
+    {
+        auto metrics = m_pModel->getMetrics();
+
+        ProcessMemory memory;
+        if (read_process_memory(memory))
+        {
+            append_memory_metrics(memory, metrics);
+        }
+        if (m_pCache)
+        {
+            m_pCache->appendMetrics(metrics);
+        }
+
+        std::ostringstream stream;
+        stream.precision(15);
+        for (const auto& [name, value] : metrics)
+        {
+            stream << name << " " << value << "\n";
+        }
+
+        return stream.str();
+    }
+
+    std::string checkpoint(const std::string& request)
+    {
+        // the server waits for the chat to finish and asks again
+        if (isBusy())
+        {
+            return "Busy";
+        }
+
+        std::istringstream stream(request);
+        std::string dir;
+        std::getline(stream, dir);
+
+        std::vector<std::string> basePaths;
+        int baseId;
+        while (stream >> baseId)
+        {
+            basePaths.push_back(get_checkpoint_kv_path(dir, baseId));
+        }
+
+        try
+        {
+            std::ofstream file(get_checkpoint_state_path(dir, getProcessId()), std::ios::binary);
+            write_string(file, kCheckpointHeader);
+            write_pod<int32_t>(file, m_priority);
+            write_string(file, (m_ring >= 0 ? m_pRings->peek(m_ring) : std::string()) + m_modelOutput);
+
+            auto initialized = m_pModel->isInitialized();
+            write_pod<uint8_t>(file, initialized);
+            if (initialized)
+            {
+                m_pModel->save(file, get_checkpoint_kv_path(dir, getProcessId()), basePaths);
+            }
+
+            if (!file)
+            {
+                return "Error: Failed to write chat state";
+            }
+
+            return initialized ? "Success" : "Empty";
+        }
+        catch (const std::exception& e)
+        {
+            return std::string("Error: ") + e.what();
+        }
+    }
+
+    std::string restore(const std::string& request)
+    {
+        if (m_pModel->isBusy() || m_pModel->isInitialized())
+        {
+            return "Error: Chat is already initialized";
+        }
+
+        std::istringstream stream(request);
+        std::string dir;
+        int id;
+        if (!std::getline(stream, dir) || !(stream >> id))
+        {
+            return "Error: Expected dir and id";
+        }
+
+        try
+        {
+            std::ifstream file(get_checkpoint_state_path(dir, id), std::ios::binary);
+            if (read_string(file) != kCheckpointHeader)
+            {
+                return "Error: Not a chat checkpoint";
+            }
+            m_priority = static_cast<ChatPriority>(read_pod<int32_t>(file));
+            m_modelOutput = read_string(file);
+            if (!m_modelOutput.empty())
+            {
+                acquireRing();
+                publishOutput();
+            }
+
+            if (read_pod<uint8_t>(file) && !m_pModel->load(file, get_checkpoint_kv_path(dir, id)))
+            {
+                return "Error: Chat is already initialized";
+            }
+        }
+        catch (const std::exception& e)
+        {
+            return std::string("Error: ") + e.what();
+        }
+
         return "Success";
     }
 
     void receiveModelOutput(const std::string& output)
     {
+        m_pTranscript->appendOutput(output);
         m_modelOutput += output;
+        if (m_keepInitReply)
+        {
+            m_initReply += output;
+        }
     }
 
     std::string releaseModelOutput()
@@ -190,17 +887,72 @@ private:
         return std::move(m_modelOutput);
     }
 
+    void startGenerating()
+    {
+        m_generating = true;
+        acquireRing();
+        publishOutput();
+    }
+
+    void acquireRing()
+    {
+        if (m_ring < 0 && m_pRings)
+        {
+            m_ring = m_pRings->acquire(getProcessId());
+        }
+    }
+
+    // moves output to the ring as far as its slowest reader has made room, the rest is retried on the next poll
+    void publishOutput()
+    {
+        if (m_ring < 0)
+        {
+            return;
+        }
+
+        if (!m_modelOutput.empty())
+        {
+            m_modelOutput.erase(0, m_pRings->write(m_ring, m_modelOutput.data(), m_modelOutput.size()));
+        }
+        m_pRings->setHasMore(m_ring, m_generating || !m_modelOutput.empty());
+    }
+
+    void releaseRing()
+    {
+        if (m_ring >= 0)
+        {
+            m_pRings->release(m_ring);
+            m_ring = -1;
+        }
+    }
+
+    // a chat receiving pieces is busy between them as well
     bool isBusy()
     {
-        return m_pModel->isBusy();
+        return m_pModel->isBusy() || m_streaming;
     }
 
+    bool acquireSlot()
+    {
+        return !m_pSlots || m_pSlots->tryAcquire(m_priority);
+    }
+
+    void releaseSlot()
+    {
+        if (m_pSlots)
+        {
+            m_pSlots->release();
+        }
+    }
+
+    // a text that has arrived completely is passed on first, so that it is its reply that is stopped
     void stopModel()
     {
-        while (m_pModel->isBusy())
+        while (m_pModel->isBusy() || (m_streaming && m_lastPiece))
         {
             m_pModel->stop();
             std::this_thread::sleep_for(100ms);
+            feedPieces();
         }
     }
 
@@ -208,16 +960,55 @@ private:
     std::unique_ptr<Model> m_pModel;
     PolyM::Queue m_queue;
     std::unique_ptr<ModelSubscriber> m_pMessageSender;
-    std::string m_modelOutput;
+    std::string m_modelOutput; // output that is not in the ring yet
+
+    // requests answered when the reply is done, with the sequence numbers their answers carry
+    struct PendingRequest
+    {
+        int senderId;
+        uint32_t sequence;
+    };
+
+    std::vector<PendingRequest> m_notify;
+
+    // shared by all runners, limits how many of them generate at once
+    GenerationSlots* m_pSlots;
+    ChatPriority m_priority;
+
+    // shared with the server, which reads output from it directly; -1 - output is released through IPC
+    OutputRings* m_pRings;
+    int m_ring = -1;
+    bool m_generating = false;
+
+    // text arriving in pieces, the model gets what has arrived whenever it is done with the previous pieces
+    std::string m_pieces;
+    bool m_streaming = false;
+    bool m_streamingPrompt = false;
+    bool m_lastPiece = false; // the rest of the text has arrived
+    std::string m_input;      // pieces received so far, for the transcript
+
+    std::unique_ptr<TranscriptWriter> m_pTranscript;
+
+    // reply to the prompt while the chat has received nothing else, forked chats with the same prompt start with it
+    std::string m_initReply;
+    bool m_keepInitReply = false;
+    std::vector<PendingRequest> m_forkInit; // servers waiting for the reply to be done to fork the chat
 
-    std::vector<int> m_notify;
+    // shared by all runners, nullptr - none
+    ResponseCache* m_pCache;
+    std::string m_cacheKey; // state of the chat before the reply being generated, empty - it is not cached
+    std::string m_cacheInput;
 };
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-std::unique_ptr<Process> make_model_runner(int processId, uint64_t timeoutMs, std::unique_ptr<Model> pModel)
+std::unique_ptr<Process> make_model_runner(int processId, uint64_t timeoutMs, std::unique_ptr<Model> pModel,
+                                           GenerationSlots* pSlots, OutputRings* pRings,
+                                           std::unique_ptr<TranscriptWriter> pTranscript, ResponseCache* pCache,
+                                           ChatPriority priority)
 {
-    return std::make_unique<ModelRunner>(processId, timeoutMs, std::move(pModel));
+    return std::make_unique<ModelRunner>(processId, timeoutMs, std::move(pModel), pSlots, pRings,
+                                         std::move(pTranscript), pCache, priority);
 }
 
 }
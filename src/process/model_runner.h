@@ -4,6 +4,10 @@
 #define LLAMA_CPP_API_PROCESS_MODEL_RUNNER_H
 
 #include "messages/common.h"
+#include "process/admission.h"
+#include "process/output_ring.h"
+#include "process/response_cache.h"
+#include "process/transcript.h"
 #include "process/process.h"
 #include "model/model.h"
 
@@ -17,6 +21,12 @@ enum ModelRunnerMessageId : int
     eForkRequest,
     eForkResponse,
 
+    eForkManyRequest,
+    eForkManyResponse,
+
+    eForkInitRequest,
+    eForkInitResponse,
+
     eKillRequest,
     eKillResponse,
 
@@ -26,6 +36,18 @@ enum ModelRunnerMessageId : int
     eReceiveInputRequest,
     eReceiveInputResponse,
 
+    eInputPieceRequest,
+    eInputPieceResponse,
+
+    eAbortInputRequest,
+    eAbortInputResponse,
+
+    eInitTokensRequest,
+    eInitTokensResponse,
+
+    eReceiveTokensRequest,
+    eReceiveTokensResponse,
+
     eStopModelRequest,
     eStopModelResponse,
 
@@ -34,11 +56,40 @@ enum ModelRunnerMessageId : int
 
     eNotifyWhenReadyRequest,
     eReady,
+
+    eLogProbRequest,
+    eLogProbResponse,
+
+    eScoreRequest,
+    eScoreResponse,
+
+    eEmbedRequest,
+    eEmbedResponse,
+
+    eConfigureRequest,
+    eConfigureResponse,
+
+    eMetricsRequest,
+    eMetricsResponse,
+
+    eCheckpointRequest,
+    eCheckpointResponse,
+
+    eRestoreRequest,
+    eRestoreResponse,
 };
 
 using ModelRunnerForkRequest = EmptyMessage<ModelRunnerMessageId::eForkRequest>;
 using ModelRunnerForkResponse = ValueMessage<ModelRunnerMessageId::eForkResponse, int>;
 
+using ModelRunnerForkManyRequest = ValueMessage<ModelRunnerMessageId::eForkManyRequest, int>;
+using ModelRunnerForkManyResponse = DataBufferMessage<ModelRunnerMessageId::eForkManyResponse>; // array of int ids
+
+// forks the chat once it has replied to its prompt, the new chat starts with that reply as unread output.
+// -1 if the chat has received anything but the prompt
+using ModelRunnerForkInitRequest = EmptyMessage<ModelRunnerMessageId::eForkInitRequest>;
+using ModelRunnerForkInitResponse = ValueMessage<ModelRunnerMessageId::eForkInitResponse, int>;
+
 using ModelRunnerKillRequest = EmptyMessage<ModelRunnerMessageId::eKillRequest>;
 using ModelRunnerKillResponse = EmptyMessage<ModelRunnerMessageId::eKillResponse>;
 
@@ -48,6 +99,19 @@ using ModelRunnerInitResponse = DataBufferMessage<ModelRunnerMessageId::eInitRes
 using ModelRunnerReceiveInputRequest = DataBufferMessage<ModelRunnerMessageId::eReceiveInputRequest>;
 using ModelRunnerReceiveInputResponse = DataBufferMessage<ModelRunnerMessageId::eReceiveInputResponse>;
 
+using ModelRunnerInputPieceRequest = DataBufferMessage<ModelRunnerMessageId::eInputPieceRequest>;
+using ModelRunnerInputPieceResponse = DataBufferMessage<ModelRunnerMessageId::eInputPieceResponse>;
+
+// drops the pieces of an input whose upload broke off before the last one, the chat is as before the first piece
+using ModelRunnerAbortInputRequest = EmptyMessage<ModelRunnerMessageId::eAbortInputRequest>;
+using ModelRunnerAbortInputResponse = DataBufferMessage<ModelRunnerMessageId::eAbortInputResponse>;
+
+using ModelRunnerInitTokensRequest = DataBufferMessage<ModelRunnerMessageId::eInitTokensRequest>;
+using ModelRunnerInitTokensResponse = DataBufferMessage<ModelRunnerMessageId::eInitTokensResponse>;
+
+using ModelRunnerReceiveTokensRequest = DataBufferMessage<ModelRunnerMessageId::eReceiveTokensRequest>;
+using ModelRunnerReceiveTokensResponse = DataBufferMessage<ModelRunnerMessageId::eReceiveTokensResponse>;
+
 using ModelRunnerStopModelRequest = EmptyMessage<ModelRunnerMessageId::eStopModelRequest>;
 using ModelRunnerStopModelResponse = EmptyMessage<ModelRunnerMessageId::eStopModelResponse>;
 
@@ -78,8 +142,7 @@ struct ModelRunnerReleaseOutputResponse : public DataBufferMessage<ModelRunnerMe
         message_data_in_buffer(rBuffer.get())[0] = hasMore;
         std::memcpy(message_data_in_buffer(rBuffer.get()) + 1, data, size);
 
-        rChannel.wait_for_recv(1);
-        rChannel.send(rBuffer.get(), messageSize);
+        send_message(rChannel, rBuffer, messageSize);
     }
 
     void send(const std::string& channelName, MessageBuffer& rBuffer)
@@ -92,7 +155,40 @@ struct ModelRunnerReleaseOutputResponse : public DataBufferMessage<ModelRunnerMe
 using ModelRunnerNotifyWhenReadyRequest = EmptyMessage<ModelRunnerMessageId::eNotifyWhenReadyRequest>;
 using ModelRunnerDone = EmptyMessage<ModelRunnerMessageId::eReady>;
 
-std::unique_ptr<Process> make_model_runner(int processId, uint64_t timeoutMs, std::unique_ptr<Model> pModel);
+using ModelRunnerLogProbRequest = EmptyMessage<ModelRunnerMessageId::eLogProbRequest>;
+// cumulative log-probability of the reply to the last input and the number of its tokens
+struct ModelRunnerReplyLogProb
+{
+    double logprob;
+    int32_t tokens;
+};
+using ModelRunnerLogProbResponse = ValueMessage<ModelRunnerMessageId::eLogProbResponse, ModelRunnerReplyLogProb>;
+
+using ModelRunnerScoreRequest = DataBufferMessage<ModelRunnerMessageId::eScoreRequest>;
+using ModelRunnerScoreResponse = DataBufferMessage<ModelRunnerMessageId::eScoreResponse>; // 'S' + array of double
+
+using ModelRunnerEmbedRequest = DataBufferMessage<ModelRunnerMessageId::eEmbedRequest>; // one text per line
+// 'S' + int32 dimensions + array of float, one embedding per text
+using ModelRunnerEmbedResponse = DataBufferMessage<ModelRunnerMessageId::eEmbedResponse>;
+
+using ModelRunnerConfigureRequest = DataBufferMessage<ModelRunnerMessageId::eConfigureRequest>; // "key=value" lines
+using ModelRunnerConfigureResponse = DataBufferMessage<ModelRunnerMessageId::eConfigureResponse>;
+
+using ModelRunnerMetricsRequest = EmptyMessage<ModelRunnerMessageId::eMetricsRequest>;
+using ModelRunnerMetricsResponse = DataBufferMessage<ModelRunnerMessageId::eMetricsResponse>; // "name value" lines
+
+// "dir\n" + ids of the parents whose KV caches the delta is taken against, nearest last
+using ModelRunnerCheckpointRequest = DataBufferMessage<ModelRunnerMessageId::eCheckpointRequest>;
+// "Success", "Empty" if the chat is not initialized and has no KV cache to save, or error
+using ModelRunnerCheckpointResponse = DataBufferMessage<ModelRunnerMessageId::eCheckpointResponse>;
+
+using ModelRunnerRestoreRequest = DataBufferMessage<ModelRunnerMessageId::eRestoreRequest>; // "dir\nid"
+using ModelRunnerRestoreResponse = DataBufferMessage<ModelRunnerMessageId::eRestoreResponse>;
+
+std::unique_ptr<Process> make_model_runner(int processId, uint64_t timeoutMs, std::unique_ptr<Model> pModel,
+                                           GenerationSlots* pSlots, OutputRings* pRings,
+                                           std::unique_ptr<TranscriptWriter> pTranscript, ResponseCache* pCache,
+                                           ChatPriority priority);
 
 }
 
@@ -0,0 +1,146 @@
+#include "process/numa.h"
+
+#include <algorithm>
+#include <cctype>
+#include <dirent.h>
+#include <fstream>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <sstream>
+#include <string>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace llama_cpp_api
+{
+
+static constexpr int kMaxNodes = 1024;
+
+// cpulist format: "0-3,8-11"
+static std::vector<int> parse_cpu_list(const std::string& str)
+{
+    std::vector<int> cpus;
+    std::istringstream stream(str);
+    std::string range;
+    while (std::getline(stream, range, ','))
+    {
+        auto separator = range.find('-');
+        try
+        {
+            auto first = std::stoi(range.substr(0, separator));
+            auto last = separator == std::string::npos ? first : std::stoi(range.substr(separator + 1));
+            for (auto cpu = first; cpu <= last; ++cpu)
+            {
+                cpus.push_back(cpu);
+            }
+        }
+        catch (const std::exception&)
+        {
+            // trailing newline or empty list
+        }
+    }
+
+    return cpus;
+}
+
+std::vector<NumaNode> read_numa_nodes(int simulatedNodes)
+{
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+
+    std::vector<NumaNode> nodes;
+    if (simulatedNodes > 0)
+    {
+        std::vector<int> cpus;
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+        {
+            if (CPU_ISSET(cpu, &allowed))
+            {
+                cpus.push_back(cpu);
+            }
+        }
+
+        // nodes get consecutive CPUs, like sockets usually do
+        auto nNodes = std::min<int>(simulatedNodes, cpus.size());
+        for (int i = 0; i < nNodes; ++i)
+        {
+            nodes.push_back(NumaNode{i, std::vector<int>(cpus.begin() + cpus.size() * i / nNodes,
+                                                         cpus.begin() + cpus.size() * (i + 1) / nNodes), true});
+        }
+
+        return nodes;
+    }
+
+    auto pDir = opendir("/sys/devices/system/node");
+    if (!pDir)
+    {
+        return nodes;
+    }
+
+    while (auto pEntry = readdir(pDir))
+    {
+        std::string name = pEntry->d_name;
+        if (name.rfind("node", 0) != 0 || name.size() == 4 || !isdigit(name[4]))
+        {
+            continue;
+        }
+
+        std::ifstream file("/sys/devices/system/node/" + name + "/cpulist");
+        std::string cpuList;
+        std::getline(file, cpuList);
+
+        NumaNode node{std::stoi(name.substr(4)), {}, false};
+        for (auto cpu : parse_cpu_list(cpuList))
+        {
+            if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))
+            {
+                node.cpus.push_back(cpu);
+            }
+        }
+
+        // memory-only nodes and nodes outside of the cpuset get no runner
+        if (!node.cpus.empty())
+        {
+            nodes.push_back(std::move(node));
+        }
+    }
+    closedir(pDir);
+
+    std::sort(nodes.begin(), nodes.end(), [](const auto& a, const auto& b)
+    {
+        return a.id < b.id;
+    });
+
+    return nodes;
+}
+
+bool bind_to_numa_node(const NumaNode& node)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (auto cpu : node.cpus)
+    {
+        CPU_SET(cpu, &set);
+    }
+    if (sched_setaffinity(0, sizeof(set), &set) != 0)
+    {
+        return false;
+    }
+
+    if (node.simulated)
+    {
+        return true;
+    }
+    if (node.id >= kMaxNodes)
+    {
+        return false;
+    }
+
+    // libnuma is not needed for a single call
+    unsigned long mask[kMaxNodes / (8 * sizeof(unsigned long))] = {};
+    mask[node.id / (8 * sizeof(unsigned long))] |= 1ul << (node.id % (8 * sizeof(unsigned long)));
+    return syscall(SYS_set_mempolicy, MPOL_BIND, mask, kMaxNodes) == 0;
+}
+
+}
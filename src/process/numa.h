@@ -0,0 +1,28 @@
+#pragma once
+
+#ifndef LLAMA_CPP_API_PROCESS_NUMA_H
+#define LLAMA_CPP_API_PROCESS_NUMA_H
+
+#include <vector>
+
+namespace llama_cpp_api
+{
+
+struct NumaNode
+{
+    int id;
+    std::vector<int> cpus;
+    bool simulated; // CPUs split between nodes that are not there, memory is not bound
+};
+
+/// Reads nodes with CPUs the process is allowed to run on from /sys/devices/system/node. With simulatedNodes > 0 the
+/// allowed CPUs are split into that many nodes instead, to try placement on machines with one node
+std::vector<NumaNode> read_numa_nodes(int simulatedNodes);
+
+/// Runs the calling thread on CPUs of the node and allocates its memory there, threads and processes it creates
+/// later inherit both. Returns false if the binding failed
+bool bind_to_numa_node(const NumaNode& node);
+
+}
+
+#endif // LLAMA_CPP_API_PROCESS_NUMA_H
@@ -0,0 +1,373 @@
+#include "process/output_ring.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <new>
+#include <pthread.h>
+#include <signal.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace llama_cpp_api
+{
+
+static constexpr size_t kAlignment = 64;
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "ring positions are shared between processes");
+
+struct OutputRingsState
+{
+    pthread_mutex_t mutex; // taken to acquire a ring only, reads and writes are lock-free
+};
+
+// positions count bytes written since the ring was acquired, the byte at position p is at p % capacity
+struct OutputRingHeader
+{
+    std::atomic<pid_t> owner; // 0 - free
+    std::atomic<int> id;
+    std::atomic<uint32_t> hasMore;
+    std::atomic<uint32_t> readers; // bit per cursor that holds output back, the consumer and registered viewers
+    std::atomic<uint64_t> head;
+    std::atomic<uint64_t> cursors[OutputRings::kMaxCursors];
+    std::atomic<int64_t> lastReadUs[OutputRings::kMaxCursors];
+};
+
+static size_t align(size_t size)
+{
+    return (size + kAlignment - 1) / kAlignment * kAlignment;
+}
+
+static int64_t now_us()
+{
+    // steady clock is CLOCK_MONOTONIC, which is the same in all processes
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void lock_state(OutputRingsState* pState)
+{
+    if (pthread_mutex_lock(&pState->mutex) == EOWNERDEAD)
+    {
+        pthread_mutex_consistent(&pState->mutex);
+    }
+}
+
+OutputRings::OutputRings(int count, size_t capacity, uint64_t viewerTimeoutMs)
+    : m_count(std::max(count, 0)), m_capacity(std::max<size_t>(capacity, kAlignment)),
+    m_viewerTimeoutUs(viewerTimeoutMs * 1000)
+{
+    if (m_count == 0)
+    {
+        return;
+    }
+
+    // pages of a ring are only touched once a chat writes to it
+    m_stride = align(sizeof(OutputRingHeader)) + align(m_capacity);
+    m_mappingSize = align(sizeof(OutputRingsState)) + m_count * m_stride;
+    auto pMemory = mmap(nullptr, m_mappingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (pMemory == MAP_FAILED)
+    {
+        throw std::runtime_error("failed to map output rings");
+    }
+    m_pState = new (pMemory) OutputRingsState();
+    m_pRings = static_cast<char*>(pMemory) + align(sizeof(OutputRingsState));
+    for (int i = 0; i < m_count; ++i)
+    {
+        new (getHeader(i)) OutputRingHeader();
+    }
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&m_pState->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+OutputRings::~OutputRings()
+{
+    if (m_pState)
+    {
+        munmap(m_pState, m_mappingSize);
+    }
+}
+
+int OutputRings::acquire(int id)
+{
+    if (m_count == 0)
+    {
+        return -1;
+    }
+
+    auto pid = getpid();
+
+    lock_state(m_pState);
+
+    int ring = -1;
+    for (int i = 0; i < m_count && ring < 0; ++i)
+    {
+        auto owner = getHeader(i)->owner.load();
+        if (owner == 0 || (owner != pid && kill(owner, 0) != 0 && errno == ESRCH))
+        {
+            ring = i;
+        }
+    }
+
+    if (ring >= 0)
+    {
+        // readers match the id before they look at the positions, so it is published last
+        auto pHeader = getHeader(ring);
+        pHeader->id.store(-1);
+        pHeader->owner.store(pid);
+        pHeader->hasMore.store(0);
+        pHeader->head.store(0);
+        for (auto& cursor : pHeader->cursors)
+        {
+            cursor.store(0);
+        }
+        pHeader->lastReadUs[kConsumerCursor].store(now_us());
+        pHeader->readers.store(1u << kConsumerCursor);
+        pHeader->id.store(id, std::memory_order_release);
+    }
+
+    pthread_mutex_unlock(&m_pState->mutex);
+    return ring;
+}
+
+void OutputRings::release(int ring)
+{
+    lock_state(m_pState);
+    getHeader(ring)->id.store(-1);
+    getHeader(ring)->owner.store(0);
+    pthread_mutex_unlock(&m_pState->mutex);
+}
+
+size_t OutputRings::write(int ring, const char* data, size_t size)
+{
+    auto pHeader = getHeader(ring);
+    auto head = pHeader->head.load(std::memory_order_relaxed);
+
+    // output is dropped once every reader has passed it, with no readers the oldest output is overwritten
+    auto floor = head;
+    auto readers = pHeader->readers.load(std::memory_order_acquire);
+    auto now = now_us();
+    for (int i = 0; readers != 0 && i < kMaxCursors; ++i)
+    {
+        uint32_t bit = 1u << i;
+        if (!(readers & bit))
+        {
+            continue;
+        }
+        if (now - pHeader->lastReadUs[i].load(std::memory_order_relaxed) > m_viewerTimeoutUs)
+        {
+            pHeader->readers.fetch_and(~bit);
+            continue;
+        }
+        floor = std::min(floor, pHeader->cursors[i].load(std::memory_order_acquire));
+    }
+
+    auto n = std::min(size, m_capacity - std::min<uint64_t>(head - floor, m_capacity));
+    auto offset = head % m_capacity;
+    auto first = std::min(n, m_capacity - offset);
+    std::memcpy(getData(ring) + offset, data, first);
+    std::memcpy(getData(ring), data + first, n - first);
+
+    pHeader->head.store(head + n, std::memory_order_release);
+    return n;
+}
+
+void OutputRings::setHasMore(int ring, bool hasMore)
+{
+    getHeader(ring)->hasMore.store(hasMore, std::memory_order_release);
+}
+
+std::string OutputRings::peek(int ring)
+{
+    // called by the writer, so nothing is overwritten meanwhile
+    auto pHeader = getHeader(ring);
+    auto head = pHeader->head.load(std::memory_order_acquire);
+    auto from = pHeader->cursors[kConsumerCursor].load(std::memory_order_acquire);
+    std::string text;
+    copy(ring, std::max(from, head > m_capacity ? head - m_capacity : 0), head, text);
+    return text;
+}
+
+bool OutputRings::read(int id, int cursor, OutputChunk& chunk)
+{
+    auto ring = findRing(id);
+    if (ring < 0 || cursor < 0 || cursor >= kMaxCursors)
+    {
+        return false;
+    }
+
+    auto pHeader = getHeader(ring);
+    uint32_t bit = 1u << cursor;
+    if (cursor != kConsumerCursor && !(pHeader->readers.load(std::memory_order_acquire) & bit))
+    {
+        return false;
+    }
+    pHeader->lastReadUs[cursor].store(now_us(), std::memory_order_relaxed);
+
+    // a consumer that was dropped holds output back again from where it reads, output overwritten meanwhile is
+    // skipped by the copy
+    if (cursor == kConsumerCursor && !(pHeader->readers.load(std::memory_order_acquire) & bit))
+    {
+        pHeader->readers.fetch_or(bit, std::memory_order_acq_rel);
+    }
+
+    // hasMore is read first, when it is false the head already includes all output
+    chunk.hasMore = pHeader->hasMore.load(std::memory_order_acquire);
+    auto head = pHeader->head.load(std::memory_order_acquire);
+
+    // readers of the same cursor take turns by moving it with compare-exchange
+    auto& position = pHeader->cursors[cursor];
+    auto from = position.load(std::memory_order_acquire);
+    while (true)
+    {
+        // another reader may have moved the cursor past the head seen here
+        head = std::max(head, from);
+        copyValid(ring, from, head, chunk.text);
+        if (position.compare_exchange_weak(from, head, std::memory_order_acq_rel))
+        {
+            break;
+        }
+    }
+    chunk.offset = head;
+
+    // the ring was taken over by another chat while it was read
+    return pHeader->id.load(std::memory_order_acquire) == id;
+}
+
+bool OutputRings::readFrom(int id, uint64_t offset, OutputChunk& chunk)
+{
+    auto ring = findRing(id);
+    if (ring < 0)
+    {
+        return false;
+    }
+
+    auto pHeader = getHeader(ring);
+    chunk.hasMore = pHeader->hasMore.load(std::memory_order_acquire);
+    chunk.offset = pHeader->head.load(std::memory_order_acquire);
+    copyValid(ring, std::min(offset, chunk.offset), chunk.offset, chunk.text);
+
+    return pHeader->id.load(std::memory_order_acquire) == id;
+}
+
+int OutputRings::addViewer(int id, uint64_t& offset)
+{
+    auto ring = findRing(id);
+    if (ring < 0)
+    {
+        return -1;
+    }
+
+    // the cursor is set before the writer can see the bit, so it never waits for a stale position
+    lock_state(m_pState);
+    auto pHeader = getHeader(ring);
+    int viewer = -1;
+    auto readers = pHeader->readers.load();
+    for (int i = 1; i < kMaxCursors && viewer < 0; ++i)
+    {
+        if (!(readers & (1u << i)))
+        {
+            viewer = i;
+        }
+    }
+    if (viewer > 0)
+    {
+        auto head = pHeader->head.load(std::memory_order_acquire);
+        offset = std::max(pHeader->cursors[kConsumerCursor].load(std::memory_order_acquire),
+                          head > m_capacity ? head - m_capacity : 0);
+        pHeader->cursors[viewer].store(offset);
+        pHeader->lastReadUs[viewer].store(now_us());
+        pHeader->readers.fetch_or(1u << viewer, std::memory_order_release);
+    }
+    pthread_mutex_unlock(&m_pState->mutex);
+
+    return pHeader->id.load(std::memory_order_acquire) == id ? viewer : -1;
+}
+
+void OutputRings::removeViewer(int id, int viewer)
+{
+    auto ring = findRing(id);
+    if (ring >= 0 && viewer > 0 && viewer < kMaxCursors)
+    {
+        getHeader(ring)->readers.fetch_and(~(1u << viewer));
+    }
+}
+
+bool OutputRings::seekViewer(int id, int viewer, uint64_t offset)
+{
+    auto ring = findRing(id);
+    if (ring < 0 || viewer <= 0 || viewer >= kMaxCursors)
+    {
+        return false;
+    }
+
+    auto pHeader = getHeader(ring);
+    if (!(pHeader->readers.load(std::memory_order_acquire) & (1u << viewer)))
+    {
+        return false;
+    }
+
+    auto head = pHeader->head.load(std::memory_order_acquire);
+    pHeader->cursors[viewer].store(std::min(offset, head), std::memory_order_release);
+    return true;
+}
+
+int OutputRings::findRing(int id)
+{
+    for (int ring = 0; ring < m_count; ++ring)
+    {
+        if (getHeader(ring)->id.load(std::memory_order_acquire) == id)
+        {
+            return ring;
+        }
+    }
+
+    return -1;
+}
+
+OutputRingHeader* OutputRings::getHeader(int ring)
+{
+    return reinterpret_cast<OutputRingHeader*>(m_pRings + ring * m_stride);
+}
+
+char* OutputRings::getData(int ring)
+{
+    return m_pRings + ring * m_stride + align(sizeof(OutputRingHeader));
+}
+
+void OutputRings::copy(int ring, uint64_t from, uint64_t to, std::string& text)
+{
+    text.resize(to - from);
+    auto offset = from % m_capacity;
+    auto first = std::min<size_t>(to - from, m_capacity - offset);
+    std::memcpy(&text[0], getData(ring) + offset, first);
+    std::memcpy(&text[0] + first, getData(ring), to - from - first);
+}
+
+uint64_t OutputRings::copyValid(int ring, uint64_t from, uint64_t head, std::string& text)
+{
+    auto begin = std::max(from, head > m_capacity ? head - m_capacity : 0);
+    copy(ring, begin, head, text);
+
+    // the writer could have overwritten the start while it was copied, when a cursor was moved back past the floor
+    // or the output is read without one
+    auto newHead = getHeader(ring)->head.load(std::memory_order_acquire);
+    if (newHead > m_capacity && newHead - m_capacity > begin)
+    {
+        auto overwritten = std::min<size_t>(newHead - m_capacity - begin, text.size());
+        text.erase(0, overwritten);
+        begin += overwritten;
+    }
+
+    return begin;
+}
+
+}
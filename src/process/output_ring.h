@@ -0,0 +1,93 @@
+#pragma once
+
+#ifndef LLAMA_CPP_API_PROCESS_OUTPUT_RING_H
+#define LLAMA_CPP_API_PROCESS_OUTPUT_RING_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace llama_cpp_api
+{
+
+struct OutputRingsState;
+struct OutputRingHeader;
+
+/// Output read from a ring, offsets count bytes the chat has written since it took the ring
+struct OutputChunk
+{
+    std::string text;
+    uint64_t offset;  // offset of the end of text, where the next read starts
+    bool hasMore;
+};
+
+/// Rings the chats write their output to and the server reads it from without asking the runners.
+/// Every ring has a single writer, its runner, and readers with independent cursors: the consumer and registered
+/// viewers. The writer never overwrites output one of them has not read yet, so every viewer sees all of it.
+/// Readers that stop reading are dropped after a timeout, so that they do not stall the chat. The consumer is optional,
+/// a chat read only by viewers or by offset is not held back by it; it holds output back again once it reads
+/// The rings live in a shared anonymous mapping, so they have to be created before runners are forked
+class OutputRings
+{
+public:
+    static constexpr int kMaxCursors = 16;
+    static constexpr int kConsumerCursor = 0; // /update and /interact, the others are viewers
+
+    /// count 0 - no rings, output goes through IPC
+    OutputRings(int count, size_t capacity, uint64_t viewerTimeoutMs);
+    ~OutputRings();
+
+    OutputRings(const OutputRings&) = delete;
+    OutputRings& operator=(const OutputRings&) = delete;
+
+    /// Takes a ring for chat id of the calling process, rings of dead runners are reused. Returns -1 if there is none
+    int acquire(int id);
+
+    /// Frees the ring, called by its writer
+    void release(int ring);
+
+    /// Appends as much of data as the slowest cursor leaves room for, returns the number of bytes written
+    size_t write(int ring, const char* data, size_t size);
+
+    /// Tells the readers whether more output is coming, set after the output it refers to is written
+    void setHasMore(int ring, bool hasMore);
+
+    /// Output the consumer has not read yet, the ring is not changed
+    std::string peek(int ring);
+
+    /// Reads output of chat id past cursor and moves the cursor to its end. Returns false if the chat has no ring or
+    /// the viewer is not registered
+    bool read(int id, int cursor, OutputChunk& chunk);
+
+    /// Reads output of chat id from offset without moving any cursor, output that was overwritten is skipped
+    bool readFrom(int id, uint64_t offset, OutputChunk& chunk);
+
+    /// Registers a viewer of chat id starting at the consumer cursor, returns its cursor or -1
+    int addViewer(int id, uint64_t& offset);
+
+    void removeViewer(int id, int viewer);
+
+    /// Moves a viewer to offset, e.g. to read again what a lost response carried. Returns false if it is not registered
+    bool seekViewer(int id, int viewer, uint64_t offset);
+
+private:
+    int findRing(int id);
+    OutputRingHeader* getHeader(int ring);
+    char* getData(int ring);
+    void copy(int ring, uint64_t from, uint64_t to, std::string& text);
+
+    /// Copies [from, head) and drops its start if the writer overwrote it meanwhile, returns the start
+    uint64_t copyValid(int ring, uint64_t from, uint64_t head, std::string& text);
+
+    OutputRingsState* m_pState = nullptr;
+    char* m_pRings = nullptr;
+    size_t m_mappingSize = 0;
+    size_t m_stride = 0;
+    int m_count;
+    size_t m_capacity;
+    int64_t m_viewerTimeoutUs;
+};
+
+}
+
+#endif // LLAMA_CPP_API_PROCESS_OUTPUT_RING_H
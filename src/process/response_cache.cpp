@@ -0,0 +1,329 @@
+#include "process/response_cache.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <new>
+#include <pthread.h>
+#include <stdexcept>
+#include <sys/mman.h>
+
+namespace llama_cpp_api
+{
+
+static constexpr size_t kAlignment = 64;
+
+struct ResponseCacheKey
+{
+    uint8_t hash[32];
+
+    bool operator==(const ResponseCacheKey& other) const
+    {
+        return std::memcmp(hash, other.hash, sizeof(hash)) == 0;
+    }
+};
+
+struct ResponseCacheState
+{
+    pthread_mutex_t mutex; // taken for every access, entries are copied under it
+    uint64_t clock;        // incremented on every use, the entry with the lowest lastUse is replaced
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t insertions;
+    uint64_t evictions;
+    int entries;
+};
+
+// followed by the state, the input and the reply
+struct ResponseCacheEntry
+{
+    ResponseCacheKey key;
+    uint64_t lastUse; // 0 - free
+    uint32_t stateSize;
+    uint32_t inputSize;
+    uint32_t size;
+};
+
+static size_t align(size_t size)
+{
+    return (size + kAlignment - 1) / kAlignment * kAlignment;
+}
+
+static uint32_t rotr(uint32_t x, int n)
+{
+    return (x >> n) | (x << (32 - n));
+}
+
+// SHA-256 (FIPS 180-4) of the state, a zero byte and the input
+static ResponseCacheKey get_key(const std::string& state, const std::string& input)
+{
+    static constexpr uint32_t k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+    };
+    uint32_t h[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+    auto compress = [&](const uint8_t* block)
+    {
+        uint32_t w[64];
+        for (int i = 0; i < 16; ++i)
+        {
+            w[i] = uint32_t(block[4 * i]) << 24 | uint32_t(block[4 * i + 1]) << 16 | uint32_t(block[4 * i + 2]) << 8 |
+                   uint32_t(block[4 * i + 3]);
+        }
+        for (int i = 16; i < 64; ++i)
+        {
+            auto s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            auto s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        auto a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+        for (int i = 0; i < 64; ++i)
+        {
+            auto t1 = hh + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            auto t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            hh = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+        h[5] += f;
+        h[6] += g;
+        h[7] += hh;
+    };
+
+    uint8_t block[64];
+    size_t used = 0;
+    uint64_t total = 0;
+    auto hash = [&](const char* data, size_t size)
+    {
+        total += size;
+        for (size_t i = 0; i < size; ++i)
+        {
+            block[used++] = static_cast<uint8_t>(data[i]);
+            if (used == sizeof(block))
+            {
+                compress(block);
+                used = 0;
+            }
+        }
+    };
+
+    hash(state.data(), state.size());
+    hash("", 1);
+    hash(input.data(), input.size());
+
+    // padding: a one bit, zeros and the length in bits, big endian
+    uint64_t bits = total * 8;
+    hash("\x80", 1);
+    while (used != 56)
+    {
+        hash("", 1);
+    }
+    char length[8];
+    for (int i = 0; i < 8; ++i)
+    {
+        length[i] = static_cast<char>(bits >> (56 - 8 * i));
+    }
+    hash(length, sizeof(length));
+
+    ResponseCacheKey key;
+    for (int i = 0; i < 8; ++i)
+    {
+        for (int j = 0; j < 4; ++j)
+        {
+            key.hash[4 * i + j] = static_cast<uint8_t>(h[i] >> (24 - 8 * j));
+        }
+    }
+    return key;
+}
+
+static void lock_state(ResponseCacheState* pState)
+{
+    if (pthread_mutex_lock(&pState->mutex) == EOWNERDEAD)
+    {
+        pthread_mutex_consistent(&pState->mutex);
+    }
+}
+
+ResponseCache::ResponseCache(size_t size, size_t entrySize)
+{
+    if (size == 0)
+    {
+        return;
+    }
+
+    m_capacity = std::max(entrySize, sizeof(ResponseCacheEntry)) - sizeof(ResponseCacheEntry);
+    m_stride = align(sizeof(ResponseCacheEntry) + m_capacity);
+    m_count = static_cast<int>(std::max<size_t>(size / m_stride, 1));
+
+    // pages of an entry are only touched once a reply is stored in it
+    m_mappingSize = align(sizeof(ResponseCacheState)) + m_count * m_stride;
+    auto pMemory = mmap(nullptr, m_mappingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (pMemory == MAP_FAILED)
+    {
+        throw std::runtime_error("failed to map response cache");
+    }
+    m_pState = new (pMemory) ResponseCacheState();
+    m_pEntries = static_cast<char*>(pMemory) + align(sizeof(ResponseCacheState));
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&m_pState->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+ResponseCache::~ResponseCache()
+{
+    if (m_pState)
+    {
+        munmap(m_pState, m_mappingSize);
+    }
+}
+
+bool ResponseCache::isEnabled() const
+{
+    return m_pState != nullptr;
+}
+
+bool ResponseCache::find(const std::string& state, const std::string& input, std::string& reply)
+{
+    if (!m_pState)
+    {
+        return false;
+    }
+
+    auto key = get_key(state, input);
+
+    lock_state(m_pState);
+
+    bool found = false;
+    for (int i = 0; i < m_count && !found; ++i)
+    {
+        auto pEntry = getEntry(i);
+        if (pEntry->lastUse != 0 && pEntry->key == key && matches(i, state, input))
+        {
+            pEntry->lastUse = ++m_pState->clock;
+            reply.assign(getData(i) + pEntry->stateSize + pEntry->inputSize, pEntry->size);
+            found = true;
+        }
+    }
+    ++(found ? m_pState->hits : m_pState->misses);
+
+    pthread_mutex_unlock(&m_pState->mutex);
+    return found;
+}
+
+void ResponseCache::insert(const std::string& state, const std::string& input, const std::string& reply)
+{
+    if (!m_pState || state.size() + input.size() + reply.size() > m_capacity)
+    {
+        return;
+    }
+
+    auto key = get_key(state, input);
+
+    lock_state(m_pState);
+
+    // a chat forked from the same state may have stored the reply meanwhile, it is replaced by the same one
+    int entry = -1;
+    for (int i = 0; i < m_count; ++i)
+    {
+        auto pEntry = getEntry(i);
+        if (pEntry->lastUse != 0 && pEntry->key == key && matches(i, state, input))
+        {
+            entry = i;
+            break;
+        }
+        if (entry < 0 || (getEntry(entry)->lastUse != 0 && pEntry->lastUse < getEntry(entry)->lastUse))
+        {
+            entry = i;
+        }
+    }
+
+    auto pEntry = getEntry(entry);
+    if (pEntry->lastUse == 0)
+    {
+        ++m_pState->entries;
+    }
+    else if (!(pEntry->key == key) || !matches(entry, state, input))
+    {
+        ++m_pState->evictions;
+    }
+    pEntry->key = key;
+    pEntry->lastUse = ++m_pState->clock;
+    pEntry->stateSize = static_cast<uint32_t>(state.size());
+    pEntry->inputSize = static_cast<uint32_t>(input.size());
+    pEntry->size = static_cast<uint32_t>(reply.size());
+    auto pData = getData(entry);
+    std::memcpy(pData, state.data(), state.size());
+    std::memcpy(pData + state.size(), input.data(), input.size());
+    std::memcpy(pData + state.size() + input.size(), reply.data(), reply.size());
+    ++m_pState->insertions;
+
+    pthread_mutex_unlock(&m_pState->mutex);
+}
+
+void ResponseCache::appendMetrics(ModelMetrics& metrics)
+{
+    if (!m_pState)
+    {
+        return;
+    }
+
+    lock_state(m_pState);
+    auto hits = m_pState->hits;
+    auto misses = m_pState->misses;
+    auto insertions = m_pState->insertions;
+    auto evictions = m_pState->evictions;
+    auto entries = m_pState->entries;
+    pthread_mutex_unlock(&m_pState->mutex);
+
+    metrics.emplace_back("response_cache_hits", static_cast<double>(hits));
+    metrics.emplace_back("response_cache_misses", static_cast<double>(misses));
+    auto lookups = hits + misses;
+    metrics.emplace_back("response_cache_hit_rate", lookups > 0 ? static_cast<double>(hits) / lookups : 0.0);
+    metrics.emplace_back("response_cache_insertions", static_cast<double>(insertions));
+    metrics.emplace_back("response_cache_evictions", static_cast<double>(evictions));
+    metrics.emplace_back("response_cache_entries", static_cast<double>(entries));
+    metrics.emplace_back("response_cache_capacity", static_cast<double>(m_count));
+}
+
+ResponseCacheEntry* ResponseCache::getEntry(int entry)
+{
+    return reinterpret_cast<ResponseCacheEntry*>(m_pEntries + entry * m_stride);
+}
+
+char* ResponseCache::getData(int entry)
+{
+    return m_pEntries + entry * m_stride + sizeof(ResponseCacheEntry);
+}
+
+bool ResponseCache::matches(int entry, const std::string& state, const std::string& input)
+{
+    auto pEntry = getEntry(entry);
+    auto pData = getData(entry);
+    return pEntry->stateSize == state.size() && pEntry->inputSize == input.size() &&
+           std::memcmp(pData, state.data(), state.size()) == 0 &&
+           std::memcmp(pData + state.size(), input.data(), input.size()) == 0;
+}
+
+}
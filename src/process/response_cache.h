@@ -0,0 +1,62 @@
+#pragma once
+
+#ifndef LLAMA_CPP_API_PROCESS_RESPONSE_CACHE_H
+#define LLAMA_CPP_API_PROCESS_RESPONSE_CACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "model/model.h"
+
+namespace llama_cpp_api
+{
+
+struct ResponseCacheState;
+struct ResponseCacheEntry;
+
+/// Replies of chats keyed by the state of the chat before the input and the input, shared by all runners.
+/// The state covers everything the reply depends on: the evaluated tokens, the sampling parameters and the state of
+/// the random number generator, so a reply found here is the one the chat would generate.
+/// Entries are found by the SHA-256 of the state and the input, and hold both, which are compared on a hit.
+/// Entries have a fixed size and the least recently used one is replaced when the cache is full.
+/// The cache lives in a shared anonymous mapping, so it has to be created before runners are forked
+class ResponseCache
+{
+public:
+    /// size 0 - no cache
+    ResponseCache(size_t size, size_t entrySize);
+    ~ResponseCache();
+
+    ResponseCache(const ResponseCache&) = delete;
+    ResponseCache& operator=(const ResponseCache&) = delete;
+
+    bool isEnabled() const;
+
+    /// Returns false if the reply to input in state is not cached
+    bool find(const std::string& state, const std::string& input, std::string& reply);
+
+    /// Replies that do not fit in an entry along with the state and the input are not cached
+    void insert(const std::string& state, const std::string& input, const std::string& reply);
+
+    /// Appends hit and eviction counts of all runners with response_cache_ prefix
+    void appendMetrics(ModelMetrics& metrics);
+
+private:
+    ResponseCacheEntry* getEntry(int entry);
+    char* getData(int entry);
+
+    /// The entry holds the reply to input in state, not just one with the same hash
+    bool matches(int entry, const std::string& state, const std::string& input);
+
+    ResponseCacheState* m_pState = nullptr;
+    char* m_pEntries = nullptr;
+    size_t m_mappingSize = 0;
+    size_t m_stride = 0;
+    size_t m_capacity = 0; // bytes of state, input and reply an entry holds
+    int m_count = 0;
+};
+
+}
+
+#endif // LLAMA_CPP_API_PROCESS_RESPONSE_CACHE_H
@@ -0,0 +1,427 @@
+#include "process/supervisor.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <iostream>
+#include <poll.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "messages/common.h"
+#include "process/transcript.h"
+
+using namespace std::chrono_literals;
+
+namespace llama_cpp_api
+{
+
+static constexpr uint64_t kPollIntervalMs = 100;
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+// a pidfd refers to the process itself, so unlike its pid it cannot be taken over by a new process once it is reaped;
+// -1 if the kernel does not support pidfds (before 5.3)
+static int open_pidfd(int pid)
+{
+    return static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+}
+
+#ifndef SYS_pidfd_send_signal
+#define SYS_pidfd_send_signal 424
+#endif
+
+// kills the process through its pidfd, so that a process that took over the pid of a reaped one is not hit. Only
+// without a pidfd the pid is signalled
+static void kill_process(int pid, int pidfd)
+{
+    if (pidfd >= 0)
+    {
+        syscall(SYS_pidfd_send_signal, pidfd, SIGKILL, nullptr, 0);
+    }
+    else
+    {
+        kill(pid, SIGKILL);
+    }
+}
+
+static volatile std::sig_atomic_t s_shutdownRequested = 0;
+
+static void handle_sigchld(int)
+{
+    auto savedErrno = errno;
+    while (waitpid(-1, nullptr, WNOHANG) > 0)
+    { }
+    errno = savedErrno;
+}
+
+static void handle_shutdown(int)
+{
+    s_shutdownRequested = 1;
+}
+
+Supervisor::Supervisor(uint64_t requestTimeoutMs, uint64_t generationTimeoutMs)
+    : m_requestTimeoutMs(requestTimeoutMs), m_generationTimeoutMs(generationTimeoutMs)
+{
+    // chats whose parent runner is gone are reparented to the server, so that they are still reaped
+    prctl(PR_SET_CHILD_SUBREAPER, 1);
+}
+
+Supervisor::~Supervisor()
+{
+    m_stopped = true;
+    if (m_pThread)
+    {
+        m_pThread->join();
+    }
+
+    for (const auto& [pid, fd] : m_pidfds)
+    {
+        close(fd);
+    }
+}
+
+void Supervisor::start(const std::vector<int>& rootPids, std::function<void()> onShutdown)
+{
+    m_rootPids = rootPids;
+    m_onShutdown = std::move(onShutdown);
+    for (auto pid : m_rootPids)
+    {
+        if (pid > 0)
+        {
+            openPidfd(pid);
+        }
+    }
+
+    struct sigaction action = {};
+    action.sa_handler = handle_sigchld;
+    action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &action, nullptr);
+
+    action.sa_handler = handle_shutdown;
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+
+    m_pThread = std::make_unique<std::thread>([this]()
+    {
+        watch();
+    });
+}
+
+void Supervisor::killAll()
+{
+    for (auto id : getChatIds())
+    {
+        killProcess(id);
+    }
+
+    for (auto pid : m_rootPids)
+    {
+        if (pid > 0)
+        {
+            killProcess(pid);
+        }
+    }
+}
+
+bool Supervisor::addChat(int id, int parentId)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto alias = m_aliases.find(id);
+        if (alias != m_aliases.end() && alias->second != id)
+        {
+            std::cerr << "Chat " << id << " killed, its id belongs to restored chat " << alias->second << std::endl;
+            auto fd = open_pidfd(id);
+            kill_process(id, fd);
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+            return false;
+        }
+    }
+
+    openPidfd(id);
+    auto transcript = get_transcript_name(id);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto parent = m_chats.find(parentId);
+    if (parent != m_chats.end())
+    {
+        m_chats[id] = ChatInfo{parentId, true, parent->second.priority, parent->second.rootId, transcript};
+    }
+    else
+    {
+        m_chats[id] = ChatInfo{parentId, true, eInteractive, parentId, transcript};
+    }
+
+    return true;
+}
+
+void Supervisor::removeChat(int id)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_chats.erase(id);
+
+    auto it = m_pidfds.find(id);
+    if (it != m_pidfds.end())
+    {
+        close(it->second);
+        m_pidfds.erase(it);
+    }
+}
+
+void Supervisor::setChatPriority(int id, ChatPriority priority)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_chats.find(id);
+    if (it != m_chats.end())
+    {
+        it->second.priority = priority;
+    }
+}
+
+bool Supervisor::reserveChats(int count, int maxChats)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (maxChats > 0)
+    {
+        auto alive = std::count_if(m_chats.begin(), m_chats.end(), [](const auto& chat)
+        {
+            return chat.second.alive;
+        });
+        if (alive + m_reservedChats + count > maxChats)
+        {
+            return false;
+        }
+    }
+
+    m_reservedChats += count;
+    return true;
+}
+
+void Supervisor::releaseChats(int count)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_reservedChats -= count;
+}
+
+std::optional<ChatInfo> Supervisor::findChat(int id)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_chats.find(id);
+    if (it == m_chats.end())
+    {
+        return std::nullopt;
+    }
+
+    return it->second;
+}
+
+std::vector<int> Supervisor::getChatIds()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    std::vector<int> ids;
+    for (const auto& [id, info] : m_chats)
+    {
+        ids.push_back(id);
+    }
+
+    return ids;
+}
+
+std::vector<int> Supervisor::getRootIds()
+{
+    std::vector<int> ids;
+    for (size_t i = 0; i < m_rootPids.size(); ++i)
+    {
+        ids.push_back(i == 0 ? 0 : m_rootPids[i]);
+    }
+
+    return ids;
+}
+
+void Supervisor::addAlias(int oldId, int id)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_aliases[oldId] = id;
+}
+
+void Supervisor::removeAlias(int oldId)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_aliases.erase(oldId);
+}
+
+int Supervisor::resolveId(int id)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_aliases.find(id);
+    return it != m_aliases.end() ? it->second : id;
+}
+
+int Supervisor::getLeastLoadedRoot()
+{
+    std::map<int, int> load;
+    for (auto id : getRootIds())
+    {
+        if (isAlive(id))
+        {
+            load[id] = 0;
+        }
+    }
+    if (load.empty())
+    {
+        return 0;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (const auto& [id, info] : m_chats)
+    {
+        auto it = load.find(info.rootId);
+        if (info.alive && it != load.end())
+        {
+            ++it->second;
+        }
+    }
+
+    return std::min_element(load.begin(), load.end(), [](const auto& a, const auto& b)
+    {
+        return a.second < b.second;
+    })->first;
+}
+
+ipc::buff_t Supervisor::receive(ipc::channel& channel, const std::vector<int>& ids, Deadline deadline)
+{
+    auto timeoutMs = deadline == eRequest ? m_requestTimeoutMs : m_generationTimeoutMs;
+    auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+
+    while (true)
+    {
+        auto buf = channel.recv(kPollIntervalMs);
+        if (!buf.empty())
+        {
+            // drop late replies to requests that timed out earlier, they carry an older sequence number
+            auto senderId = sender_id_in_buffer(buf.data());
+            if (sequence_in_buffer(buf.data()) == message_sequence() &&
+                std::find(ids.begin(), ids.end(), senderId) != ids.end())
+            {
+                return buf;
+            }
+            continue;
+        }
+
+        for (auto id : ids)
+        {
+            if (!isAlive(id))
+            {
+                ++message_sequence();
+                throw RunnerError(503, "Chat " + std::to_string(id) + " died");
+            }
+        }
+
+        if (timeoutMs > 0 && std::chrono::steady_clock::now() > end)
+        {
+            ++message_sequence();
+            throw RunnerError(504, "Timed out waiting for chat");
+        }
+    }
+}
+
+void Supervisor::watch()
+{
+    while (!m_stopped)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(kPollIntervalMs));
+
+        if (s_shutdownRequested)
+        {
+            s_shutdownRequested = 0;
+            if (m_onShutdown)
+            {
+                m_onShutdown();
+            }
+        }
+
+        std::vector<int> dead;
+        for (auto id : getChatIds())
+        {
+            if (!isAlive(id))
+            {
+                dead.push_back(id);
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (auto id : dead)
+        {
+            auto it = m_chats.find(id);
+            if (it != m_chats.end() && it->second.alive)
+            {
+                std::cerr << "Chat " << id << " died" << std::endl;
+                it->second.alive = false;
+            }
+        }
+    }
+}
+
+void Supervisor::openPidfd(int pid)
+{
+    auto fd = open_pidfd(pid);
+    if (fd < 0)
+    {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto [it, inserted] = m_pidfds.emplace(pid, fd);
+    if (!inserted)
+    {
+        close(it->second);
+        it->second = fd;
+    }
+}
+
+void Supervisor::killProcess(int pid)
+{
+    // the pidfd is used under the lock, so that removeChat does not close it meanwhile
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_pidfds.find(pid);
+    kill_process(pid, it != m_pidfds.end() ? it->second : -1);
+}
+
+bool Supervisor::isAlive(int id)
+{
+    if (id == 0)
+    {
+        if (m_rootPids.empty())
+        {
+            return false;
+        }
+        id = m_rootPids[0];
+    }
+
+    // a pidfd becomes readable when the process exits, even if it is not reaped yet
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_pidfds.find(id);
+        if (it != m_pidfds.end())
+        {
+            pollfd pfd = {it->second, POLLIN, 0};
+            return poll(&pfd, 1, 0) == 0;
+        }
+    }
+
+    // dead runners are reaped by their parent runner or by the server, so they disappear
+    return kill(id, 0) == 0 || errno != ESRCH;
+}
+
+}
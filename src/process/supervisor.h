@@ -0,0 +1,163 @@
+#pragma once
+
+#ifndef LLAMA_CPP_API_PROCESS_SUPERVISOR_H
+#define LLAMA_CPP_API_PROCESS_SUPERVISOR_H
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "libipc/ipc.h"
+
+#include "process/admission.h"
+
+namespace llama_cpp_api
+{
+
+/// Thrown when a runner does not reply, carries the HTTP status to report
+class RunnerError : public std::runtime_error
+{
+public:
+    RunnerError(int status, const std::string& message)
+        : std::runtime_error(message), m_status(status)
+    { }
+
+    int getStatus() const
+    {
+        return m_status;
+    }
+
+private:
+    int m_status;
+};
+
+struct ChatInfo
+{
+    int parentId;
+    bool alive;
+    ChatPriority priority;
+    int rootId = 0; // root runner the chat was forked from
+    std::string transcript; // name of the log of the chat in the transcript dir, see get_transcript_name
+};
+
+/// Keeps track of runner processes on the server side: reaps them, detects crashed chats, bounds the time spent
+/// waiting for replies and kills all runners on shutdown
+class Supervisor
+{
+public:
+    enum Deadline
+    {
+        eRequest,    // runner replies right away
+        eGeneration, // runner replies when it finishes generating
+    };
+
+    Supervisor(uint64_t requestTimeoutMs, uint64_t generationTimeoutMs);
+    ~Supervisor();
+
+    /// Installs signal handlers and starts the watchdog thread, onShutdown is called on SIGINT or SIGTERM.
+    /// There is a root runner per NUMA node, the first one has id 0, the others are identified by their pid
+    void start(const std::vector<int>& rootPids, std::function<void()> onShutdown);
+
+    /// Kills all runners, including root
+    void killAll();
+
+    /// Forked chats inherit priority and root of their parent. A chat whose id is the old id of a restored chat is
+    /// killed and false is returned, requests with that id go to the restored chat
+    bool addChat(int id, int parentId);
+    void removeChat(int id);
+    void setChatPriority(int id, ChatPriority priority);
+
+    /// Reserves room for chats about to be forked, returns false if there would be more than maxChats (0 - no limit).
+    /// The reservation is released with releaseChats after the chats are added or the fork failed
+    bool reserveChats(int count, int maxChats);
+    void releaseChats(int count);
+
+    std::optional<ChatInfo> findChat(int id);
+    std::vector<int> getChatIds();
+
+    std::vector<int> getRootIds();
+
+    /// Restored chats get new ids, requests with the ids they had before the restart are redirected, also when a new
+    /// chat gets the same pid. An old id is aliased to -1 while its chat is being restored
+    void addAlias(int oldId, int id);
+    void removeAlias(int oldId);
+    int resolveId(int id);
+
+    /// Returns the live root with the fewest live chats forked from it
+    int getLeastLoadedRoot();
+
+    /// Receives a reply of one of the runners to the last request of the calling thread, throws RunnerError if they
+    /// die or the deadline passes. Requests sent after that get a new sequence number, replies to older ones are dropped
+    ipc::buff_t receive(ipc::channel& channel, const std::vector<int>& ids, Deadline deadline = eRequest);
+
+private:
+    void watch();
+    void openPidfd(int pid);
+    void killProcess(int pid);
+    bool isAlive(int id);
+
+private:
+    uint64_t m_requestTimeoutMs, m_generationTimeoutMs;
+    std::vector<int> m_rootPids;
+
+    std::mutex m_mutex;
+    std::map<int, ChatInfo> m_chats;
+    std::map<int, int> m_aliases;
+    std::map<int, int> m_pidfds; // pid -> pidfd of live and dead runners, until they are removed
+    int m_reservedChats = 0;
+
+    std::function<void()> m_onShutdown;
+    std::atomic<bool> m_stopped = false;
+    std::unique_ptr<std::thread> m_pThread;
+};
+
+/// Reservation of chats made with Supervisor::reserveChats, what is left of it is released at the end of the scope,
+/// also when a runner fails to reply
+class ChatReservation
+{
+public:
+    ChatReservation(Supervisor& supervisor, int count, int maxChats)
+        : m_supervisor(supervisor), m_count(supervisor.reserveChats(count, maxChats) ? count : 0)
+    { }
+
+    ~ChatReservation()
+    {
+        release(m_count);
+    }
+
+    ChatReservation(const ChatReservation&) = delete;
+    ChatReservation& operator=(const ChatReservation&) = delete;
+
+    /// False if there would be more than maxChats
+    explicit operator bool() const
+    {
+        return m_count > 0;
+    }
+
+    /// Releases count of the reserved chats, e.g. once they have been added
+    void release(int count)
+    {
+        count = std::min(count, m_count);
+        if (count > 0)
+        {
+            m_supervisor.releaseChats(count);
+            m_count -= count;
+        }
+    }
+
+private:
+    Supervisor& m_supervisor;
+    int m_count;
+};
+
+}
+
+#endif // LLAMA_CPP_API_PROCESS_SUPERVISOR_H
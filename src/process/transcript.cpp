@@ -0,0 +1,307 @@
+#include "process/transcript.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace llama_cpp_api
+{
+
+static constexpr uint32_t kTranscriptMagic = 0x4e52544c; // "LTRN"
+static constexpr uint32_t kTranscriptVersion = 1;
+
+// a parent reference chain longer than this is a damaged log referencing itself
+static constexpr int kMaxForkDepth = 1024;
+
+std::string get_transcript_name(int pid)
+{
+    // the start time is in clock ticks since boot, the 22nd field, which follows the name in parentheses
+    std::ifstream stat("/proc/" + std::to_string(pid) + "/stat");
+    std::string line;
+    std::getline(stat, line);
+    auto nameEnd = line.rfind(')');
+    if (nameEnd == std::string::npos)
+    {
+        return "";
+    }
+    std::istringstream fields(line.substr(nameEnd + 1));
+    std::string field;
+    uint64_t startTicks = 0;
+    for (int i = 3; i <= 22 && fields >> field; ++i)
+    {
+        if (i == 22)
+        {
+            startTicks = std::stoull(field);
+        }
+    }
+
+    // the boot time makes the name differ from logs of processes that had the pid before a reboot
+    std::ifstream procStat("/proc/stat");
+    uint64_t bootTime = 0;
+    while (std::getline(procStat, line))
+    {
+        if (line.compare(0, 6, "btime ") == 0)
+        {
+            bootTime = std::stoull(line.substr(6));
+            break;
+        }
+    }
+    if (startTicks == 0 || bootTime == 0)
+    {
+        return "";
+    }
+
+    auto startMs = bootTime * 1000 + startTicks * 1000 / sysconf(_SC_CLK_TCK);
+    return std::to_string(pid) + "-" + std::to_string(startMs) + ".log";
+}
+
+template <typename T>
+static void append_pod(std::string& buffer, const T& value)
+{
+    buffer.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <typename T>
+static bool parse_pod(const char*& p, const char* end, T& value)
+{
+    if (end - p < static_cast<ptrdiff_t>(sizeof(value)))
+    {
+        return false;
+    }
+    std::memcpy(&value, p, sizeof(value));
+    p += sizeof(value);
+    return true;
+}
+
+TranscriptWriter::TranscriptWriter(std::string dir)
+    : m_dir(std::move(dir))
+{ }
+
+TranscriptWriter::~TranscriptWriter()
+{
+    if (m_fd >= 0)
+    {
+        close(m_fd);
+    }
+}
+
+std::unique_ptr<TranscriptWriter> TranscriptWriter::fork() const
+{
+    auto pWriter = std::make_unique<TranscriptWriter>(m_dir);
+
+    // a chat that has written nothing passes on its own reference
+    pWriter->m_parentName = m_name.empty() ? m_parentName : m_name;
+    pWriter->m_parentSize = m_name.empty() ? m_parentSize : m_size;
+    return pWriter;
+}
+
+void TranscriptWriter::appendInput(const std::string& text)
+{
+    append(eTranscriptInput, text.data(), text.size());
+}
+
+void TranscriptWriter::appendOutput(const std::string& text)
+{
+    append(eTranscriptOutput, text.data(), text.size());
+}
+
+void TranscriptWriter::endTurn(const ModelTurn& turn)
+{
+    std::string payload;
+    append_pod<uint32_t>(payload, turn.input.size());
+    append_pod<uint32_t>(payload, turn.output.size());
+    payload.append(reinterpret_cast<const char*>(turn.input.data()), turn.input.size() * sizeof(int));
+    payload.append(reinterpret_cast<const char*>(turn.output.data()), turn.output.size() * sizeof(int));
+    append(eTranscriptTurn, payload.data(), payload.size());
+}
+
+void TranscriptWriter::append(TranscriptRecordType type, const char* data, uint32_t size)
+{
+    if (m_dir.empty() || (m_fd < 0 && !open()))
+    {
+        return;
+    }
+
+    // a record is a single write, so readers never see half of it unless the disk is full
+    std::string record;
+    record.reserve(sizeof(uint8_t) + sizeof(uint32_t) + size);
+    append_pod<uint8_t>(record, type);
+    append_pod<uint32_t>(record, size);
+    record.append(data, size);
+
+    if (write(m_fd, record.data(), record.size()) != static_cast<ssize_t>(record.size()))
+    {
+        fprintf(stderr, "warning: failed to write transcript %s/%s, it is not written anymore\n", m_dir.c_str(),
+                m_name.c_str());
+        close(m_fd);
+        m_fd = -1;
+        m_dir.clear();
+        return;
+    }
+    m_size += record.size();
+}
+
+bool TranscriptWriter::open()
+{
+    std::error_code error;
+    std::filesystem::create_directories(m_dir, error);
+
+    // ids are process ids, which are reused, so the log has a name of its own that the server and forks of the chat
+    // refer to
+    m_name = get_transcript_name(getpid());
+    auto path = m_dir + "/" + m_name;
+
+    m_fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0644);
+    if (m_fd < 0)
+    {
+        fprintf(stderr, "warning: failed to create transcript %s\n", path.c_str());
+        m_name.clear();
+        m_dir.clear();
+        return false;
+    }
+
+    std::string header;
+    append_pod(header, kTranscriptMagic);
+    append_pod(header, kTranscriptVersion);
+    append_pod<uint32_t>(header, m_parentName.size());
+    header += m_parentName;
+    append_pod<uint64_t>(header, m_parentSize);
+    if (write(m_fd, header.data(), header.size()) != static_cast<ssize_t>(header.size()))
+    {
+        fprintf(stderr, "warning: failed to write transcript %s\n", path.c_str());
+        close(m_fd);
+        m_fd = -1;
+        m_dir.clear();
+        return false;
+    }
+    m_size = header.size();
+    return true;
+}
+
+TranscriptReader::TranscriptReader(const std::string& dir, const std::string& name)
+{
+    m_turnOffsets.push_back(0);
+    try
+    {
+        map(dir + "/" + name, UINT64_MAX, 0);
+    }
+    catch (...)
+    {
+        for (auto [pMemory, size] : m_mappings)
+        {
+            munmap(pMemory, size);
+        }
+        throw;
+    }
+}
+
+TranscriptReader::~TranscriptReader()
+{
+    for (auto [pMemory, size] : m_mappings)
+    {
+        munmap(pMemory, size);
+    }
+}
+
+uint64_t TranscriptReader::getSize() const
+{
+    return m_size;
+}
+
+size_t TranscriptReader::getTurnCount() const
+{
+    // the last offset is where the next turn starts, unless it has started already
+    return m_turnOffsets.back() < m_size ? m_turnOffsets.size() : m_turnOffsets.size() - 1;
+}
+
+uint64_t TranscriptReader::getTurnOffset(size_t turn) const
+{
+    return turn < m_turnOffsets.size() ? m_turnOffsets[turn] : m_size;
+}
+
+const std::vector<TranscriptReader::Record>& TranscriptReader::getRecords() const
+{
+    return m_records;
+}
+
+void TranscriptReader::map(const std::string& path, uint64_t limit, int depth)
+{
+    if (depth > kMaxForkDepth)
+    {
+        throw std::runtime_error("transcript references itself");
+    }
+
+    auto fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        throw std::runtime_error(depth == 0 ? "Chat has no transcript" : "Transcript of a parent chat is missing");
+    }
+
+    struct stat st;
+    auto pMemory = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        pMemory = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (pMemory == MAP_FAILED)
+    {
+        throw std::runtime_error("failed to map transcript " + path);
+    }
+    m_mappings.emplace_back(pMemory, st.st_size);
+
+    auto p = static_cast<const char*>(pMemory);
+    auto end = p + std::min<uint64_t>(st.st_size, limit);
+
+    uint32_t magic = 0, version = 0, nameSize = 0;
+    if (!parse_pod(p, end, magic) || !parse_pod(p, end, version) || magic != kTranscriptMagic ||
+        version != kTranscriptVersion || !parse_pod(p, end, nameSize) || end - p < nameSize)
+    {
+        throw std::runtime_error("not a transcript: " + path);
+    }
+    std::string parentName(p, nameSize);
+    p += nameSize;
+    uint64_t parentSize = 0;
+    if (!parse_pod(p, end, parentSize))
+    {
+        throw std::runtime_error("not a transcript: " + path);
+    }
+
+    if (!parentName.empty())
+    {
+        map(std::filesystem::path(path).parent_path().string() + "/" + parentName, parentSize, depth + 1);
+    }
+
+    // a record that is cut off is still being written
+    while (true)
+    {
+        uint8_t type;
+        uint32_t size;
+        if (!parse_pod(p, end, type) || !parse_pod(p, end, size) || end - p < size)
+        {
+            break;
+        }
+
+        Record record{static_cast<TranscriptRecordType>(type), p, size, m_size};
+        p += size;
+        m_records.push_back(record);
+
+        if (type == eTranscriptTurn)
+        {
+            m_turnOffsets.push_back(m_size);
+        }
+        else
+        {
+            m_size += size;
+        }
+    }
+}
+
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#ifndef LLAMA_CPP_API_PROCESS_TRANSCRIPT_H
+#define LLAMA_CPP_API_PROCESS_TRANSCRIPT_H
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "model/subscriber.h"
+
+namespace llama_cpp_api
+{
+
+enum TranscriptRecordType : uint8_t
+{
+    eTranscriptInput = 1,
+    eTranscriptOutput = 2,
+    eTranscriptTurn = 3, // end of a turn: input and output token ids
+};
+
+/// Name of the log of the chat run by process pid: <pid>-<start time in ms>.log, so that a chat that gets the pid of
+/// a deleted chat does not take over its log. Empty if the process is gone
+std::string get_transcript_name(int pid);
+
+/// Appends inputs and outputs of a chat to its log in dir, the log is created on the first append and named by
+/// get_transcript_name of the calling process. The log of a forked chat starts with a reference to the log of its
+/// parent and the size it had at the fork, so the common start of the chats is stored once
+class TranscriptWriter
+{
+public:
+    /// dir empty - nothing is written
+    explicit TranscriptWriter(std::string dir);
+    ~TranscriptWriter();
+
+    TranscriptWriter(const TranscriptWriter&) = delete;
+    TranscriptWriter& operator=(const TranscriptWriter&) = delete;
+
+    /// Writer of the chat forked from this chat, called in the forked process
+    std::unique_ptr<TranscriptWriter> fork() const;
+
+    void appendInput(const std::string& text);
+    void appendOutput(const std::string& text);
+    void endTurn(const ModelTurn& turn);
+
+private:
+    void append(TranscriptRecordType type, const char* data, uint32_t size);
+    bool open();
+
+    std::string m_dir;
+    std::string m_name;       // unique name of the log in dir, empty until it is created
+    std::string m_parentName; // log of the parent, empty - none
+    uint64_t m_parentSize = 0;
+    int m_fd = -1;
+    uint64_t m_size = 0;
+};
+
+/// Log of a chat with the logs it references, mapped into memory
+class TranscriptReader
+{
+public:
+    struct Record
+    {
+        TranscriptRecordType type;
+        const char* data;
+        uint32_t size;
+        uint64_t offset; // offset of the text of input and output records in the text of the chat
+    };
+
+    /// Reads log name in dir, throws if it does not exist
+    TranscriptReader(const std::string& dir, const std::string& name);
+    ~TranscriptReader();
+
+    TranscriptReader(const TranscriptReader&) = delete;
+    TranscriptReader& operator=(const TranscriptReader&) = delete;
+
+    /// Bytes of input and output text
+    uint64_t getSize() const;
+
+    /// Turns, including one that has not ended yet
+    size_t getTurnCount() const;
+
+    /// Text offset where a turn starts, turn == getTurnCount() - the end of the text
+    uint64_t getTurnOffset(size_t turn) const;
+
+    /// Calls write with pieces of the text in [from, to) that point into the mappings, stops when it returns false
+    template <typename WriteFunction>
+    bool writeText(uint64_t from, uint64_t to, WriteFunction write) const
+    {
+        for (const auto& record : m_records)
+        {
+            if (record.type == eTranscriptTurn || record.offset + record.size <= from)
+            {
+                continue;
+            }
+            if (record.offset >= to)
+            {
+                break;
+            }
+
+            auto begin = std::max(from, record.offset);
+            auto end = std::min<uint64_t>(to, record.offset + record.size);
+            if (!write(record.data + (begin - record.offset), end - begin))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    const std::vector<Record>& getRecords() const;
+
+private:
+    void map(const std::string& path, uint64_t limit, int depth);
+
+    std::vector<std::pair<void*, size_t>> m_mappings;
+    std::vector<Record> m_records;
+    std::vector<uint64_t> m_turnOffsets;
+    uint64_t m_size = 0;
+};
+
+}
+
+#endif // LLAMA_CPP_API_PROCESS_TRANSCRIPT_H